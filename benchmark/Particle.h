@@ -0,0 +1,185 @@
+/**
+ * @brief Minimal POSIX replacement for Particle.h, for building SequentialFileRK on a host computer
+ * 
+ * Only what SequentialFileRK uses is implemented: String, Logger, mutexes, semaphores, threads,
+ * millis(), micros(), and delay(). Logging is discarded. This is only for the benchmark and 
+ * is not used by device builds.
+ */
+#ifndef __PARTICLE_H_HOST_SHIM
+#define __PARTICLE_H_HOST_SHIM
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+typedef uint32_t system_tick_t;
+
+/**
+ * @brief Subset of the Wiring String class, backed by std::string
+ */
+class String {
+public:
+    String() {}
+    String(const char *s) : s(s ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    String(int value) : s(std::to_string(value)) {}
+
+    const char *c_str() const { return s.c_str(); }
+    operator const char *() const { return s.c_str(); }
+    unsigned length() const { return s.length(); }
+    bool reserve(unsigned size) { s.reserve(size); return true; }
+
+    bool startsWith(const String &other) const { return s.compare(0, other.s.size(), other.s) == 0; }
+    bool endsWith(const String &other) const { 
+        return s.size() >= other.s.size() && s.compare(s.size() - other.s.size(), other.s.size(), other.s) == 0; 
+    }
+    String substring(unsigned from) const { return s.substr(from); }
+    String substring(unsigned from, unsigned to) const { return s.substr(from, to - from); }
+    int indexOf(char c) const { size_t pos = s.find(c); return (pos == std::string::npos) ? -1 : (int)pos; }
+    char charAt(unsigned index) const { return s[index]; }
+    long toInt() const { return atol(s.c_str()); }
+
+    bool equals(const char *other) const { return s == other; }
+    bool equals(const String &other) const { return s == other.s; }
+    bool operator==(const char *other) const { return s == other; }
+    bool operator==(const String &other) const { return s == other.s; }
+    bool operator!=(const String &other) const { return s != other.s; }
+
+    String &operator+=(const String &other) { s += other.s; return *this; }
+    String &operator+=(const char *other) { s += other; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+    friend String operator+(const String &a, const char *b) { return String(a.s + b); }
+
+    static String format(const char *fmt, ...) {
+        char buf[256];
+        va_list ap; 
+        va_start(ap, fmt); 
+        vsnprintf(buf, sizeof(buf), fmt, ap); 
+        va_end(ap);
+        return String(buf);
+    }
+
+private:
+    std::string s;
+};
+
+/**
+ * @brief Logger that discards all messages, so logging does not affect the measurements
+ */
+class Logger {
+public:
+    explicit Logger(const char *name) {}
+    void trace(const char *fmt, ...) const {}
+    void info(const char *fmt, ...) const {}
+    void warn(const char *fmt, ...) const {}
+    void error(const char *fmt, ...) const {}
+};
+
+typedef pthread_mutex_t *os_mutex_t;
+
+inline int os_mutex_create(os_mutex_t *mutex) { *mutex = new pthread_mutex_t; return pthread_mutex_init(*mutex, NULL); }
+inline int os_mutex_destroy(os_mutex_t mutex) { pthread_mutex_destroy(mutex); delete mutex; return 0; }
+inline int os_mutex_lock(os_mutex_t mutex) { return pthread_mutex_lock(mutex); }
+inline int os_mutex_unlock(os_mutex_t mutex) { return pthread_mutex_unlock(mutex); }
+
+#define CONCURRENT_WAIT_FOREVER ((system_tick_t)-1)
+
+/**
+ * @brief Counting semaphore with a maximum count, like a FreeRTOS semaphore
+ */
+struct os_semaphore_host {
+    sem_t sem;
+    int maxCount;
+    pthread_mutex_t mutex;
+};
+typedef os_semaphore_host *os_semaphore_t;
+
+inline int os_semaphore_create(os_semaphore_t *semaphore, unsigned maxCount, unsigned initial) { 
+    *semaphore = new os_semaphore_host;
+    (*semaphore)->maxCount = maxCount;
+    pthread_mutex_init(&(*semaphore)->mutex, NULL);
+    return sem_init(&(*semaphore)->sem, 0, initial);
+}
+inline int os_semaphore_destroy(os_semaphore_t semaphore) { 
+    sem_destroy(&semaphore->sem); 
+    pthread_mutex_destroy(&semaphore->mutex);
+    delete semaphore; 
+    return 0; 
+}
+inline int os_semaphore_give(os_semaphore_t semaphore, bool reserved) { 
+    // Giving a semaphore that's already at its maximum count fails, like FreeRTOS
+    int result = 1;
+    int value;
+    pthread_mutex_lock(&semaphore->mutex); 
+    sem_getvalue(&semaphore->sem, &value);
+    if (value < semaphore->maxCount) {
+        result = sem_post(&semaphore->sem);
+    }
+    pthread_mutex_unlock(&semaphore->mutex);
+    return result;
+}
+inline int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved) {
+    if (timeout == CONCURRENT_WAIT_FOREVER) {
+        return sem_wait(&semaphore->sem);
+    }
+    if (timeout == 0) {
+        return (sem_trywait(&semaphore->sem) == 0) ? 0 : 1;
+    }
+    struct timespec ts; 
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000; 
+    ts.tv_nsec += (timeout % 1000) * 1000000; 
+    if (ts.tv_nsec >= 1000000000) { 
+        ts.tv_sec++; 
+        ts.tv_nsec -= 1000000000; 
+    }
+    return (sem_timedwait(&semaphore->sem, &ts) == 0) ? 0 : 1;
+}
+
+typedef pthread_t os_thread_t;
+typedef int os_thread_prio_t;
+typedef void (*os_thread_fn_t)(void *param);
+
+#define OS_THREAD_PRIORITY_DEFAULT 2
+
+struct os_thread_host_start {
+    os_thread_fn_t fn;
+    void *param;
+};
+inline void *os_thread_host_entry(void *param) { 
+    os_thread_host_start start = *(os_thread_host_start *)param; 
+    delete (os_thread_host_start *)param; 
+    start.fn(start.param); 
+    return NULL; 
+}
+inline int os_thread_create(os_thread_t *thread, const char *name, os_thread_prio_t priority, os_thread_fn_t fn, void *param, size_t stackSize) {
+    // Priority and stack size are ignored
+    return pthread_create(thread, NULL, os_thread_host_entry, new os_thread_host_start{fn, param});
+}
+inline int os_thread_exit(void *thread) { pthread_exit(NULL); return 0; }
+inline int os_thread_join(os_thread_t thread) { return pthread_join(thread, NULL); }
+
+inline system_tick_t millis() { 
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return (system_tick_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000); 
+}
+inline unsigned long micros() { 
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return (unsigned long)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000); 
+}
+inline void delay(unsigned ms) { usleep(ms * 1000); }
+
+#endif /* __PARTICLE_H_HOST_SHIM */
@@ -0,0 +1,261 @@
+/**
+ * @brief Host benchmark and stress test for SequentialFileRK
+ *
+ * Builds SequentialFileRK.cpp against the POSIX Particle.h in this directory and measures:
+ *
+ * - scanDir() time against the number of files in the queue directory
+ * - reserveFile(), addFileToQueue(), getFileFromQueue() throughput with 1 to 4 producer
+ *   and consumer threads
+ * - removeFileNum() cost against the number of files in the queue directory
+ *
+ * Usage: ./bench [-q] [dir]
+ *
+ * -q runs smaller sizes for a quick check. dir is the scratch directory (default:
+ * /tmp/seqfile-bench); it's deleted and recreated. Results depend heavily on the host file
+ * system, so compare runs on the same machine, not against numbers from the device.
+ */
+#include "SequentialFileRK.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static String benchDir = "/tmp/seqfile-bench";
+static bool quick = false;
+
+static uint64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void removeTree(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir) {
+        while(true) {
+            struct dirent *ent = readdir(dir);
+            if (!ent) {
+                break;
+            }
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            String entPath = String(path) + String("/") + ent->d_name;
+            if (ent->d_type == DT_DIR) {
+                removeTree(entPath);
+            }
+            else {
+                unlink(entPath);
+            }
+        }
+        closedir(dir);
+        rmdir(path);
+    }
+}
+
+static void createEmptyFile(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/**
+ * @brief Creates numFiles empty queue files, numbered from 1, without using the library
+ */
+static void createQueueFiles(SequentialFile &sequentialFile, int numFiles) {
+    for(int fileNum = 1; fileNum <= numFiles; fileNum++) {
+        if (sequentialFile.getShardSize() > 0 && (fileNum == 1 || (fileNum % sequentialFile.getShardSize()) == 0)) {
+            mkdir(sequentialFile.getShardPath(sequentialFile.getShardForFileNum(fileNum)), 0777);
+        }
+        createEmptyFile(sequentialFile.getPathForFileNum(fileNum));
+    }
+}
+
+static void benchScanDir() {
+    const int sizes[] = { 1000, 10000, 50000 };
+
+    printf("\nscanDir()\n");
+    printf("%8s %12s %12s %14s %14s\n", "files", "flat ms", "sharded ms", "index build ms", "index load ms");
+
+    for(size_t ii = 0; ii < sizeof(sizes) / sizeof(sizes[0]); ii++) {
+        int numFiles = quick ? sizes[ii] / 10 : sizes[ii];
+        double results[4];
+
+        for(int variant = 0; variant < 3; variant++) {
+            removeTree(benchDir);
+            {
+                SequentialFile sequentialFile;
+                sequentialFile.withDirPath(benchDir);
+                if (variant == 1) {
+                    sequentialFile.withShardSize(1000);
+                }
+                mkdir(benchDir, 0777);
+                createQueueFiles(sequentialFile, numFiles);
+            }
+
+            SequentialFile sequentialFile;
+            sequentialFile.withDirPath(benchDir);
+            if (variant == 1) {
+                sequentialFile.withShardSize(1000);
+            }
+            if (variant == 2) {
+                sequentialFile.withIndexFile();
+            }
+
+            uint64_t startUs = nowUs();
+            sequentialFile.scanDir();
+            results[variant] = (nowUs() - startUs) / 1000.0;
+
+            if (sequentialFile.getQueueLen() != numFiles) {
+                printf("error: queue has %d files, expected %d\n", sequentialFile.getQueueLen(), numFiles);
+            }
+
+            if (variant == 2) {
+                // The second scan loads the index written by the first
+                SequentialFile indexedFile;
+                indexedFile.withDirPath(benchDir).withIndexFile();
+
+                startUs = nowUs();
+                indexedFile.scanDir();
+                results[3] = (nowUs() - startUs) / 1000.0;
+            }
+        }
+
+        printf("%8d %12.1f %12.1f %14.1f %14.1f\n", numFiles, results[0], results[1], results[2], results[3]);
+    }
+}
+
+/**
+ * @brief Runs numThreads producers and numThreads consumers, each producer adding opsPerThread files
+ *
+ * The files are not created, so this measures the queue itself, not the file system.
+ * 
+ * @return Files per second received by the consumers
+ */
+static double runThroughput(SequentialFileQueue *queue, int numThreads, int opsPerThread) {
+    removeTree(benchDir);
+
+    SequentialFile sequentialFile;
+    sequentialFile.withDirPath(benchDir).withQueue(queue);
+    sequentialFile.scanDir();
+
+    std::atomic<int> producersDone(0);
+    std::atomic<int> received(0);
+    std::vector<std::thread> threads;
+
+    uint64_t startUs = nowUs();
+
+    for(int ii = 0; ii < numThreads; ii++) {
+        threads.push_back(std::thread([&]() {
+            for(int jj = 0; jj < opsPerThread; jj++) {
+                sequentialFile.addFileToQueue(sequentialFile.reserveFile());
+            }
+            producersDone++;
+        }));
+        threads.push_back(std::thread([&]() {
+            while(producersDone < numThreads || sequentialFile.getQueueLen() > 0) {
+                if (sequentialFile.waitFileFromQueue(10) != 0) {
+                    received++;
+                }
+            }
+        }));
+    }
+    for(auto it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+
+    double seconds = (nowUs() - startUs) / 1000000.0;
+
+    if (received != numThreads * opsPerThread) {
+        // A fixed-size container was full
+        printf("note: %d of %d files were not queued\n", numThreads * opsPerThread - received, numThreads * opsPerThread);
+    }
+    return received / seconds;
+}
+
+static void benchThroughput() {
+    int opsPerThread = quick ? 20000 : 200000;
+
+    printf("\nreserveFile() + addFileToQueue() + waitFileFromQueue(), files per second\n");
+    printf("%8s %14s %14s\n", "threads", "deque", "run queue");
+
+    for(int numThreads = 1; numThreads <= 4; numThreads++) {
+        SequentialFileRunQueue runQueue(64);
+
+        double dequeRate = runThroughput(NULL, numThreads, opsPerThread);
+        double runRate = runThroughput(&runQueue, numThreads, opsPerThread);
+
+        printf("%8d %14.0f %14.0f\n", numThreads, dequeRate, runRate);
+    }
+
+    // The lock-free container only supports one producer and one consumer. It's large enough 
+    // for all of the files, since a full container drops files instead of blocking the producer.
+    SequentialFileSpscQueue spscQueue(opsPerThread);
+    printf("%8s %14s %14.0f (SequentialFileSpscQueue, 1 producer, 1 consumer)\n", "1", "",
+        runThroughput(&spscQueue, 1, opsPerThread));
+}
+
+/**
+ * @brief Times removeFileNum() for numRemove files in a directory of numFiles files
+ */
+static double runRemove(int numFiles, int numRemove, bool allExtensions, bool sidecar) {
+    removeTree(benchDir);
+    mkdir(benchDir, 0777);
+
+    SequentialFile sequentialFile;
+    sequentialFile.withDirPath(benchDir);
+    if (sidecar) {
+        sequentialFile.withSidecarExtension("sha1");
+    }
+    createQueueFiles(sequentialFile, numFiles);
+    sequentialFile.scanDir();
+
+    uint64_t startUs = nowUs();
+    for(int fileNum = 1; fileNum <= numRemove; fileNum++) {
+        sequentialFile.removeFileNum(fileNum, allExtensions);
+    }
+    return (double)(nowUs() - startUs) / numRemove;
+}
+
+static void benchRemove() {
+    const int sizes[] = { 1000, 10000 };
+    int numRemove = quick ? 50 : 200;
+
+    printf("\nremoveFileNum(), microseconds per file\n");
+    printf("%8s %14s %14s %14s\n", "files", "false", "true", "true, sidecar");
+
+    for(size_t ii = 0; ii < sizeof(sizes) / sizeof(sizes[0]); ii++) {
+        int numFiles = quick ? sizes[ii] / 10 : sizes[ii];
+
+        double noExtUs = runRemove(numFiles, numRemove, false, false);
+        double allExtUs = runRemove(numFiles, numRemove, true, false);
+        double sidecarUs = runRemove(numFiles, numRemove, true, true);
+
+        printf("%8d %14.1f %14.1f %14.1f\n", numFiles, noExtUs, allExtUs, sidecarUs);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    for(int ii = 1; ii < argc; ii++) {
+        if (strcmp(argv[ii], "-q") == 0) {
+            quick = true;
+        }
+        else {
+            benchDir = argv[ii];
+        }
+    }
+
+    printf("SequentialFileRK benchmark in %s%s\n", benchDir.c_str(), quick ? " (quick)" : "");
+
+    benchScanDir();
+    benchThroughput();
+    benchRemove();
+
+    removeTree(benchDir);
+    return 0;
+}
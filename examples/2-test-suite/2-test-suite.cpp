@@ -1,4 +1,5 @@
 #include "SequentialFileRK.h"
+#include "SequentialSegmentFileRK.h"
 
 #include <dirent.h>
 #include <fcntl.h>
@@ -82,6 +83,11 @@ int testHandler(String param) {
         }
     }
     else
+    if (cmd.equals("index")) {
+        // index 1 to enable the index file, index 0 to disable it
+        sequentialFile.withIndexFile(arg.toInt() != 0).scanDir();
+    }
+    else
     if (cmd.equals("ext")) {
         sequentialFile.withFilenameExtension(arg).scanDir();
     }
@@ -90,7 +96,16 @@ int testHandler(String param) {
         int fileNum = sequentialFile.reserveFile();
         Log.info("reserveFile returned %d", fileNum);
     }
-    else 
+    else
+    if (cmd.equals("reservebad")) {
+        // reserveFiles() with a count less than 1 must fail without using up or reusing file numbers
+        int before = sequentialFile.reserveFile();
+        bool passed = sequentialFile.reserveFiles(0) == 0 && sequentialFile.reserveFiles(-3) == 0;
+        int after = sequentialFile.reserveFile();
+        passed = passed && before != 0 && after == before + 1;
+        Log.info("reservebad %s", passed ? "passed" : "failed");
+    }
+    else
     if (cmd.equals("create")) {
         int fileNum = arg.toInt();
         if (fileNum != 0) {
@@ -121,6 +136,86 @@ int testHandler(String param) {
         }
     }
     else
+    if (cmd.equals("write")) {
+        // Write a file of arg bytes in small pieces using a Writer and queue it
+        int size = arg.toInt();
+        SequentialFile::Writer writer(sequentialFile);
+        if (writer.begin()) {
+            for(int ii = 0; ii < size; ii++) {
+                char c = 'A' + (ii % 26);
+                writer.write(&c, 1);
+            }
+            Log.info("writer commit %d returned %d", writer.getFileNum(), writer.commit());
+        }
+    }
+    else
+    if (cmd.equals("writefail")) {
+        // A Writer that fails to create its file must not keep its shard directory from being removed
+        SequentialFile shardFile;
+        shardFile.withDirPath("/usr/seqtest3").withShardSize(4);
+        shardFile.removeAll(false);
+        shardFile.scanDir();
+
+        SequentialFile::Writer writer(shardFile);
+        // A directory where the file would be created makes open() fail
+        int fileNum = shardFile.reserveFile();
+        String blockerPath = shardFile.getPathForFileNum(fileNum);
+        mkdir(blockerPath, 0777);
+        int badFileNum = writer.beginReserved(fileNum);
+        rmdir(blockerPath);
+
+        for(int ii = 0; ii < 9; ii++) {
+            if (writer.begin()) {
+                writer.write("x", 1);
+                writer.commit();
+            }
+        }
+
+        while((fileNum = shardFile.getFileFromQueue()) != 0) {
+            shardFile.removeFileNum(fileNum, true);
+        }
+
+        // Shard 2 holds the last file number, so it stays
+        struct stat sb;
+        bool passed = (badFileNum == 0);
+        for(int shard = 0; shard < 2; shard++) {
+            if (stat(shardFile.getShardPath(shard), &sb) == 0) {
+                Log.info("shard %d was not removed", shard);
+                passed = false;
+            }
+        }
+        Log.info("writefail %s", passed ? "passed" : "failed");
+        shardFile.removeAll(true);
+    }
+    else
+    if (cmd.equals("segack")) {
+        // Acknowledging one record twice must not delete a segment with a record that is not acknowledged
+        SequentialSegmentFile segmentFile;
+        segmentFile.withDirPath("/usr/seqtest4");
+        segmentFile.removeAll(false);
+        segmentFile.scanDir();
+
+        segmentFile.addRecord("first", 5);
+        segmentFile.addRecord("second", 6);
+        // Starts a new segment, so the first segment can be fully read
+        segmentFile.withSegmentSize(16).addRecord("third", 5);
+
+        SequentialSegmentRecord first, second;
+        char buf[16];
+        segmentFile.getRecordFromQueue(first, buf, sizeof(buf));
+        segmentFile.getRecordFromQueue(second, buf, sizeof(buf));
+
+        segmentFile.ackRecord(first);
+        segmentFile.ackRecord(first);
+
+        SequentialSegmentRecord third;
+        segmentFile.getRecordFromQueue(third, buf, sizeof(buf));
+
+        bool passed = (first.segment == second.segment) && segmentFile.readRecord(second, buf, sizeof(buf));
+        Log.info("segack %s", passed ? "passed" : "failed");
+        segmentFile.removeAll(true);
+    }
+    else
     if (cmd.equals("add")) {
         int fileNum = arg.toInt();
         if (fileNum != 0) {
@@ -135,6 +230,29 @@ int testHandler(String param) {
         int fileNum = sequentialFile.getFileFromQueue();
         Log.info("getFileFromQueue returned %d", fileNum);
     }
+    else
+    if (cmd.equals("read")) {
+        // Read all queued files using a Reader. The files that were read stay on disk, but
+        // are no longer in the queue until the next scan; stop() only returns unfinished files.
+        SequentialFile::Reader reader(sequentialFile);
+        reader.start();
+
+        SequentialFile::Reader::Chunk chunk;
+        while(reader.readChunk(chunk, 500)) {
+            Log.info("file %d offset %u len %u last %d", chunk.fileNum, chunk.offset, chunk.len, chunk.lastChunk);
+            reader.releaseChunk();
+        }
+        reader.stop();
+    }
+    else
+    if (cmd.equals("batch")) {
+        // Get up to 16 files from the queue at once
+        int fileNums[16];
+        size_t count = sequentialFile.getFilesFromQueue(fileNums, sizeof(fileNums) / sizeof(fileNums[0]));
+        for(size_t ii = 0; ii < count; ii++) {
+            Log.info("getFilesFromQueue returned %d", fileNums[ii]);
+        }
+    }
     else 
     if (cmd.equals("rm")) {
         int fileNum = arg.toInt();
@@ -156,6 +274,35 @@ int testHandler(String param) {
         }
     }
     else 
+    if (cmd.equals("rmsidecar")) {
+        // Like rm2, but the sidecar extension is known, so the directory is not read
+        int fileNum = arg.toInt();
+        if (fileNum != 0) {
+            SequentialFile sidecarFile;
+            sidecarFile
+                .withDirPath(sequentialFile.getDirPath())
+                .withFilenameExtension("jpg")
+                .withSidecarExtension("sha1");
+            sidecarFile.removeFileNum(fileNum, true);
+        }
+        else {
+            Log.info("arg required (fileNum)");
+        }
+    }
+    else 
+    if (cmd.equals("rmrange")) {
+        // rmrange <from> <to> removes a range of files, all extensions
+        int toIndex = arg.indexOf(' ');
+        int fromFileNum = arg.toInt();
+        int toFileNum = (toIndex > 0) ? arg.substring(toIndex + 1).toInt() : 0;
+        if (fromFileNum != 0 && toFileNum >= fromFileNum) {
+            sequentialFile.removeFileNums(fromFileNum, toFileNum, true);
+        }
+        else {
+            Log.info("args required (fromFileNum toFileNum)");
+        }
+    }
+    else 
     if (cmd.equals("rmdir")) {
         sequentialFile.removeAll(true);
     }
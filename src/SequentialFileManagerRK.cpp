@@ -0,0 +1,210 @@
+#include "SequentialFileManagerRK.h"
+
+
+static Logger _log("app.seqfile");
+
+
+SequentialFileManager::SequentialFileManager() {
+    os_semaphore_create(&queueSemaphore, 1, 0);
+    os_mutex_create(&admitMutex);
+}
+
+SequentialFileManager::~SequentialFileManager() {
+    if (scanThreadStarted) {
+        // Waits for scanDirAsync() to finish
+        os_thread_join(scanThread);
+    }
+
+    for(auto it = queues.begin(); it != queues.end(); it++) {
+        (*it)->manager = NULL;
+    }
+
+    os_mutex_destroy(admitMutex);
+    os_semaphore_destroy(queueSemaphore);
+}
+
+SequentialFileManager &SequentialFileManager::withSequentialFile(SequentialFile &sequentialFile) {
+    if (sequentialFile.manager) {
+        _log.error("%s was already added to a manager", sequentialFile.getDirPath());
+        return *this;
+    }
+    if (queues.size() >= MAX_QUEUES) {
+        _log.error("too many queues");
+        return *this;
+    }
+
+    if (maxBytes > 0) {
+        sequentialFile.withMetadata(true);
+    }
+    sequentialFile.manager = this;
+    queues.push_back(&sequentialFile);
+    return *this;
+}
+
+void SequentialFileManager::removeSequentialFile(SequentialFile *sequentialFile) {
+    if (scanThreadStarted) {
+        // The scanDirAsync() thread may be scanning this queue
+        os_thread_join(scanThread);
+        scanThreadStarted = false;
+    }
+
+    for(auto it = queues.begin(); it != queues.end(); it++) {
+        if (*it == sequentialFile) {
+            queues.erase(it);
+            break;
+        }
+    }
+    sequentialFile->manager = NULL;
+}
+
+SequentialFileManager &SequentialFileManager::withMaxBytes(uint64_t maxBytes) {
+    this->maxBytes = maxBytes;
+    if (maxBytes > 0) {
+        // getQueuedBytes() requires metadata
+        for(auto it = queues.begin(); it != queues.end(); it++) {
+            (*it)->withMetadata(true);
+        }
+    }
+    return *this;
+}
+
+uint64_t SequentialFileManager::getQueuedBytes() const {
+    uint64_t total = 0;
+    for(auto it = queues.begin(); it != queues.end(); it++) {
+        total += (*it)->getQueuedBytes();
+    }
+    return total;
+}
+
+int SequentialFileManager::getQueueLen() const {
+    int total = 0;
+    for(auto it = queues.begin(); it != queues.end(); it++) {
+        total += (*it)->getQueueLen();
+    }
+    return total;
+}
+
+bool SequentialFileManager::scanDirs() {
+    bool result = true;
+
+    for(auto it = queues.begin(); it != queues.end(); it++) {
+        if (!(*it)->scanDir()) {
+            result = false;
+        }
+    }
+    return result;
+}
+
+bool SequentialFileManager::scanDirAsync(os_thread_prio_t priority, size_t stackSize) {
+    if (scanRunning) {
+        return false;
+    }
+
+    if (scanThreadStarted) {
+        // Previous scan thread has exited, since scanRunning is false
+        os_thread_join(scanThread);
+        scanThreadStarted = false;
+    }
+
+    // Each queue is emptied and marked as scanning here, so a reserveFile() before the
+    // worker thread gets to it finishes that scan instead of starting another one
+    for(auto it = queues.begin(); it != queues.end(); it++) {
+        SequentialFile *sf = *it;
+
+        if (sf->queue->isLockFree() && sf->lanes.empty()) {
+            // The worker thread would be another producer
+            sf->scanDir();
+            continue;
+        }
+        if (sf->isScanning()) {
+            _log.info("%s is already being scanned", sf->getDirPath());
+            continue;
+        }
+
+        os_mutex_lock(sf->scanMutex);
+        if (sf->step.op == SequentialFile::StepState::Op::NONE) {
+            sf->scanStepBegin();
+        }
+        os_mutex_unlock(sf->scanMutex);
+    }
+
+    scanRunning = true;
+    if (os_thread_create(&scanThread, "seqmgr", priority, scanThreadFunction, this, stackSize) != 0) {
+        _log.error("failed to create scan thread, scanning now");
+        scanFinish();
+        scanRunning = false;
+        return false;
+    }
+    scanThreadStarted = true;
+
+    return true;
+}
+
+// [static]
+void SequentialFileManager::scanThreadFunction(void *param) {
+    SequentialFileManager *mgr = (SequentialFileManager *)param;
+
+    mgr->scanFinish();
+    mgr->scanRunning = false;
+
+    os_thread_exit(NULL);
+}
+
+void SequentialFileManager::scanFinish() {
+    for(auto it = queues.begin(); it != queues.end(); it++) {
+        SequentialFile *sf = *it;
+
+        os_mutex_lock(sf->scanMutex);
+        // Already done if it was loaded from the index file, or scanned by reserveFile()
+        if (sf->step.op == SequentialFile::StepState::Op::SCAN) {
+            sf->scanStepInternal(0, 0);
+        }
+        os_mutex_unlock(sf->scanMutex);
+    }
+}
+
+SequentialFile *SequentialFileManager::waitFileFromAny(int &fileNum, system_tick_t timeoutMs, SequentialFileMeta *meta, int *priority) {
+    system_tick_t startMs = millis();
+
+    while(true) {
+        for(auto it = queues.begin(); it != queues.end(); it++) {
+            fileNum = (*it)->waitFileFromQueue(0, meta, priority);
+            if (fileNum != 0) {
+                return *it;
+            }
+        }
+
+        system_tick_t waitMs = CONCURRENT_WAIT_FOREVER;
+        if (timeoutMs != CONCURRENT_WAIT_FOREVER) {
+            system_tick_t elapsedMs = millis() - startMs;
+            if (elapsedMs >= timeoutMs) {
+                break;
+            }
+            waitMs = timeoutMs - elapsedMs;
+        }
+
+        // Signaled when files are added to any queue, but the queues are checked again
+        // since another consumer may have gotten the file first
+        os_semaphore_take(queueSemaphore, waitMs, false);
+    }
+
+    fileNum = 0;
+    return NULL;
+}
+
+bool SequentialFileManager::isQuotaFull(uint64_t addBytes) const {
+    return maxBytes > 0 && getQueuedBytes() + addBytes > maxBytes;
+}
+
+void SequentialFileManager::spaceSignal() {
+    for(auto it = queues.begin(); it != queues.end(); it++) {
+        SequentialFile *sf = *it;
+        if (sf->overflowPolicy == SequentialFile::OverflowPolicy::BLOCK) {
+            os_semaphore_give(sf->spaceSemaphore, false);
+        }
+    }
+}
+
+void SequentialFileManager::queueSignal() {
+    os_semaphore_give(queueSemaphore, false);
+}
@@ -0,0 +1,226 @@
+#ifndef __SEQUENTIALFILEMANAGERRK_H
+#define __SEQUENTIALFILEMANAGERRK_H
+
+#include "SequentialFileRK.h"
+
+/**
+ * @brief Class for managing several SequentialFile queues together
+ *
+ * When an app has several queues, for example images, logs, and events, each one normally
+ * has its own scan at boot, its own scanDirAsync() thread, and its own consumer polling
+ * or waiting on it. This class registers the queues so they can share:
+ *
+ * - One scan pass at boot, with scanDirs() on the calling thread or scanDirAsync() on a
+ *   single worker thread, instead of one thread per queue
+ * - One flash quota across all of the queues (withMaxBytes())
+ * - One wait for a file in any of the queues (waitFileFromAny())
+ *
+ * You typically instantiate this class as a global variable, along with the SequentialFile
+ * objects. In global setup(), configure each SequentialFile, add it using withSequentialFile(),
+ * then call scanDirs() or scanDirAsync() instead of calling scanDir() on each queue.
+ *
+ * ```cpp
+ * SequentialFile imageQueue;
+ * SequentialFile eventQueue;
+ * SequentialFileManager queueManager;
+ *
+ * void setup() {
+ *     imageQueue.withDirPath("/usr/images").withFilenameExtension("jpg");
+ *     eventQueue.withDirPath("/usr/events");
+ *     queueManager.withSequentialFile(eventQueue)
+ *         .withSequentialFile(imageQueue)
+ *         .withMaxBytes(1024 * 1024)
+ *         .scanDirAsync();
+ * }
+ * ```
+ *
+ * The SequentialFile objects are used directly for everything else, and it's still safe
+ * to use them from different threads. Queues must be added before scanning. A SequentialFile
+ * that is deleted before the manager removes itself from it, after waiting for
+ * scanDirAsync() to complete; don't delete one while another thread is using the manager.
+ */
+class SequentialFileManager {
+public:
+    /**
+     * @brief Default constructor
+     */
+    SequentialFileManager();
+
+    /**
+     * @brief Destructor
+     *
+     * Waits for scanDirAsync() to complete.
+     */
+    virtual ~SequentialFileManager();
+
+    /**
+     * @brief Adds a queue to the manager
+     *
+     * @param sequentialFile The queue. Must be configured (withDirPath(), etc.) but not
+     * scanned yet. A queue can only be added to one manager.
+     *
+     * Queues are scanned in the order they are added, and waitFileFromAny() checks them in
+     * this order, so add the most important queue first. At most MAX_QUEUES queues can be added.
+     */
+    SequentialFileManager &withSequentialFile(SequentialFile &sequentialFile);
+
+    /**
+     * @brief Sets the maximum total size of the files in all of the queues (default: 0, no limit)
+     *
+     * @param maxBytes Maximum total size in bytes, or 0 for no limit
+     *
+     * This works like SequentialFile::withMaxBytes(), except that the limit is on the sum
+     * of getQueuedBytes() for all of the queues, so one queue can use space the others
+     * are not using. Each queue's own withOverflowPolicy() is used when the quota is
+     * reached; with DROP_OLDEST, a queue only removes its own oldest files. Enables
+     * SequentialFile::withMetadata() on each queue. Call this before scanning.
+     */
+    SequentialFileManager &withMaxBytes(uint64_t maxBytes);
+
+    /**
+     * @brief Gets the quota set using withMaxBytes()
+     */
+    uint64_t getMaxBytes() const { return maxBytes; };
+
+    /**
+     * @brief Gets the total size of the files in all of the queues
+     *
+     * The same as adding up SequentialFile::getQueuedBytes() for each queue.
+     */
+    uint64_t getQueuedBytes() const;
+
+    /**
+     * @brief Gets the total number of files in all of the queues
+     */
+    int getQueueLen() const;
+
+    /**
+     * @brief Gets the number of queues added using withSequentialFile()
+     */
+    size_t getNumQueues() const { return queues.size(); };
+
+    /**
+     * @brief Gets a queue added using withSequentialFile()
+     *
+     * @param index 0 is the first queue added. Must be less than getNumQueues().
+     */
+    SequentialFile &getSequentialFile(size_t index) const { return *queues[index]; };
+
+    /**
+     * @brief Scans the queue directories of all of the queues on the calling thread
+     *
+     * @return true if all of the scans succeeded
+     *
+     * The same as calling SequentialFile::scanDir() for each queue, in the order they were added.
+     */
+    bool scanDirs();
+
+    /**
+     * @brief Scans the queue directories of all of the queues on one worker thread
+     *
+     * @param priority Thread priority (default: OS_THREAD_PRIORITY_DEFAULT)
+     *
+     * @param stackSize Thread stack size in bytes (default: 3072)
+     *
+     * @return true if the worker thread was started
+     *
+     * Each queue behaves as it does with SequentialFile::scanDirAsync(), including
+     * isScanning(), but there is one thread for all of the queues instead of one each.
+     * The queues are scanned in the order they were added. If reserveFile() is called on
+     * a queue that has not been scanned yet, and the high-water mark is not available, that
+     * queue is scanned on the calling thread instead. Not supported for queues with a
+     * lock-free queue container (SequentialFileSpscQueue); those are scanned before this
+     * returns.
+     */
+    bool scanDirAsync(os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 3072);
+
+    /**
+     * @brief Returns true if scanDirAsync() is still scanning
+     */
+    bool isScanning() const { return scanRunning; };
+
+    /**
+     * @brief Waits for a file in any of the queues, removing it from the queue
+     *
+     * @param fileNum Filled in with the file number, or 0 if the timeout expired
+     *
+     * @param timeoutMs Maximum time to wait in milliseconds, CONCURRENT_WAIT_FOREVER (the
+     * default) to wait forever, or 0 to not wait
+     *
+     * @param meta If not NULL and metadata is enabled, filled in with the metadata for the file
+     *
+     * @param priority If not NULL, filled in with the priority lane the file is from
+     *
+     * @return The queue the file is from, or NULL if the timeout expired
+     *
+     * The queues are checked in the order they were added, so a file in the first queue
+     * is always returned before files in the others. This replaces a thread or a polling
+     * loop for each queue.
+     */
+    SequentialFile *waitFileFromAny(int &fileNum, system_tick_t timeoutMs = CONCURRENT_WAIT_FOREVER, SequentialFileMeta *meta = NULL, int *priority = NULL);
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialFileManager(const SequentialFileManager&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialFileManager& operator=(const SequentialFileManager&) = delete;
+
+    /**
+     * @brief Maximum number of queues (withSequentialFile())
+     */
+    static const size_t MAX_QUEUES = 16;
+
+protected:
+    // Called by SequentialFile
+    friend class SequentialFile;
+
+    /**
+     * @brief Removes a queue that is being deleted. Called by the SequentialFile destructor.
+     */
+    void removeSequentialFile(SequentialFile *sequentialFile);
+
+    /**
+     * @brief Returns true if adding addBytes bytes to any queue would exceed withMaxBytes()
+     */
+    bool isQuotaFull(uint64_t addBytes) const;
+
+    /**
+     * @brief Wakes producers blocked on the quota in all queues. Called when files are taken from any queue.
+     */
+    void spaceSignal();
+
+    /**
+     * @brief Wakes up a thread in waitFileFromAny(). Called when files are added to any queue.
+     */
+    void queueSignal();
+
+    /**
+     * @brief Worker thread entry point, param is the SequentialFileManager
+     */
+    static void scanThreadFunction(void *param);
+
+    /**
+     * @brief Finishes the step-wise scans started by scanDirAsync(), in order
+     */
+    void scanFinish();
+
+    /**
+     * @brief The queues added using withSequentialFile(), in order. Only changed after scanning starts when a queue is deleted.
+     */
+    std::vector<SequentialFile *> queues;
+
+    uint64_t maxBytes = 0;                  //!< Quota for all queues, 0 for no limit. Set using withMaxBytes().
+
+    os_semaphore_t queueSemaphore = 0;      //!< Given when files are added to any queue
+    os_mutex_t admitMutex = 0;              //!< Held while a file is checked against the quota and queued, in any queue
+
+    os_thread_t scanThread = 0;             //!< The scanDirAsync() thread. Only valid if scanThreadStarted is true.
+    bool scanThreadStarted = false;         //!< scanThread was created and has not been joined
+    std::atomic<bool> scanRunning{false};   //!< True while the scanDirAsync() thread is scanning
+};
+
+#endif // __SEQUENTIALFILEMANAGERRK_H
@@ -1,280 +1,4708 @@
 #include "SequentialFileRK.h"
+#include "SequentialFileManagerRK.h"
 
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <stddef.h>
+
+#include <algorithm>
+
 
 static Logger _log("app.seqfile");
 
+const char *SequentialFile::INDEX_FILENAME = "queue.idx";
+const char *SequentialFile::HIGH_WATER_MARK_FILENAME = "queue.hwm";
+const char *SequentialFile::TOMBSTONE_SUFFIX = ".rm";
+const char *SequentialFile::POOL_FILENAME_PREFIX = "pool.";
+
+namespace {
+
+/**
+ * @brief Fixed-size record in the index file. The first record is always the header.
+ * 
+ * The crc is the CRC-32 of the first 12 bytes of the record.
+ */
+struct IndexRecord {
+    uint32_t type;
+    int32_t fileNum;
+    int32_t count;
+    uint32_t crc;
+};
+
+/**
+ * @brief Formats value as decimal with leading zeros to at least minDigits digits, like %0Nd
+ * 
+ * @return The number of characters stored in buf, not including the null terminator, 
+ * or 0 if it did not fit.
+ */
+size_t formatDecimal(char *buf, size_t bufSize, unsigned int value, int minDigits) {
+    char digits[10];
+    int numDigits = 0;
+
+    do {
+        digits[numDigits++] = '0' + (value % 10);
+        value /= 10;
+    } while(value != 0);
+
+    size_t len = (numDigits > minDigits) ? numDigits : minDigits;
+    if (len >= bufSize) {
+        return 0;
+    }
+    for(size_t ii = 0; ii < len; ii++) {
+        size_t digit = len - ii - 1;
+        buf[ii] = (digit < (size_t)numDigits) ? digits[digit] : '0';
+    }
+    buf[len] = 0;
+    return len;
+}
+
+/**
+ * @brief Stores dir + "/" + name in buf
+ * 
+ * @return false if it did not fit
+ */
+bool joinPath(char *buf, size_t bufSize, const char *dir, const char *name) {
+    size_t dirLen = strlen(dir);
+    size_t nameLen = strlen(name);
+    if (dirLen + 1 + nameLen >= bufSize) {
+        return false;
+    }
+    memcpy(buf, dir, dirLen);
+    buf[dirLen] = '/';
+    memcpy(&buf[dirLen + 1], name, nameLen + 1);
+    return true;
+}
+
+/**
+ * @brief Returns the file numbers in set that are also in any of the numKeep sets in keep
+ */
+SequentialFileRunSet runSetIntersect(const SequentialFileRunSet &set, const SequentialFileRunSet *keep, size_t numKeep) {
+    SequentialFileRunSet result;
+    const std::vector<SequentialFileRunSet::Run> &runs = set.getRuns();
+
+    for(auto it = runs.begin(); it != runs.end(); it++) {
+        for(int fileNum = it->first; fileNum <= it->last; fileNum++) {
+            for(size_t ii = 0; ii < numKeep; ii++) {
+                if (keep[ii].contains(fileNum)) {
+                    result.insert(fileNum);
+                    break;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief First 3 bytes of a compressed file, followed by the codec
+ */
+const uint8_t COMPRESSED_MAGIC[3] = { 'S', 'Q', 'Z' };
+
+const uint8_t COMPRESSED_CODEC_LZ4 = 1;     //!< Codec byte in the compressed file header
+
+const size_t LZ4_MIN_MATCH = 4;             //!< Shortest match that can be encoded
+const size_t LZ4_LAST_LITERALS = 5;         //!< The last 5 bytes of a block are always literals
+const size_t LZ4_MF_LIMIT = 12;             //!< The last match must start at least 12 bytes before the end
+
+/**
+ * @brief Appends an LZ4 sequence (literals, then a match if matchLen is not 0) to dst
+ * 
+ * @return false if it did not fit in dstSize bytes
+ */
+bool lz4AppendSequence(uint8_t *dst, size_t dstSize, size_t &op, const uint8_t *literals, size_t litLen, size_t offset, size_t matchLen) {
+    size_t matchCode = (matchLen > 0) ? matchLen - LZ4_MIN_MATCH : 0;
+
+    // Token, length bytes, literals, and offset
+    size_t needed = 1 + (litLen / 255 + 1) + litLen + ((matchLen > 0) ? 2 + matchCode / 255 + 1 : 0);
+    if (op + needed > dstSize) {
+        return false;
+    }
+
+    dst[op++] = (uint8_t)(((litLen >= 15) ? 15 : litLen) << 4 | ((matchCode >= 15) ? 15 : matchCode));
+    if (litLen >= 15) {
+        size_t remain = litLen - 15;
+        for(; remain >= 255; remain -= 255) {
+            dst[op++] = 255;
+        }
+        dst[op++] = (uint8_t) remain;
+    }
+    if (litLen > 0) {
+        memcpy(&dst[op], literals, litLen);
+        op += litLen;
+    }
+
+    if (matchLen > 0) {
+        dst[op++] = (uint8_t)(offset & 0xff);
+        dst[op++] = (uint8_t)(offset >> 8);
+        if (matchCode >= 15) {
+            size_t remain = matchCode - 15;
+            for(; remain >= 255; remain -= 255) {
+                dst[op++] = 255;
+            }
+            dst[op++] = (uint8_t) remain;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Reads exactly len bytes from fd, retrying partial reads
+ */
+bool readFully(int fd, uint8_t *buf, size_t len) {
+    while(len > 0) {
+        int count = read(fd, buf, len);
+        if (count <= 0) {
+            return false;
+        }
+        buf += count;
+        len -= count;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads an LZ4 length extension, adding it to len
+ */
+bool lz4ReadLength(const uint8_t *src, size_t srcLen, size_t &ip, size_t &len) {
+    uint8_t byte;
+    do {
+        if (ip >= srcLen) {
+            return false;
+        }
+        byte = src[ip++];
+        len += byte;
+    } while(byte == 255);
+    return true;
+}
+
+void indexRecordSet(IndexRecord &rec, uint32_t type, int fileNum, int count) {
+    rec.type = type;
+    rec.fileNum = fileNum;
+    rec.count = count;
+    rec.crc = SequentialFile::crc32(&rec, offsetof(IndexRecord, crc));
+}
+
+}
+
+
+void SequentialFileRunSet::insertRange(int first, int last) {
+    if (first > last) {
+        return;
+    }
+
+    // Fast path: appending after the last run, the usual case since file numbers increase
+    if (runs.empty() || first > runs.back().last + 1) {
+        runs.push_back(Run{first, last});
+        count += last - first + 1;
+        return;
+    }
+
+    // Find the first run that could overlap or be adjacent to first..last
+    auto it = std::lower_bound(runs.begin(), runs.end(), first, [](const Run &run, int value) {
+        return run.last + 1 < value;
+    });
+
+    if (it == runs.end() || last + 1 < it->first) {
+        // Not overlapping or adjacent to any run
+        runs.insert(it, Run{first, last});
+        count += last - first + 1;
+        return;
+    }
+
+    // Merge all runs overlapping or adjacent to first..last into *it
+    auto end = it;
+    while(end != runs.end() && end->first <= last + 1) {
+        count -= end->last - end->first + 1;
+        if (end->first < first) {
+            first = end->first;
+        }
+        if (end->last > last) {
+            last = end->last;
+        }
+        end++;
+    }
+    it->first = first;
+    it->last = last;
+    count += last - first + 1;
+    runs.erase(it + 1, end);
+}
+
+void SequentialFileRunSet::removeRange(int first, int last) {
+    if (first > last) {
+        return;
+    }
+
+    auto it = std::lower_bound(runs.begin(), runs.end(), first, [](const Run &run, int value) {
+        return run.last < value;
+    });
+
+    while(it != runs.end() && it->first <= last) {
+        if (it->first < first && it->last > last) {
+            // Removing from the middle of a run splits it in two
+            Run after{last + 1, it->last};
+            it->last = first - 1;
+            count -= last - first + 1;
+            runs.insert(it + 1, after);
+            return;
+        }
+
+        int removeFirst = (it->first > first) ? it->first : first;
+        int removeLast = (it->last < last) ? it->last : last;
+        count -= removeLast - removeFirst + 1;
+
+        if (removeFirst == it->first && removeLast == it->last) {
+            it = runs.erase(it);
+        }
+        else {
+            if (removeFirst == it->first) {
+                it->first = removeLast + 1;
+            }
+            else {
+                it->last = removeFirst - 1;
+            }
+            it++;
+        }
+    }
+}
+
+bool SequentialFileRunSet::contains(int fileNum) const {
+    auto it = std::lower_bound(runs.begin(), runs.end(), fileNum, [](const Run &run, int value) {
+        return run.last < value;
+    });
+    return it != runs.end() && it->first <= fileNum;
+}
+
+int SequentialFileRunSet::next(int fileNum) const {
+    auto it = std::lower_bound(runs.begin(), runs.end(), fileNum, [](const Run &run, int value) {
+        return run.last <= value;
+    });
+    if (it == runs.end()) {
+        return 0;
+    }
+    return (it->first > fileNum) ? it->first : fileNum + 1;
+}
+
+
+bool SequentialFileQueue::push_back_range(int first, int count) {
+    for(int ii = 0; ii < count; ii++) {
+        if (!push_back(first + ii)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+SequentialFileRunQueue::SequentialFileRunQueue(size_t maxRuns) : maxRuns(maxRuns) {
+    runs = new Run[maxRuns];
+}
+
+SequentialFileRunQueue::~SequentialFileRunQueue() {
+    delete[] runs;
+}
+
+bool SequentialFileRunQueue::push_back_range(int first, int count) {
+    if (count <= 0) {
+        return true;
+    }
+    if (numRuns > 0) {
+        Run &last = runs[(head + numRuns - 1) % maxRuns];
+        if (last.first + last.count == first) {
+            last.count += count;
+            this->count += count;
+            return true;
+        }
+    }
+    if (numRuns >= maxRuns) {
+        return false;
+    }
+    runs[(head + numRuns) % maxRuns] = Run{first, count};
+    numRuns++;
+    this->count += count;
+    return true;
+}
+
+bool SequentialFileRunQueue::push_front(int fileNum) {
+    if (numRuns > 0 && runs[head].first == fileNum + 1) {
+        // Usually a file from SequentialFile::acquire() being returned in order
+        runs[head].first = fileNum;
+        runs[head].count++;
+        count++;
+        return true;
+    }
+    if (numRuns >= maxRuns) {
+        return false;
+    }
+    head = (head + maxRuns - 1) % maxRuns;
+    runs[head] = Run{fileNum, 1};
+    numRuns++;
+    count++;
+    return true;
+}
+
+void SequentialFileRunQueue::pop_front() {
+    Run &run = runs[head];
+    count--;
+    if (--run.count > 0) {
+        run.first++;
+    }
+    else {
+        head = (head + 1) % maxRuns;
+        numRuns--;
+    }
+}
+
+
+SequentialFileSpscQueue::SequentialFileSpscQueue(size_t maxFiles) : numSlots(maxFiles + 1) {
+    // One slot is always unused so a full ring can be distinguished from an empty one
+    slots = new int[numSlots];
+}
+
+SequentialFileSpscQueue::~SequentialFileSpscQueue() {
+    delete[] slots;
+}
+
+bool SequentialFileSpscQueue::push_back(int fileNum) {
+    size_t curTail = tail.load(std::memory_order_relaxed);
+    size_t nextTail = (curTail + 1) % numSlots;
+
+    if (nextTail == head.load(std::memory_order_acquire)) {
+        return false;
+    }
+    slots[curTail] = fileNum;
+    tail.store(nextTail, std::memory_order_release);
+    return true;
+}
+
+int SequentialFileSpscQueue::front() const {
+    return slots[head.load(std::memory_order_relaxed)];
+}
+
+void SequentialFileSpscQueue::pop_front() {
+    size_t curHead = head.load(std::memory_order_relaxed);
+    head.store((curHead + 1) % numSlots, std::memory_order_release);
+}
+
+size_t SequentialFileSpscQueue::size() const {
+    size_t curHead = head.load(std::memory_order_acquire);
+    size_t curTail = tail.load(std::memory_order_acquire);
+    return (curTail + numSlots - curHead) % numSlots;
+}
+
+void SequentialFileSpscQueue::clear() {
+    head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+
+void SequentialFileHistogram::add(uint32_t us) {
+    size_t bucket = 0;
+    for(uint32_t limit = 10; bucket < NUM_BUCKETS - 1 && us >= limit; limit *= 10) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    if (us > maxUs) {
+        maxUs = us;
+    }
+    // The part under 1 millisecond is carried over so many short durations still add up
+    remainderUs += us;
+    totalMs += remainderUs / 1000;
+    remainderUs %= 1000;
+}
+
+
+SequentialFile::SequentialFile() {
+    // Created here instead of on first use so two threads can't both create them
+    os_mutex_create(&queueMutex);
+    os_mutex_create(&indexMutex);
+    os_mutex_create(&scanMutex);
+    os_mutex_create(&metaMutex);
+    os_mutex_create(&tombstoneMutex);
+    os_mutex_create(&statsMutex);
+    os_mutex_create(&poolMutex);
+    os_mutex_create(&shardMutex);
+    os_mutex_create(&admitMutex);
+    os_semaphore_create(&queueSemaphore, 1, 0);
+    os_semaphore_create(&spaceSemaphore, 1, 0);
+    os_semaphore_create(&scanStartedSemaphore, 1, 0);
+}
+
+SequentialFile::~SequentialFile() {
+    if (manager) {
+        // So the manager does not keep a pointer to this queue
+        manager->removeSequentialFile(this);
+    }
+    if (scanThreadStarted) {
+        // Waits for scanDirAsync() to finish
+        os_thread_join(scanThread);
+    }
+    if (tombstoneThreadStarted) {
+        // Any remaining tombstone directories are deleted after the next scanDir()
+        tombstoneStop = true;
+        os_thread_join(tombstoneThread);
+    }
+
+    indexClose();
+    stepClose();
+
+    for(auto it = lanes.begin(); it != lanes.end(); it++) {
+        delete it->queue;
+    }
+
+    os_semaphore_destroy(scanStartedSemaphore);
+    os_semaphore_destroy(spaceSemaphore);
+    os_semaphore_destroy(queueSemaphore);
+    os_mutex_destroy(admitMutex);
+    os_mutex_destroy(shardMutex);
+    os_mutex_destroy(poolMutex);
+    os_mutex_destroy(statsMutex);
+    os_mutex_destroy(tombstoneMutex);
+    os_mutex_destroy(metaMutex);
+    os_mutex_destroy(scanMutex);
+    os_mutex_destroy(indexMutex);
+    os_mutex_destroy(queueMutex);
+}
+
+SequentialFile &SequentialFile::withDirPath(const char *dirPath) { 
+    this->dirPath = dirPath; 
+    if (this->dirPath.endsWith("/")) {
+        this->dirPath = this->dirPath.substring(0, this->dirPath.length() - 1);
+    }
+    return *this; 
+};
+
+
+SequentialFile &SequentialFile::withShardSize(int shardSize) {
+    this->shardSize = shardSize;
+    lastShardCreated = -1;
+    return *this;
+}
+
+SequentialFile &SequentialFile::withQueue(SequentialFileQueue *queue) {
+    queueMutexLock();
+    this->queue = (queue ? queue : &defaultQueue);
+    queueMutexUnlock();
+    return *this;
+}
+
+SequentialFile &SequentialFile::withPattern(const char *pattern) {
+    if (nameFixed) {
+        _log.error("the pattern of a SequentialFileT cannot be changed");
+        return *this;
+    }
+    this->pattern = pattern;
+
+    // Patterns of the form %0Nd, like the default %08d, are formatted and parsed without 
+    // snprintf and sscanf
+    patternDigits = 0;
+    if (pattern[0] == '%' && pattern[1] == '0' && pattern[2] >= '1' && pattern[2] <= '9' && pattern[3] == 'd' && pattern[4] == 0) {
+        patternDigits = pattern[2] - '0';
+    }
+
+    // Other patterns use sscanf, with %n to find the end of the number
+    scanPattern = this->pattern + "%n";
+
+    return *this;
+}
+
+SequentialFile &SequentialFile::withFilenameExtension(const char *ext) {
+    if (nameFixed) {
+        _log.error("the filename extension of a SequentialFileT cannot be changed");
+        return *this;
+    }
+    this->filenameExtension = ext;
+    return *this;
+}
+
+bool SequentialFile::parseFileNum(const char *name, int &fileNum, bool anyExtension) const {
+    const char *cp = parseFileNumPrefix(name, fileNum);
+    if (!cp) {
+        return false;
+    }
+
+    // cp is the part after the number, which is either nothing or a dot and extension
+    if (anyExtension) {
+        return *cp == 0 || *cp == '.';
+    }
+    if (filenameExtension.length() == 0) {
+        return *cp == 0;
+    }
+    return *cp == '.' && strcmp(cp + 1, filenameExtension.c_str()) == 0;
+}
+
+int SequentialFile::parseLane(const char *name, int &fileNum) const {
+    if (lanes.empty()) {
+        return parseFileNum(name, fileNum, false) ? 0 : -1;
+    }
+
+    const char *cp = parseFileNumPrefix(name, fileNum);
+    if (!cp || (*cp != 0 && *cp != '.')) {
+        return -1;
+    }
+
+    for(size_t lane = 0; lane < lanes.size(); lane++) {
+        const char *ext = lanes[lane].queue ? lanes[lane].ext.c_str() : filenameExtension.c_str();
+        if (*ext == 0 ? (*cp == 0) : (*cp == '.' && strcmp(cp + 1, ext) == 0)) {
+            return (int) lane;
+        }
+    }
+    return -1;
+}
+
+const char *SequentialFile::parseFileNumPrefix(const char *name, int &fileNum) const {
+    const char *cp = name;
+
+    if (patternDigits > 0) {
+        // Fixed-width decimal pattern; larger numbers use more digits than the width
+        uint32_t value = 0;
+        int numDigits = 0;
+
+        while(*cp >= '0' && *cp <= '9') {
+            // Checked before multiplying, since 10 digits can overflow uint32_t
+            uint32_t digit = *cp++ - '0';
+            if (++numDigits > 10 || value > (0x7fffffff - digit) / 10) {
+                return NULL;
+            }
+            value = value * 10 + digit;
+        }
+        if (numDigits == 0) {
+            return NULL;
+        }
+        fileNum = (int) value;
+    }
+    else {
+        int consumed = -1;
+        if (sscanf(name, scanPattern.c_str(), &fileNum, &consumed) != 1 || consumed < 0) {
+            return NULL;
+        }
+        cp += consumed;
+    }
+    return cp;
+}
+
+SequentialFile &SequentialFile::withPriorityExtension(int priority, const char *ext) {
+    if (priority == 0 || !ext || !*ext || findLane(priority) >= 0) {
+        _log.error("invalid or duplicate priority lane %d", priority);
+        return *this;
+    }
+    if (indexFile) {
+        _log.error("priority lanes are not supported with the index file, lane %d not added", priority);
+        return *this;
+    }
+
+    queueMutexLock();
+    if (lanes.empty()) {
+        // Priority 0 is the filename extension and the queue set using withQueue()
+        lanes.push_back(Lane{0, "", NULL});
+    }
+
+    auto it = lanes.begin();
+    while(it != lanes.end() && it->priority > priority) {
+        it++;
+    }
+    lanes.insert(it, Lane{priority, ext, new SequentialFileDequeQueue()});
+    queueMutexUnlock();
+
+    return *this;
+}
+
+SequentialFile &SequentialFile::withIndexFile(bool enable) {
+    if (enable && !lanes.empty()) {
+        _log.error("index file is not supported with priority lanes, not enabled");
+        return *this;
+    }
+    indexFile = enable;
+    return *this;
+}
+
+const char *SequentialFile::getExtensionForPriority(int priority) const {
+    int lane = findLane(priority);
+    if (lane < 0) {
+        return NULL;
+    }
+    const char *ext = getLaneExt(lane);
+    return ext ? ext : filenameExtension.c_str();
+}
+
+SequentialFile &SequentialFile::withConsumerGroup(const char *name) {
+    if (!name || !*name || getConsumerGroup(name) >= 0 || groups.size() >= MAX_CONSUMER_GROUPS) {
+        _log.error("invalid or duplicate consumer group %s", name ? name : "");
+        return *this;
+    }
+
+    queueMutexLock();
+    groups.push_back(ConsumerGroup{name, 0, SequentialFileRunSet()});
+    queueMutexUnlock();
+
+    return *this;
+}
+
+SequentialFile &SequentialFile::withDigest(Digest digest, const char *ext) {
+    if (digest != Digest::NONE && (!ext || !*ext)) {
+        _log.error("digest requires a sidecar extension");
+        return *this;
+    }
+
+    this->digest = digest;
+    digestExtension = ext ? ext : "";
+
+    if (digest != Digest::NONE && std::find(sidecarExtensions.begin(), sidecarExtensions.end(), digestExtension) == sidecarExtensions.end()) {
+        withSidecarExtension(ext);
+    }
+    return *this;
+}
+
+bool SequentialFile::readDigest(int fileNum, char *buf, size_t bufSize) {
+    if (digestExtension.length() == 0 || bufSize == 0) {
+        return false;
+    }
+
+    char pathBuf[PATH_BUF_SIZE];
+    String pathStr;
+    const char *path = pathBuf;
+    if (!getPathForFileNum(fileNum, pathBuf, sizeof(pathBuf), digestExtension)) {
+        // Too long for the stack buffer
+        pathStr = getPathForFileNum(fileNum, digestExtension);
+        path = pathStr.c_str();
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    int count = read(fd, buf, bufSize - 1);
+    close(fd);
+
+    if (count <= 0) {
+        return false;
+    }
+    buf[count] = 0;
+    return true;
+}
+
+int SequentialFile::getConsumerGroup(const char *name) const {
+    for(size_t group = 0; group < groups.size(); group++) {
+        if (groups[group].name == name) {
+            return (int) group;
+        }
+    }
+    return -1;
+}
+
+int SequentialFile::findLane(int priority) const {
+    if (lanes.empty()) {
+        return (priority == 0) ? 0 : -1;
+    }
+    for(size_t lane = 0; lane < lanes.size(); lane++) {
+        if (lanes[lane].priority == priority) {
+            return (int) lane;
+        }
+    }
+    return -1;
+}
+
+int SequentialFile::getFrontLane() const {
+    for(size_t lane = 0; lane < getNumLanes(); lane++) {
+        if (!getLaneQueue(lane)->empty()) {
+            return (int) lane;
+        }
+    }
+    return -1;
+}
+
+bool SequentialFile::scanDir(void) {
+    if (scanAsyncRunning) {
+        _log.error("scanDirAsync() or scanDirStep() is still running");
+        return false;
+    }
+    return scanDirInternal(false);
+}
+
+bool SequentialFile::scanDirAsync(os_thread_prio_t priority, size_t stackSize) {
+    if (queue->isLockFree() && lanes.empty()) {
+        _log.error("scanDirAsync() is not supported with a lock-free queue");
+        return false;
+    }
+
+    // Also waits for an implicit scanDir() on another thread to complete
+    os_mutex_lock(scanMutex);
+    bool running = scanAsyncRunning;
+    os_mutex_unlock(scanMutex);
+    if (running) {
+        return false;
+    }
+
+    if (scanThreadStarted) {
+        // Previous scan thread has exited, since scanAsyncRunning is false
+        os_thread_join(scanThread);
+        scanThreadStarted = false;
+    }
+
+    scanAsyncBegin();
+
+    if (os_thread_create(&scanThread, "seqscan", priority, scanThreadFunction, this, stackSize) != 0) {
+        _log.error("failed to create scan thread");
+        scanAsyncRunning = false;
+        return false;
+    }
+    scanThreadStarted = true;
+
+    // Once the thread has locked scanMutex, an implicit scan waits for it instead of starting another
+    os_semaphore_take(scanStartedSemaphore, CONCURRENT_WAIT_FOREVER, false);
+
+    return true;
+}
+
+SequentialFile::StepResult SequentialFile::scanDirStep(size_t maxEntries, system_tick_t maxMs) {
+    if (scanAsyncRunning && step.op != StepState::Op::SCAN) {
+        _log.error("scanDirAsync() is still running");
+        return StepResult::FAILED;
+    }
+
+    os_mutex_lock(scanMutex);
+
+    if (step.op == StepState::Op::REMOVE) {
+        _log.error("removeAllStep() is still running");
+        os_mutex_unlock(scanMutex);
+        return StepResult::FAILED;
+    }
+
+    StepResult result = StepResult::IN_PROGRESS;
+    if (step.op == StepState::Op::NONE) {
+        result = scanStepBegin();
+    }
+    if (result == StepResult::IN_PROGRESS) {
+        result = scanStepInternal(maxEntries, maxMs);
+    }
+
+    os_mutex_unlock(scanMutex);
+
+    return result;
+}
+
+SequentialFile::StepResult SequentialFile::scanStepBegin() {
+    unsigned long startUs = micros();
+
+    if (queue->isLockFree() && lanes.empty()) {
+        _log.error("scanDirStep() is not supported with a lock-free queue");
+        return StepResult::FAILED;
+    }
+    if (!scanPrepare()) {
+        return StepResult::FAILED;
+    }
+
+    scanEntries = 0;
+    scanAsyncBegin();
+
+    step.op = StepState::Op::SCAN;
+    step.laneFileNums.assign(getNumLanes(), SequentialFileRunSet());
+    step.shardFileNums.assign(getNumLanes(), SequentialFileRunSet());
+
+    if (indexFile) {
+        indexMutexLock();
+        indexClose();
+        indexMutexUnlock();
+
+        // Loading the index is a single file, so it's not split across calls
+        if (indexLoad(step.laneFileNums[0])) {
+            setQueue(step.laneFileNums, true);
+            scanAsyncFinish(step.laneFileNums, true);
+            stepClose();
+
+            highWaterMarkUpdate(lastFileNum);
+            statsScan(startUs);
+            return StepResult::DONE;
+        }
+    }
+
+    _log.trace("scanning %s in steps", dirPath.c_str());
+
+    step.path = dirPath;
+    step.listingShards = (shardSize > 0);
+    step.dir = opendir(dirPath);
+    if (!step.dir) {
+        std::vector<SequentialFileRunSet> laneFileNums(getNumLanes());
+        scanAsyncFinish(laneFileNums, false);
+        stepClose();
+        return StepResult::FAILED;
+    }
+    step.elapsedUs = micros() - startUs;
+
+    return StepResult::IN_PROGRESS;
+}
+
+SequentialFile::StepResult SequentialFile::scanStepInternal(size_t maxEntries, system_tick_t maxMs) {
+    unsigned long startUs = micros();
+    system_tick_t startMs = millis();
+    size_t numEntries = 0;
+
+    while((maxEntries == 0 || numEntries < maxEntries) && (maxMs == 0 || millis() - startMs < maxMs)) {
+        if (!step.dir) {
+            if (step.shardIndex < step.shards.size()) {
+                const std::pair<int, String> &shard = step.shards[step.shardIndex++];
+
+                step.path = dirPath + String("/") + shard.second;
+                step.shard = shard.first;
+                step.shardCount = 0;
+                step.dir = opendir(step.path);
+                continue;
+            }
+
+            // All directories have been read
+            if (shardSize > 0) {
+                // Shard directories for new files are created by reserveFile()
+                lastShardCreated = -1;
+            }
+            updateLastFileNum(step.scanLastNum);
+            removeEmptyShards(step.emptyShards);
+
+            // Held so files added after the deferred files are queued are appended to the new index
+            indexMutexLock();
+            scanAsyncFinish(step.laneFileNums, true);
+            if (indexFile) {
+                indexWrite(step.laneFileNums[0], lastFileNum);
+            }
+            indexMutexUnlock();
+
+            highWaterMarkUpdate(lastFileNum);
+
+            // Only the time spent in scanDirStep() calls, not the time between them
+            step.elapsedUs += micros() - startUs;
+            statsScan(micros() - step.elapsedUs);
+            stepClose();
+
+            return StepResult::DONE;
+        }
+
+        struct dirent* ent = readdir(step.dir);
+        numEntries++;
+
+        if (ent) {
+            int shard;
+            if (step.listingShards) {
+                if (ent->d_type == DT_DIR && parseShard(ent->d_name, shard)) {
+                    step.shards.push_back(std::make_pair(shard, String(ent->d_name)));
+                }
+            }
+            else
+            if (scanDirEntry(step.path, step.shard, ent, (step.shard >= 0) ? step.shardFileNums : step.laneFileNums, step.scanLastNum)) {
+                step.shardCount++;
+            }
+            continue;
+        }
+
+        closedir(step.dir);
+        step.dir = NULL;
+
+        if (step.listingShards) {
+            // Shards are scanned in increasing order so each one can be queued when it's read
+            std::sort(step.shards.begin(), step.shards.end(), 
+                [](const std::pair<int, String> &a, const std::pair<int, String> &b) { return a.first < b.first; });
+            step.listingShards = false;
+        }
+        else
+        if (step.shard >= 0) {
+            if (step.shardCount == 0) {
+                // Removed once lastFileNum is known, in case a new file is about to be created in it
+                step.emptyShards.push_back(step.shard);
+                continue;
+            }
+            updateLastFileNum(step.scanLastNum);
+            setQueue(step.shardFileNums, true);
+
+            for(size_t lane = 0; lane < step.shardFileNums.size(); lane++) {
+                const std::vector<SequentialFileRunSet::Run> &runs = step.shardFileNums[lane].getRuns();
+                for(auto runIt = runs.begin(); runIt != runs.end(); runIt++) {
+                    step.laneFileNums[lane].insertRange(runIt->first, runIt->last);
+                }
+                step.shardFileNums[lane].clear();
+            }
+        }
+        else {
+            // Not sharded, so the files are queued once the whole directory is read and sorted
+            setQueue(step.laneFileNums, true);
+        }
+    }
+
+    step.elapsedUs += micros() - startUs;
+    return StepResult::IN_PROGRESS;
+}
+
+void SequentialFile::stepClose() {
+    if (step.dir) {
+        closedir(step.dir);
+    }
+    if (step.topDir) {
+        closedir(step.topDir);
+    }
+    step = StepState();
+}
+
+// [static]
+void SequentialFile::scanThreadFunction(void *param) {
+    SequentialFile *sf = (SequentialFile *)param;
+
+    os_mutex_lock(sf->scanMutex);
+    os_semaphore_give(sf->scanStartedSemaphore, false);
+
+    if (!sf->scanDirInternal(true)) {
+        // Files deferred during the scan are still queued, but the queue is not complete
+        std::vector<SequentialFileRunSet> laneFileNums(sf->getNumLanes());
+        sf->scanAsyncFinish(laneFileNums, false);
+    }
+    os_mutex_unlock(sf->scanMutex);
+
+    os_thread_exit(NULL);
+}
+
+bool SequentialFile::scanPrepare() {
+    if (dirPath.length() <= 1) {
+        // Cannot use an unconfigured directory or "/"!
+        _log.error("unconfigured dirPath");
+        return false;
+    }
+
+    if (!createDirIfNecessary(dirPath)) {
+        return false;
+    }
+
+    if (fastRemoveAll && !tombstoneResumed) {
+        tombstoneResume();
+    }
+
+    if (poolSize > 0) {
+        poolLoad();
+    }
+    return true;
+}
+
+void SequentialFile::scanAsyncBegin() {
+    int hwm;
+    scanAsyncHaveLastNum = highWaterMark && highWaterMarkRead(hwm);
+    if (scanAsyncHaveLastNum) {
+        scanAsyncLastNum = hwm;
+        highWaterMarkSaved = hwm;
+        updateLastFileNum(hwm);
+        _log.trace("lastFileNum=%d from high-water mark", lastFileNum.load());
+    }
+
+    // Files found by the scan are appended to the empty queue
+    scanDirCompleted = false;
+    setQueue(std::vector<SequentialFileRunSet>(getNumLanes()));
+
+    queueMutexLock();
+    scanDeferred.assign(getNumLanes(), SequentialFileRunSet());
+    queueMutexUnlock();
+
+    scanAsyncRunning = true;
+}
+
+bool SequentialFile::scanDirInternal(bool async) {
+    unsigned long startUs = micros();
+    scanEntries = 0;
+
+    if (!scanPrepare()) {
+        return false;
+    }
+
+    // Files are collected in a sorted set for each lane so the queue is in fileNum order 
+    // with no duplicates, regardless of directory order
+    std::vector<SequentialFileRunSet> laneFileNums(getNumLanes());
+
+    int hwm;
+    if (highWaterMark && !async && highWaterMarkRead(hwm)) {
+        // File numbers are not reused, even if the files for them were removed
+        highWaterMarkSaved = hwm;
+        updateLastFileNum(hwm);
+    }
+
+    if (indexFile) {
+        indexMutexLock();
+        indexClose();
+        indexMutexUnlock();
+
+        if (indexLoad(laneFileNums[0])) {
+            if (async) {
+                setQueue(laneFileNums, true);
+                scanAsyncFinish(laneFileNums, true);
+            }
+            else {
+                setQueue(laneFileNums);
+                scanDirCompleted = true;
+            }
+            highWaterMarkUpdate(lastFileNum);
+            statsScan(startUs);
+            return true;
+        }
+    }
+
+    _log.trace("scanning %s with pattern %s", dirPath.c_str(), pattern.c_str());
+
+    int scanLastNum = 0;
+
+    if (shardSize > 0) {
+        DIR *dir = opendir(dirPath);
+        if (!dir) {
+            return false;
+        }
+
+        // Shards are scanned in increasing order so an async scan can queue each one when it's read
+        std::vector<std::pair<int, String>> shards;
+        while(true) {
+            struct dirent* ent = readdir(dir); 
+            if (!ent) {
+                break;
+            }
+
+            int shard;
+            if (ent->d_type == DT_DIR && parseShard(ent->d_name, shard)) {
+                shards.push_back(std::make_pair(shard, String(ent->d_name)));
+            }
+        }
+        closedir(dir);
+
+        std::sort(shards.begin(), shards.end(), 
+            [](const std::pair<int, String> &a, const std::pair<int, String> &b) { return a.first < b.first; });
+
+        std::vector<SequentialFileRunSet> shardFileNums(getNumLanes());
+        std::vector<int> emptyShards;
+
+        for(auto it = shards.begin(); it != shards.end(); it++) {
+            String shardPath = dirPath + String("/") + it->second;
+            int count = scanDirFiles(shardPath, it->first, async ? shardFileNums : laneFileNums, scanLastNum);
+            if (count == 0) {
+                // Removed once lastFileNum is known, in case a new file is about to be created in it
+                emptyShards.push_back(it->first);
+            }
+            if (async && count > 0) {
+                updateLastFileNum(scanLastNum);
+                setQueue(shardFileNums, true);
+
+                for(size_t lane = 0; lane < shardFileNums.size(); lane++) {
+                    const std::vector<SequentialFileRunSet::Run> &runs = shardFileNums[lane].getRuns();
+                    for(auto runIt = runs.begin(); runIt != runs.end(); runIt++) {
+                        laneFileNums[lane].insertRange(runIt->first, runIt->last);
+                    }
+                    shardFileNums[lane].clear();
+                }
+            }
+        }
+
+        updateLastFileNum(scanLastNum);
+        removeEmptyShards(emptyShards);
+
+        // Shard directories for new files are created by reserveFile()
+        lastShardCreated = -1;
+    }
+    else {
+        if (scanDirFiles(dirPath, -1, laneFileNums, scanLastNum) < 0) {
+            return false;
+        }
+        if (async) {
+            setQueue(laneFileNums, true);
+        }
+    }
+
+    // Only increases lastFileNum so numbers reserved by other threads are not reused
+    updateLastFileNum(scanLastNum);
+
+    if (async) {
+        // Held so files added after the deferred files are queued are appended to the new index
+        indexMutexLock();
+        scanAsyncFinish(laneFileNums, true);
+        if (indexFile) {
+            indexWrite(laneFileNums[0], lastFileNum);
+        }
+        indexMutexUnlock();
+    }
+    else {
+        setQueue(laneFileNums);
+
+        if (indexFile) {
+            indexMutexLock();
+            indexWrite(laneFileNums[0], lastFileNum);
+            indexMutexUnlock();
+        }
+        scanDirCompleted = true;
+    }
+
+    highWaterMarkUpdate(lastFileNum);
+    statsScan(startUs);
+
+    return true;
+}
+
+void SequentialFile::scanAsyncFinish(std::vector<SequentialFileRunSet> &laneFileNums, bool completed) {
+    size_t numDeferred = 0;
+
+    queueMutexLock();
+    for(size_t lane = 0; lane < scanDeferred.size() && lane < laneFileNums.size(); lane++) {
+        SequentialFileQueue *laneQueue = getLaneQueue(lane);
+        const std::vector<SequentialFileRunSet::Run> &runs = scanDeferred[lane].getRuns();
+
+        for(auto it = runs.begin(); it != runs.end(); it++) {
+            for(int fileNum = it->first; fileNum <= it->last; fileNum++) {
+                // The scan may have found the file already
+                if (!laneFileNums[lane].contains(fileNum)) {
+                    if (!laneQueue->push_back(fileNum)) {
+                        _log.error("queue full, fileNum %d not queued", fileNum);
+                        metaTake(fileNum, NULL);
+                        continue;
+                    }
+                    laneFileNums[lane].insert(fileNum);
+                    numDeferred++;
+                }
+            }
+        }
+    }
+    scanDeferred.clear();
+    statsQueueLen();
+
+    // scanDirCompleted is set first so scanDirIfNecessary() never sees neither flag set
+    scanDirCompleted = completed;
+    scanAsyncRunning = false;
+    queueMutexUnlock();
+
+    if (numDeferred > 0) {
+        queueSignal();
+    }
+    _log.trace("async scan completed, %u files added during the scan", numDeferred);
+}
+
+bool SequentialFile::scanDeferAdd(size_t lane, const int *fileNums, size_t count) {
+    if (!scanAsyncRunning) {
+        return false;
+    }
+
+    bool deferred = false;
+
+    queueMutexLock();
+    // Checked again with the mutex locked, since scanAsyncFinish() clears it with the mutex locked
+    if (scanAsyncRunning && lane < scanDeferred.size()) {
+        for(size_t ii = 0; ii < count; ii++) {
+            scanDeferred[lane].insert(fileNums[ii]);
+        }
+        deferred = true;
+    }
+    queueMutexUnlock();
+
+    return deferred;
+}
+
+String SequentialFile::getHighWaterMarkPath() const {
+    return dirPath + String("/") + HIGH_WATER_MARK_FILENAME;
+}
+
+bool SequentialFile::highWaterMarkRead(int &fileNum) {
+    int fd = open(getHighWaterMarkPath(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    IndexRecord rec;
+    bool result = read(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+        rec.type == INDEX_RECORD_LAST_NUM &&
+        rec.crc == SequentialFile::crc32(&rec, offsetof(IndexRecord, crc));
+    close(fd);
+
+    if (!result) {
+        _log.error("high-water mark file is not valid");
+        return false;
+    }
+    fileNum = rec.fileNum;
+    return true;
+}
+
+void SequentialFile::highWaterMarkUpdate(int fileNum) {
+    if (!highWaterMark || fileNum < highWaterMarkSaved) {
+        return;
+    }
+
+    indexMutexLock();
+    // Checked again so only one thread rewrites the file
+    if (fileNum >= highWaterMarkSaved) {
+        String path = getHighWaterMarkPath();
+        String tempPath = path + ".tmp";
+
+        IndexRecord rec;
+        indexRecordSet(rec, INDEX_RECORD_LAST_NUM, fileNum + HIGH_WATER_MARK_STEP, 0);
+
+        // Renamed so the file always contains either the old or the new value
+        int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        bool result = (fd >= 0) && write(fd, &rec, sizeof(rec)) == sizeof(rec);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (result && rename(tempPath, path) == 0) {
+            highWaterMarkSaved = rec.fileNum;
+        }
+        else {
+            _log.error("failed to save high-water mark errno=%d", errno);
+            unlink(tempPath);
+        }
+    }
+    indexMutexUnlock();
+}
+
+int SequentialFile::reserveFile(void) {
+    return reserveFiles(1);
+}
+
+int SequentialFile::reserveFiles(int count) {
+    if (count <= 0) {
+        _log.error("cannot reserve %d files", count);
+        return 0;
+    }
+
+    scanDirIfNecessary(true);
+
+    if (hasQueueLimit() && overflowPolicy != OverflowPolicy::DROP_OLDEST) {
+        if (maxFiles > 0 && (size_t)count > maxFiles) {
+            _log.error("cannot reserve %d files, more than maxFiles", count);
+            return 0;
+        }
+
+        system_tick_t startMs = millis();
+
+        // At least one more byte must fit, since the size of the new files is not known yet
+        while(isQueueFull(count, 1)) {
+            if (overflowPolicy == OverflowPolicy::REJECT_NEW) {
+                _log.info("queue full, not reserving");
+                return 0;
+            }
+
+            system_tick_t waitMs = CONCURRENT_WAIT_FOREVER;
+            if (blockTimeoutMs != CONCURRENT_WAIT_FOREVER) {
+                system_tick_t elapsedMs = millis() - startMs;
+                if (elapsedMs >= blockTimeoutMs) {
+                    _log.info("queue full, timed out waiting to reserve");
+                    return 0;
+                }
+                waitMs = blockTimeoutMs - elapsedMs;
+            }
+
+            // Signaled when files are taken from the queue
+            os_semaphore_take(spaceSemaphore, waitMs, false);
+        }
+
+        if (overflowPolicy == OverflowPolicy::BLOCK && !isQueueFull(count + 1, 1)) {
+            // Wake up another blocked producer, if any, since there's only one signal
+            spaceSignal();
+        }
+    }
+
+    // Atomic so two threads reserving at the same time never get the same file numbers
+    int fileNum;
+    if (isReserveTracked()) {
+        // Recorded with the same lock isShardRemovable() and isReserved() use, so a shard is
+        // not removed and a temporary file is not deleted between reserving the number and
+        // queueing the file
+        os_mutex_lock(shardMutex);
+        fileNum = lastFileNum.fetch_add(count) + 1;
+        shardReserved.insertRange(fileNum, fileNum + count - 1);
+        os_mutex_unlock(shardMutex);
+    }
+    else {
+        fileNum = lastFileNum.fetch_add(count) + 1;
+    }
+    statsCount(&SequentialFileStats::reserveCount, count);
+
+    // Saved before returning so the numbers are not reused after a reset
+    highWaterMarkUpdate(fileNum + count - 1);
+
+    createShardDirs(fileNum, fileNum + count - 1);
+
+    return fileNum;
+}
+
+int SequentialFile::scanDirFiles(const char *path, int shard, std::vector<SequentialFileRunSet> &laneFileNums, int &scanLastNum) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    int count = 0;
+
+    while(true) {
+        struct dirent* ent = readdir(dir); 
+        if (!ent) {
+            break;
+        }
+        if (scanDirEntry(path, shard, ent, laneFileNums, scanLastNum)) {
+            count++;
+        }
+    }
+    closedir(dir);
+
+    return count;
+}
+
+bool SequentialFile::scanDirEntry(const char *path, int shard, const struct dirent *ent, std::vector<SequentialFileRunSet> &laneFileNums, int &scanLastNum) {
+    scanEntries++;
+    
+    if (ent->d_type != DT_REG) {
+        // Not a plain file
+        return false;
+    }
+    
+    int fileNum;
+    int lane = parseLane(ent->d_name, fileNum);
+    if (lane >= 0) {
+        if (shard >= 0 && getShardForFileNum(fileNum) != shard) {
+            _log.info("ignoring %s, not in the right shard", ent->d_name);
+            return false;
+        }
+
+        if (preScanAddHook(ent->d_name)) {
+            if (fileNum > scanLastNum) {
+                scanLastNum = fileNum;
+            }
+            _log.trace("adding to queue %d %s", fileNum, ent->d_name);
+
+            laneFileNums[lane].insert(fileNum);
+        }
+        return true;
+    }
+    
+    if (tempExtension.length() > 0 && parseFileNum(ent->d_name, fileNum, true)) {
+        // Orphaned temporary file from a write that did not finish before a reset. A number
+        // that is still reserved is being written now, and during scanDirAsync() or 
+        // scanDirStep() so are files above the high-water mark.
+        const char *ext = strrchr(ent->d_name, '.');
+        bool inProgress = (scanAsyncRunning && scanAsyncHaveLastNum && fileNum > scanAsyncLastNum) || isReserved(fileNum);
+        if (ext && strcmp(ext + 1, tempExtension.c_str()) == 0 && !inProgress) {
+            String tempPath = String(path) + String("/") + ent->d_name;
+            unlink(tempPath);
+            _log.info("removed orphaned temporary file %s", tempPath.c_str());
+        }
+    }
+    return false;
+}
+
+// [static]
+bool SequentialFile::parseShard(const char *name, int &shard) {
+    uint32_t value = 0;
+    int numDigits = 0;
+
+    for(const char *cp = name; *cp; cp++) {
+        if (*cp < '0' || *cp > '9' || ++numDigits > 9) {
+            return false;
+        }
+        value = value * 10 + (*cp - '0');
+    }
+    shard = (int) value;
+    return numDigits > 0;
+}
+
+void SequentialFile::updateLastFileNum(int fileNum) {
+    int curLastFileNum = lastFileNum.load();
+    while(fileNum > curLastFileNum) {
+        if (lastFileNum.compare_exchange_weak(curLastFileNum, fileNum)) {
+            break;
+        }
+    }
+}
+
+void SequentialFile::scanDirIfNecessary(bool needLastFileNum) {
+    if (!scanDirCompleted) {
+        if (scanAsyncRunning && (!needLastFileNum || scanAsyncHaveLastNum)) {
+            // The scanDirAsync() thread queues files as it finds them
+            return;
+        }
+
+        // Only one thread does the implicit scan; the others wait for it to complete.
+        // This also waits for scanDirAsync(), since its thread holds scanMutex.
+        os_mutex_lock(scanMutex);
+        if (!scanDirCompleted) {
+            if (step.op == StepState::Op::SCAN) {
+                // Finish the scanDirStep() in progress instead of starting over
+                scanStepInternal(0, 0);
+            }
+            else {
+                scanDirInternal(false);
+            }
+        }
+        os_mutex_unlock(scanMutex);
+    }
+}
+
+bool SequentialFile::addFileToQueue(int fileNum) {
+    return queueFile(fileNum, findLane(0), NULL);
+}
+
+bool SequentialFile::addFileToQueue(int fileNum, const SequentialFileMeta &meta) {
+    return queueFile(fileNum, findLane(0), &meta);
+}
+
+bool SequentialFile::addFileToQueueWithPriority(int fileNum, int priority, const SequentialFileMeta *meta) {
+    int lane = findLane(priority);
+    if (lane < 0) {
+        _log.error("no priority lane %d, fileNum %d not queued", priority, fileNum);
+        return false;
+    }
+    return queueFile(fileNum, lane, meta);
+}
+
+bool SequentialFile::queueFile(int fileNum, size_t lane, const SequentialFileMeta *meta) {
+    scanDirIfNecessary(true);
+    updateLastFileNum(fileNum);
+    highWaterMarkUpdate(fileNum);
+    shardRelease(fileNum, fileNum);
+
+    const char *ext = getLaneExt(lane);
+    if (!commitTempFile(fileNum, ext)) {
+        return false;
+    }
+
+    SequentialFileMeta statMeta;
+    if (metadata && !meta) {
+        statFileMeta(fileNum, statMeta, ext);
+        meta = &statMeta;
+    }
+
+    // The limits are checked again now that the size of the file is known, and stay locked
+    // until it's queued so files added by other threads at the same time are counted
+    bool admitted = isAdmitChecked();
+    if (admitted && !admitLock(1, meta ? meta->size : 0, true)) {
+        _log.info("queue full, removing %d", fileNum);
+        removeFileNum(fileNum, !sidecarExtensions.empty());
+        return false;
+    }
+
+    if (metadata) {
+        // Added before the file is queued so a consumer always finds it
+        metaInsert(fileNum, *meta);
+    }
+
+    // queuedBytes already includes the new file
+    evictIfFull(1, 0);
+
+    bool queued = true;
+    if (!scanDeferAdd(lane, &fileNum, 1)) {
+        queueContainerLock();
+        queued = getLaneQueue(lane)->push_back(fileNum); 
+        statsQueueLen();
+        queueContainerUnlock();
+
+        if (queued) {
+            queueSignal();
+        }
+    }
+
+    if (admitted) {
+        admitUnlock();
+    }
+
+    if (queued) {
+        statsCount(&SequentialFileStats::addCount, 1);
+        // Only after the file is queued, so the index never lists a file that was not
+        indexAppend(INDEX_RECORD_ADD, fileNum, 1);
+    }
+    else {
+        _log.error("queue full, fileNum %d not queued", fileNum);
+        metaTake(fileNum, NULL);
+    }
+
+    return queued;
+}
+
+size_t SequentialFile::addFilesToQueue(const int *fileNums, size_t count) {
+    scanDirIfNecessary(true);
+
+    for(size_t ii = 0; ii < count; ii++) {
+        shardRelease(fileNums[ii], fileNums[ii]);
+    }
+
+    size_t numQueued = 0;
+
+    if (tempExtension.length() > 0) {
+        // Queue each group of files that were renamed successfully; the others are not queued
+        size_t ii = 0;
+        while(ii < count) {
+            size_t end = ii;
+            while(end < count && commitTempFile(fileNums[end])) {
+                end++;
+            }
+            numQueued += queueFileNums(&fileNums[ii], end - ii);
+            ii = end + 1;
+        }
+    }
+    else {
+        numQueued = queueFileNums(fileNums, count);
+    }
+    return numQueued;
+}
+
+size_t SequentialFile::queueFileNums(const int *fileNums, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    std::vector<SequentialFileMeta> metas;
+    uint64_t addBytes = 0;
+    if (metadata) {
+        metas.resize(count);
+        for(size_t ii = 0; ii < count; ii++) {
+            statFileMeta(fileNums[ii], metas[ii]);
+            addBytes += metas[ii].size;
+        }
+    }
+
+    bool admitted = isAdmitChecked();
+    if (admitted && !admitLock(count, addBytes, false)) {
+        // Not all of them fit, so add them one at a time, in order; each one waits with 
+        // BLOCK and is removed if it does not fit
+        size_t numQueued = 0;
+        for(size_t ii = 0; ii < count; ii++) {
+            if (queueFile(fileNums[ii], findLane(0), metadata ? &metas[ii] : NULL)) {
+                numQueued++;
+            }
+        }
+        return numQueued;
+    }
+
+    if (metadata) {
+        for(size_t ii = 0; ii < count; ii++) {
+            metaInsert(fileNums[ii], metas[ii]);
+        }
+    }
+
+    evictIfFull(count, 0);
+
+    size_t numQueued = 0;
+
+    SequentialFileQueue *laneQueue = getLaneQueue(findLane(0));
+
+    if (scanDeferAdd(findLane(0), fileNums, count)) {
+        numQueued = count;
+    }
+    else {
+        queueContainerLock();
+        for(; numQueued < count; numQueued++) {
+            if (!laneQueue->push_back(fileNums[numQueued])) {
+                break;
+            }
+        }
+        statsQueueLen();
+        queueContainerUnlock();
+    }
+
+    if (admitted) {
+        admitUnlock();
+    }
+
+    if (numQueued > 0) {
+        statsCount(&SequentialFileStats::addCount, numQueued);
+        queueSignal();
+    }
+    if (numQueued < count) {
+        _log.error("queue full, only %u of %u files queued", numQueued, count);
+        for(size_t ii = numQueued; ii < count; ii++) {
+            metaTake(fileNums[ii], NULL);
+        }
+    }
+
+    // Sequential file numbers are stored as a single index record. Files that were not
+    // queued still use up their file numbers, but are not added to the index.
+    for(size_t ii = 0; ii < count; ) {
+        size_t end = ii + 1;
+        while(end < count && fileNums[end] == fileNums[end - 1] + 1) {
+            end++;
+        }
+        updateLastFileNum(fileNums[end - 1]);
+        highWaterMarkUpdate(fileNums[end - 1]);
+        if (ii < numQueued) {
+            size_t indexEnd = (end < numQueued) ? end : numQueued;
+            indexAppend(INDEX_RECORD_ADD, fileNums[ii], (int)(indexEnd - ii));
+        }
+        ii = end;
+    }
+    return numQueued;
+}
+ 
+size_t SequentialFile::getFilesFromQueue(int *fileNums, size_t maxFiles, SequentialFileMeta *metas, int *priorities) {
+    size_t count = 0;
+    int lane;
+
+    scanDirIfNecessary();
+
+    queueContainerLock();
+    while(count < maxFiles && (lane = getFrontLane()) >= 0) {
+        SequentialFileQueue *laneQueue = getLaneQueue(lane);
+        if (priorities) {
+            priorities[count] = getLanePriority(lane);
+        }
+        fileNums[count++] = laneQueue->front();
+        laneQueue->pop_front();
+    }
+    queueContainerUnlock();
+
+    for(size_t ii = 0; ii < count; ii++) {
+        metaTake(fileNums[ii], metas ? &metas[ii] : NULL);
+    }
+    if (count > 0) {
+        statsCount(&SequentialFileStats::getCount, count);
+        spaceSignal();
+    }
+
+    if (count > 0) {
+        _log.trace("getFilesFromQueue returned %u files starting with %d", count, fileNums[0]);
+    }
+
+    return count;
+}
+
+size_t SequentialFile::acquire(int *fileNums, size_t maxFiles, SequentialFileMeta *metas, int *priorities) {
+    if (queue->isLockFree() && lanes.empty()) {
+        // nack() would need to add to the front of the queue from any thread
+        _log.error("acquire is not supported with a lock-free queue");
+        return 0;
+    }
+
+    size_t count = 0;
+    int lane;
+
+    scanDirIfNecessary();
+
+    queueMutexLock();
+    while(count < maxFiles && (lane = getFrontLane()) >= 0) {
+        SequentialFileQueue *laneQueue = getLaneQueue(lane);
+        if (priorities) {
+            priorities[count] = getLanePriority(lane);
+        }
+        int fileNum = laneQueue->front();
+        laneQueue->pop_front();
+        inFlight.push_back(InFlight{fileNum, (size_t)lane});
+        fileNums[count++] = fileNum;
+    }
+    queueMutexUnlock();
+
+    // The metadata is kept until ack() since the file still counts against withMaxBytes()
+    for(size_t ii = 0; ii < count && metas; ii++) {
+        getFileMeta(fileNums[ii], metas[ii]);
+    }
+    if (count > 0) {
+        statsCount(&SequentialFileStats::getCount, count);
+        _log.trace("acquire returned %u files starting with %d", count, fileNums[0]);
+    }
+
+    return count;
+}
+
+bool SequentialFile::ack(int fileNum, bool allExtensions) {
+    InFlight entry;
+
+    queueMutexLock();
+    bool found = inFlightRemove(fileNum, entry);
+    queueMutexUnlock();
+
+    if (!found) {
+        _log.info("ack %d not in flight", fileNum);
+        return false;
+    }
+
+    metaTake(fileNum, NULL);
+    removeFileNum(fileNum, allExtensions);
+    spaceSignal();
+
+    _log.trace("ack %d", fileNum);
+    return true;
+}
+
+bool SequentialFile::nack(int fileNum) {
+    InFlight entry;
+
+    queueMutexLock();
+    bool found = inFlightRemove(fileNum, entry);
+    if (found) {
+        inFlightRequeue(entry);
+    }
+    queueMutexUnlock();
+
+    if (!found) {
+        _log.info("nack %d not in flight", fileNum);
+        return false;
+    }
+
+    queueSignal();
+
+    _log.trace("nack %d", fileNum);
+    return true;
+}
+
+void SequentialFile::nackAll() {
+    size_t count = 0;
+
+    queueMutexLock();
+    // Newest first, so the files end up at the front of the queue in their original order
+    while(!inFlight.empty()) {
+        inFlightRequeue(inFlight.back());
+        inFlight.pop_back();
+        count++;
+    }
+    queueMutexUnlock();
+
+    if (count > 0) {
+        queueSignal();
+        _log.trace("nackAll returned %u files", count);
+    }
+}
+
+size_t SequentialFile::getInFlightCount() const {
+    queueMutexLock();
+    size_t count = inFlight.size();
+    queueMutexUnlock();
+
+    return count;
+}
+
+int SequentialFile::getFileFromGroup(int group, SequentialFileMeta *meta) {
+    if (group < 0 || group >= (int)groups.size()) {
+        return 0;
+    }
+
+    scanDirIfNecessary();
+
+    queueMutexLock();
+    groupDrain();
+
+    ConsumerGroup &consumerGroup = groups[group];
+    int fileNum = groupFiles.next(consumerGroup.cursor);
+    while(fileNum != 0 && consumerGroup.acked.contains(fileNum)) {
+        // Only after rewindGroup(), since the cursor is normally past the acknowledged files
+        fileNum = groupFiles.next(fileNum);
+    }
+    if (fileNum != 0) {
+        consumerGroup.cursor = fileNum;
+    }
+    queueMutexUnlock();
+
+    if (fileNum != 0) {
+        if (meta) {
+            getFileMeta(fileNum, *meta);
+        }
+        statsCount(&SequentialFileStats::getCount, 1);
+        _log.trace("getFileFromGroup %s returned %d", groups[group].name.c_str(), fileNum);
+    }
+
+    return fileNum;
+}
+
+bool SequentialFile::ackGroup(int group, int fileNum, bool allExtensions) {
+    if (group < 0 || group >= (int)groups.size()) {
+        return false;
+    }
+
+    bool result = false;
+    bool remove = true;
+
+    queueMutexLock();
+    groupDrain();
+
+    if (groupFiles.contains(fileNum) && !groups[group].acked.contains(fileNum)) {
+        result = true;
+        groups[group].acked.insert(fileNum);
+
+        for(auto it = groups.begin(); it != groups.end(); it++) {
+            if (!it->acked.contains(fileNum)) {
+                remove = false;
+                break;
+            }
+        }
+        if (remove) {
+            for(auto it = groups.begin(); it != groups.end(); it++) {
+                it->acked.remove(fileNum);
+            }
+            groupFiles.remove(fileNum);
+        }
+    }
+    queueMutexUnlock();
+
+    if (!result) {
+        _log.info("ackGroup %d: %d not in queue or already acknowledged", group, fileNum);
+        return false;
+    }
+
+    if (remove) {
+        metaTake(fileNum, NULL);
+        removeFileNum(fileNum, allExtensions);
+        spaceSignal();
+    }
+    else {
+        indexAppend(INDEX_RECORD_GROUP_ACK | ((uint32_t)group << 8), fileNum, 1);
+    }
+
+    _log.trace("ackGroup %d: %d%s", group, fileNum, remove ? " removed" : "");
+    return true;
+}
+
+void SequentialFile::rewindGroup(int group) {
+    if (group < 0 || group >= (int)groups.size()) {
+        return;
+    }
+
+    queueMutexLock();
+    groups[group].cursor = 0;
+    queueMutexUnlock();
+}
+
+size_t SequentialFile::getGroupQueueLen(int group) const {
+    if (group < 0 || group >= (int)groups.size()) {
+        return 0;
+    }
+
+    // Acknowledged files are always in groupFiles or the queue containers
+    queueMutexLock();
+    size_t size = groupFiles.size() - groups[group].acked.size();
+    for(size_t lane = 0; lane < getNumLanes(); lane++) {
+        size += getLaneQueue(lane)->size();
+    }
+    queueMutexUnlock();
+
+    return size;
+}
+
+int SequentialFile::waitFileFromQueue(system_tick_t timeoutMs, SequentialFileMeta *meta, int *priority) {
+    scanDirIfNecessary();
+
+    system_tick_t startMs = millis();
+
+    while(true) {
+        int fileNum = 0;
+        bool moreFiles = false;
+
+        queueContainerLock();
+        int lane = getFrontLane();
+        if (lane >= 0) {
+            SequentialFileQueue *laneQueue = getLaneQueue(lane);
+            fileNum = laneQueue->front();
+            laneQueue->pop_front();
+            moreFiles = (getFrontLane() >= 0);
+            if (priority) {
+                *priority = getLanePriority(lane);
+            }
+        }
+        queueContainerUnlock();
+
+        if (fileNum != 0) {
+            metaTake(fileNum, meta);
+            statsCount(&SequentialFileStats::getCount, 1);
+            spaceSignal();
+
+            if (moreFiles) {
+                // Wake up another waiting consumer, if any, since there's only one signal per batch
+                queueSignal();
+            }
+
+            _log.trace("waitFileFromQueue returned %d", fileNum);
+            return fileNum;
+        }
+
+        system_tick_t waitMs = CONCURRENT_WAIT_FOREVER;
+        if (timeoutMs != CONCURRENT_WAIT_FOREVER) {
+            system_tick_t elapsedMs = millis() - startMs;
+            if (elapsedMs >= timeoutMs) {
+                return 0;
+            }
+            waitMs = timeoutMs - elapsedMs;
+        }
+
+        // Signaled when files are added, but the queue is checked again since another
+        // consumer may have gotten the file first
+        os_semaphore_take(queueSemaphore, waitMs, false);
+    }
+}
+
+int SequentialFile::getFileFromQueue(bool remove, SequentialFileMeta *meta, int *priority) {
+    int fileNum = 0;
+
+    scanDirIfNecessary();
+
+    queueContainerLock();
+    int lane = getFrontLane();
+    if (lane >= 0) {
+        SequentialFileQueue *laneQueue = getLaneQueue(lane);
+        fileNum = laneQueue->front();
+        if (remove) {
+            laneQueue->pop_front();
+        }
+        if (priority) {
+            *priority = getLanePriority(lane);
+        }
+    }
+    queueContainerUnlock();
+
+    if (fileNum != 0) {
+        if (remove) {
+            metaTake(fileNum, meta);
+            statsCount(&SequentialFileStats::getCount, 1);
+            spaceSignal();
+        }
+        else
+        if (meta) {
+            getFileMeta(fileNum, *meta);
+        }
+        _log.trace("getFileFromQueue returned %d", fileNum);
+    }
+
+    return fileNum;
+}
+
+
+String SequentialFile::getNameForFileNum(int fileNum, const char *overrideExt) {
+    char buf[PATH_BUF_SIZE];
+    if (getNameForFileNum(fileNum, buf, sizeof(buf), overrideExt)) {
+        return String(buf);
+    }
+
+    String name = String::format(pattern.c_str(), fileNum);
+
+    return getNameWithOptionalExt(name, (overrideExt ? overrideExt : filenameExtension.c_str()));
+}
+
+String SequentialFile::getTempPathForFileNum(int fileNum, const char *overrideExt) {
+    String result = getPathForFileNum(fileNum, overrideExt);
+    if (tempExtension.length() > 0) {
+        result += ".";
+        result += tempExtension;
+    }
+    return result;
+}
+
+bool SequentialFile::getTempPathForFileNum(int fileNum, char *buf, size_t bufSize, const char *overrideExt) const {
+    if (!getPathForFileNum(fileNum, buf, bufSize, overrideExt)) {
+        return false;
+    }
+
+    size_t tempLen = tempExtension.length();
+    if (tempLen > 0) {
+        size_t len = strlen(buf);
+        if (len + 1 + tempLen >= bufSize) {
+            return false;
+        }
+        buf[len++] = '.';
+        memcpy(&buf[len], tempExtension.c_str(), tempLen + 1);
+    }
+    return true;
+}
+
+bool SequentialFile::commitTempFile(int fileNum, const char *overrideExt) {
+    if (tempExtension.length() == 0) {
+        return true;
+    }
+
+    char tempBuf[PATH_BUF_SIZE];
+    char pathBuf[PATH_BUF_SIZE];
+    String tempStr, pathStr;
+    const char *tempPath = tempBuf;
+    const char *path = pathBuf;
+
+    if (!getTempPathForFileNum(fileNum, tempBuf, sizeof(tempBuf), overrideExt) || !getPathForFileNum(fileNum, pathBuf, sizeof(pathBuf), overrideExt)) {
+        // Too long for the stack buffers
+        tempStr = getTempPathForFileNum(fileNum, overrideExt);
+        pathStr = getPathForFileNum(fileNum, overrideExt);
+        tempPath = tempStr.c_str();
+        path = pathStr.c_str();
+    }
+
+    if (rename(tempPath, path) == 0) {
+        return true;
+    }
+    if (errno == ENOENT) {
+        // No temporary file, assume it was written directly to the queue filename
+        return true;
+    }
+
+    _log.error("failed to rename %s errno=%d, not queued", tempPath, errno);
+    return false;
+}
+
+String SequentialFile::getPathForFileNum(int fileNum, const char *overrideExt) {
+    char buf[PATH_BUF_SIZE];
+    if (getPathForFileNum(fileNum, buf, sizeof(buf), overrideExt)) {
+        return String(buf);
+    }
+
+    String result;
+    result.reserve(dirPath.length() + pattern.length() + 4);
+
+    // dirPath never ends with a "/" because withDirName() removes it if it was passed in
+    result = ((shardSize > 0) ? getShardPath(getShardForFileNum(fileNum)) : dirPath) + String("/") + getNameForFileNum(fileNum, overrideExt);
+
+    return result;
+}
+
+bool SequentialFile::getNameForFileNum(int fileNum, char *buf, size_t bufSize, const char *overrideExt) const {
+    size_t len;
+
+    if (patternDigits > 0 && fileNum >= 0) {
+        // Fixed-width decimal pattern like the default %08d, formatted without snprintf
+        len = formatDecimal(buf, bufSize, (unsigned int) fileNum, patternDigits);
+        if (len == 0) {
+            return false;
+        }
+    }
+    else {
+        int result = snprintf(buf, bufSize, pattern.c_str(), fileNum);
+        if (result < 0 || (size_t)result >= bufSize) {
+            return false;
+        }
+        len = result;
+    }
+
+    const char *ext = (overrideExt ? overrideExt : filenameExtension.c_str());
+    if (*ext) {
+        size_t extLen = strlen(ext);
+        if (len + 1 + extLen >= bufSize) {
+            return false;
+        }
+        buf[len++] = '.';
+        memcpy(&buf[len], ext, extLen);
+        len += extLen;
+    }
+    buf[len] = 0;
+
+    return true;
+}
+
+bool SequentialFile::getPathForFileNum(int fileNum, char *buf, size_t bufSize, const char *overrideExt) const {
+    size_t dirLen;
+
+    if (shardSize > 0) {
+        if (!getShardPath(getShardForFileNum(fileNum), buf, bufSize)) {
+            return false;
+        }
+        dirLen = strlen(buf);
+    }
+    else {
+        dirLen = dirPath.length();
+        if (dirLen >= bufSize) {
+            return false;
+        }
+        memcpy(buf, dirPath.c_str(), dirLen);
+    }
+
+    // dirPath never ends with a "/" because withDirName() removes it if it was passed in
+    if (dirLen + 1 >= bufSize) {
+        return false;
+    }
+    buf[dirLen++] = '/';
+
+    return getNameForFileNum(fileNum, &buf[dirLen], bufSize - dirLen, overrideExt);
+}
+
+String SequentialFile::getShardPath(int shard) const {
+    char buf[SHARD_DIGITS + 2];
+    formatDecimal(buf, sizeof(buf), (unsigned int) shard, SHARD_DIGITS);
+
+    return dirPath + String("/") + buf;
+}
+
+bool SequentialFile::getShardPath(int shard, char *buf, size_t bufSize) const {
+    size_t dirLen = dirPath.length();
+    if (dirLen + 1 >= bufSize) {
+        return false;
+    }
+    memcpy(buf, dirPath.c_str(), dirLen);
+    buf[dirLen++] = '/';
+
+    return formatDecimal(&buf[dirLen], bufSize - dirLen, (unsigned int) shard, SHARD_DIGITS) != 0;
+}
+
+void SequentialFile::createShardDirs(int fromFileNum, int toFileNum) {
+    if (shardSize <= 0) {
+        return;
+    }
+
+    int toShard = getShardForFileNum(toFileNum);
+    for(int shard = getShardForFileNum(fromFileNum); shard <= toShard; shard++) {
+        int curLastShard = lastShardCreated.load();
+        if (shard <= curLastShard) {
+            continue;
+        }
+
+        String path = getShardPath(shard);
+        if (mkdir(path, 0777) == 0) {
+            _log.trace("created shard %s", path.c_str());
+        }
+        else if (errno != EEXIST) {
+            _log.error("mkdir %s failed errno=%d", path.c_str(), errno);
+            continue;
+        }
+
+        while(shard > curLastShard && !lastShardCreated.compare_exchange_weak(curLastShard, shard)) {
+        }
+    }
+}
+
+void SequentialFile::shardRelease(int fromFileNum, int toFileNum) {
+    if (!isReserveTracked()) {
+        return;
+    }
+
+    os_mutex_lock(shardMutex);
+    shardReserved.removeRange(fromFileNum, toFileNum);
+    os_mutex_unlock(shardMutex);
+}
+
+bool SequentialFile::isReserved(int fileNum) {
+    os_mutex_lock(shardMutex);
+    bool result = shardReserved.contains(fileNum);
+    os_mutex_unlock(shardMutex);
+
+    return result;
+}
+
+bool SequentialFile::isShardRemovable(int shard) {
+    int shardLast = shard * shardSize + shardSize - 1;
+
+    os_mutex_lock(shardMutex);
+    // Numbers above lastFileNum have not been reserved yet, and createShardDirs() does not
+    // create a shard again once lastShardCreated is past it
+    int firstOutstanding = lastFileNum + 1;
+    if (!shardReserved.empty() && shardReserved.getRuns()[0].first < firstOutstanding) {
+        firstOutstanding = shardReserved.getRuns()[0].first;
+    }
+    bool result = shardLast < firstOutstanding;
+    os_mutex_unlock(shardMutex);
+
+    return result;
+}
+
+void SequentialFile::removeEmptyShards(const std::vector<int> &shards) {
+    for(auto it = shards.begin(); it != shards.end(); it++) {
+        if (isShardRemovable(*it)) {
+            // Fails if there are other files in the shard, which is fine
+            rmdir(getShardPath(*it));
+        }
+    }
+}
+
+void SequentialFile::removeFileNum(int fileNum, bool allExtensions) {
+    removeFileNums(fileNum, fileNum, allExtensions);
+}
+
+void SequentialFile::removeFileNums(int fromFileNum, int toFileNum, bool allExtensions) {
+    if (fromFileNum > toFileNum) {
+        return;
+    }
+
+    statsCount(&SequentialFileStats::removeCount, toFileNum - fromFileNum + 1);
+    shardRelease(fromFileNum, toFileNum);
+
+    if (shardSize > 0) {
+        int toShard = getShardForFileNum(toFileNum);
+        for(int shard = getShardForFileNum(fromFileNum); shard <= toShard; shard++) {
+            int shardFirst = shard * shardSize;
+            int shardLast = shardFirst + shardSize - 1;
+            String shardPath = getShardPath(shard);
+
+            if (allExtensions && fromFileNum <= shardFirst && toFileNum >= shardLast) {
+                // Removing every file in the shard, so just empty it and remove the directory
+                removeDirFiles(shardPath);
+            }
+            else {
+                removeFileNumsInDir(shardPath, std::max(fromFileNum, shardFirst), std::min(toFileNum, shardLast), allExtensions);
+            }
+
+            if (toFileNum >= shardLast && isShardRemovable(shard)) {
+                // Fails if some files in the shard are still in the queue; scanDir() removes 
+                // it later if it's empty
+                if (rmdir(shardPath) == 0) {
+                    _log.trace("removed shard %s", shardPath.c_str());
+                }
+            }
+        }
+    }
+    else {
+        removeFileNumsInDir(dirPath, fromFileNum, toFileNum, allExtensions);
+    }
+
+    indexAppend(INDEX_RECORD_REMOVE, fromFileNum, toFileNum - fromFileNum + 1);
+}
+
+void SequentialFile::removeFileNumsInDir(const char *path, int fromFileNum, int toFileNum, bool allExtensions) {
+    if (allExtensions && sidecarExtensions.empty()) {
+        // Extensions are not known, so find them in a single pass through the directory
+        DIR *dir = opendir(path);
+        if (dir) {
+            while(true) {
+                struct dirent* ent = readdir(dir); 
+                if (!ent) {
+                    break;
+                }
+                
+                if (ent->d_type != DT_REG) {
+                    // Not a plain file
+                    continue;
+                }
+                
+                int curFileNum;
+                if (parseFileNum(ent->d_name, curFileNum, true)) {
+                    if (curFileNum >= fromFileNum && curFileNum <= toFileNum) {
+                        String filePath = String(path) + String("/") + ent->d_name;
+                        unsigned long startUs = micros();
+                        // Only queue files are pooled, not sidecar files
+                        int tempFileNum;
+                        removeFile(filePath, parseFileNum(ent->d_name, tempFileNum, false));
+                        statsTime(&SequentialFileStats::unlinkTime, startUs);
+                        _log.trace("removed %s", filePath.c_str());
+                    }
+                }
+            }
+            closedir(dir);
+        }
+    }
+    else {
+        for(int fileNum = fromFileNum; fileNum <= toFileNum; fileNum++) {
+            unlinkFileNum(fileNum, NULL);
+
+            // The file could be in any priority lane
+            for(size_t lane = 0; lane < lanes.size(); lane++) {
+                if (lanes[lane].queue) {
+                    unlinkFileNum(fileNum, lanes[lane].ext);
+                }
+            }
+
+            if (allExtensions) {
+                for(auto it = sidecarExtensions.begin(); it != sidecarExtensions.end(); it++) {
+                    unlinkFileNum(fileNum, *it);
+                }
+            }
+        }
+    }
+}
+
+// [static]
+void SequentialFile::removeDirFiles(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir) {
+        while(true) {
+            struct dirent* ent = readdir(dir); 
+            if (!ent) {
+                break;
+            }
+            
+            if (ent->d_type != DT_REG) {
+                // Not a plain file
+                continue;
+            }
+            
+            char buf[PATH_BUF_SIZE];
+            String pathStr;
+            const char *filePath = buf;
+            if (!joinPath(buf, sizeof(buf), path, ent->d_name)) {
+                // Too long for the stack buffer
+                pathStr = String(path) + String("/") + ent->d_name;
+                filePath = pathStr.c_str();
+            }
+            unlink(filePath);
+            _log.trace("removed %s", filePath);
+        }
+        closedir(dir);
+    }    
+}
+
+int SequentialFile::unlinkFileNum(int fileNum, const char *overrideExt) {
+    char buf[PATH_BUF_SIZE];
+    String pathStr;
+    const char *path = buf;
+
+    if (!getPathForFileNum(fileNum, buf, sizeof(buf), overrideExt)) {
+        // Too long for the stack buffer
+        pathStr = getPathForFileNum(fileNum, overrideExt);
+        path = pathStr.c_str();
+    }
+
+    // Only queue files are pooled, not sidecar files
+    bool poolable = (overrideExt == NULL);
+    for(size_t lane = 0; lane < lanes.size() && !poolable; lane++) {
+        poolable = (lanes[lane].ext == overrideExt);
+    }
+
+    unsigned long startUs = micros();
+    int result = removeFile(path, poolable);
+
+    // Not all sidecar files exist for every fileNum, so only log the ones removed
+    if (result == 0) {
+        statsTime(&SequentialFileStats::unlinkTime, startUs);
+        _log.trace("removed %s", path);
+    }
+    return result;
+}
+
+int SequentialFile::removeFile(const char *path, bool poolable) {
+    if (poolable && poolSize > 0 && poolPut(path)) {
+        return 0;
+    }
+    return unlink(path);
+}
+
+String SequentialFile::getPoolPath(size_t slot) const {
+    return dirPath + String("/") + POOL_FILENAME_PREFIX + String((int)slot);
+}
+
+void SequentialFile::poolLoad() {
+    os_mutex_lock(poolMutex);
+
+    // Created now, during the scan, so Writer::begin() does not have to create them later
+    poolFiles.assign(poolSize, false);
+    for(size_t slot = 0; slot < poolSize; slot++) {
+        String slotPath = getPoolPath(slot);
+        struct stat statbuf;
+        if (stat(slotPath, &statbuf) == 0) {
+            poolFiles[slot] = true;
+            continue;
+        }
+
+        int fd = open(slotPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd >= 0) {
+            close(fd);
+            poolFiles[slot] = true;
+        }
+        else {
+            _log.error("failed to create %s errno=%d", slotPath.c_str(), errno);
+        }
+    }
+
+    os_mutex_unlock(poolMutex);
+}
+
+bool SequentialFile::poolTake(const char *path) {
+    bool result = false;
+
+    os_mutex_lock(poolMutex);
+    for(size_t slot = 0; slot < poolFiles.size(); slot++) {
+        if (!poolFiles[slot]) {
+            continue;
+        }
+
+        // Either way the slot is free now; a failed rename means the spare file is gone
+        poolFiles[slot] = false;
+        String slotPath = getPoolPath(slot);
+        if (rename(slotPath, path) == 0) {
+            result = true;
+            break;
+        }
+        _log.info("failed to rename %s errno=%d", slotPath.c_str(), errno);
+    }
+    os_mutex_unlock(poolMutex);
+
+    if (result) {
+        statsCount(&SequentialFileStats::poolTakeCount, 1);
+    }
+    return result;
+}
+
+bool SequentialFile::poolPut(const char *path) {
+    bool result = false;
+
+    os_mutex_lock(poolMutex);
+    for(size_t slot = 0; slot < poolFiles.size(); slot++) {
+        if (poolFiles[slot]) {
+            continue;
+        }
+
+        String slotPath = getPoolPath(slot);
+        if (rename(path, slotPath) != 0) {
+            // Usually the file does not exist; unlink() is tried instead
+            break;
+        }
+
+        // Emptied so the data blocks are released, while the file itself is kept
+        int fd = open(slotPath, O_WRONLY | O_TRUNC);
+        if (fd >= 0) {
+            close(fd);
+            poolFiles[slot] = true;
+        }
+        else {
+            _log.info("failed to truncate %s errno=%d", slotPath.c_str(), errno);
+            unlink(slotPath);
+        }
+        result = true;
+        break;
+    }
+    os_mutex_unlock(poolMutex);
+
+    if (result) {
+        statsCount(&SequentialFileStats::poolPutCount, 1);
+    }
+    return result;
+}
+
+size_t SequentialFile::getFilePoolAvailable() const {
+    size_t count = 0;
+
+    os_mutex_lock(poolMutex);
+    for(size_t slot = 0; slot < poolFiles.size(); slot++) {
+        if (poolFiles[slot]) {
+            count++;
+        }
+    }
+    os_mutex_unlock(poolMutex);
+
+    return count;
+}
+
+void SequentialFile::removeAll(bool removeDir) {
+    // Waits for scanDirAsync() to complete
+    os_mutex_lock(scanMutex);
+
+    if (step.op == StepState::Op::SCAN) {
+        std::vector<SequentialFileRunSet> laneFileNums(getNumLanes());
+        scanAsyncFinish(laneFileNums, false);
+    }
+    // Also ends a removeAllStep() in progress
+    stepClose();
+
+    // The index file is removed along with the other files and recreated by scanDir()
+    indexMutexLock();
+    indexClose();
+    indexMutexUnlock();
+
+    if (fastRemoveAll && tombstoneDir(removeDir)) {
+        // Files are deleted by the tombstone thread
+    }
+    else
+    if (shardSize > 0) {
+        DIR *dir = opendir(dirPath);
+        if (dir) {
+            while(true) {
+                struct dirent* ent = readdir(dir); 
+                if (!ent) {
+                    break;
+                }
+                
+                int shard;
+                if (ent->d_type == DT_DIR && parseShard(ent->d_name, shard)) {
+                    String shardPath = dirPath + String("/") + ent->d_name;
+                    removeDirFiles(shardPath);
+                    rmdir(shardPath);
+                }
+            }
+            closedir(dir);
+        }
+        lastShardCreated = -1;
+        removeDirFiles(dirPath);
+    }
+    else {
+        removeDirFiles(dirPath);
+    }
+
+    removeAllFinish(removeDir);
+
+    os_mutex_unlock(scanMutex);
+}
+
+SequentialFile::StepResult SequentialFile::removeAllStep(bool removeDir, size_t maxEntries, system_tick_t maxMs) {
+    // Waits for scanDirAsync() to complete
+    os_mutex_lock(scanMutex);
+
+    if (step.op == StepState::Op::SCAN) {
+        // The files found so far are not queued
+        stepClose();
+        std::vector<SequentialFileRunSet> laneFileNums(getNumLanes());
+        scanAsyncFinish(laneFileNums, false);
+        _log.info("scanDirStep() abandoned by removeAllStep()");
+    }
+
+    if (step.op == StepState::Op::NONE) {
+        indexMutexLock();
+        indexClose();
+        indexMutexUnlock();
+
+        // Emptied now so consumers don't get files that are about to be removed
+        queueMutexLock();
+        queueClear();
+        queueMutexUnlock();
+
+        if (fastRemoveAll && tombstoneDir(removeDir)) {
+            // Files are deleted by the tombstone thread
+            removeAllFinish(removeDir);
+            os_mutex_unlock(scanMutex);
+            return StepResult::DONE;
+        }
+        if (shardSize > 0) {
+            lastShardCreated = -1;
+        }
+
+        step.op = StepState::Op::REMOVE;
+        step.path = dirPath;
+        step.dir = opendir(dirPath);
+    }
+
+    system_tick_t startMs = millis();
+    size_t numEntries = 0;
+    StepResult result = StepResult::IN_PROGRESS;
+
+    while((maxEntries == 0 || numEntries < maxEntries) && (maxMs == 0 || millis() - startMs < maxMs)) {
+        struct dirent* ent = step.dir ? readdir(step.dir) : NULL;
+        numEntries++;
+
+        if (!ent) {
+            if (step.dir) {
+                closedir(step.dir);
+                step.dir = NULL;
+            }
+            if (step.topDir) {
+                // Done with a shard directory, continue with the queue directory
+                rmdir(step.path);
+                step.dir = step.topDir;
+                step.topDir = NULL;
+                step.path = dirPath;
+                continue;
+            }
+
+            removeAllFinish(removeDir);
+            stepClose();
+            result = StepResult::DONE;
+            break;
+        }
+
+        int shard;
+        if (ent->d_type == DT_REG) {
+            char buf[PATH_BUF_SIZE];
+            String pathStr;
+            const char *filePath = buf;
+            if (!joinPath(buf, sizeof(buf), step.path, ent->d_name)) {
+                // Too long for the stack buffer
+                pathStr = step.path + String("/") + ent->d_name;
+                filePath = pathStr.c_str();
+            }
+            unlink(filePath);
+            _log.trace("removed %s", filePath);
+        }
+        else
+        if (ent->d_type == DT_DIR && shardSize > 0 && !step.topDir && parseShard(ent->d_name, shard)) {
+            String shardPath = dirPath + String("/") + ent->d_name;
+            DIR *shardDir = opendir(shardPath);
+            if (shardDir) {
+                step.topDir = step.dir;
+                step.dir = shardDir;
+                step.path = shardPath;
+            }
+        }
+    }
+
+    os_mutex_unlock(scanMutex);
+
+    return result;
+}
+
+void SequentialFile::queueClear() {
+    for(size_t lane = 0; lane < getNumLanes(); lane++) {
+        getLaneQueue(lane)->clear();
+    }
+    inFlight.clear();
+    groupFiles.clear();
+    for(auto it = groups.begin(); it != groups.end(); it++) {
+        it->cursor = 0;
+        it->acked.clear();
+    }
+
+    os_mutex_lock(metaMutex);
+    metaEntries.clear();
+    queuedBytes = 0;
+    os_mutex_unlock(metaMutex);
+}
+
+void SequentialFile::removeAllFinish(bool removeDir) {
+    queueMutexLock();
+
+    queueClear();
+
+    if (removeDir) {
+        rmdir(dirPath);
+    }
+    lastFileNum = 0;
+    highWaterMarkSaved = 0;
+    scanDirCompleted = false;
+
+    queueMutexUnlock();
+
+    os_mutex_lock(shardMutex);
+    shardReserved.clear();
+    os_mutex_unlock(shardMutex);
+
+    // The spare files were removed with the other files; they are created again by the next scan
+    os_mutex_lock(poolMutex);
+    poolFiles.clear();
+    os_mutex_unlock(poolMutex);
+
+    spaceSignal();
+}
+
+bool SequentialFile::tombstoneDir(bool removeDir) {
+    String tombstonePath;
+    struct stat statbuf;
+
+    // A previous tombstone directory may still be being deleted
+    for(int gen = 1; ; gen++) {
+        if (gen > 100) {
+            return false;
+        }
+        tombstonePath = dirPath + TOMBSTONE_SUFFIX + String(gen);
+        if (stat(tombstonePath, &statbuf) != 0) {
+            break;
+        }
+    }
+
+    if (rename(dirPath, tombstonePath) != 0) {
+        _log.info("could not rename %s errno=%d, removing files", dirPath.c_str(), errno);
+        return false;
+    }
+    _log.trace("renamed %s to %s", dirPath.c_str(), tombstonePath.c_str());
+
+    if (!removeDir) {
+        createDirIfNecessary(dirPath);
+    }
+    lastShardCreated = -1;
+
+    os_mutex_lock(tombstoneMutex);
+    tombstones.push_back(tombstonePath);
+    os_mutex_unlock(tombstoneMutex);
+
+    tombstoneStart();
+    return true;
+}
+
+void SequentialFile::tombstoneResume() {
+    tombstoneResumed = true;
+
+    const char *slash = strrchr(dirPath.c_str(), '/');
+    if (!slash) {
+        return;
+    }
+    String parentPath = (slash == dirPath.c_str()) ? String("/") : dirPath.substring(0, slash - dirPath.c_str());
+    String prefix = String(slash + 1) + TOMBSTONE_SUFFIX;
+
+    DIR *dir = opendir(parentPath);
+    if (!dir) {
+        return;
+    }
+
+    os_mutex_lock(tombstoneMutex);
+    while(true) {
+        struct dirent* ent = readdir(dir); 
+        if (!ent) {
+            break;
+        }
+
+        int gen;
+        if (ent->d_type == DT_DIR && strncmp(ent->d_name, prefix, prefix.length()) == 0 && 
+            parseShard(&ent->d_name[prefix.length()], gen)) {
+            String tombstonePath = dirPath + TOMBSTONE_SUFFIX + String(gen);
+            if (std::find(tombstones.begin(), tombstones.end(), tombstonePath) == tombstones.end()) {
+                _log.info("removing %s left over from before a reset", tombstonePath.c_str());
+                tombstones.push_back(tombstonePath);
+            }
+        }
+    }
+    os_mutex_unlock(tombstoneMutex);
+    closedir(dir);
+
+    tombstoneStart();
+}
+
+void SequentialFile::tombstoneStart() {
+    os_mutex_lock(tombstoneMutex);
+    if (!tombstoneRunning && !tombstones.empty()) {
+        if (tombstoneThreadStarted) {
+            // Previous thread has exited or is about to, since tombstoneRunning is false
+            os_thread_join(tombstoneThread);
+            tombstoneThreadStarted = false;
+        }
+
+        tombstoneRunning = true;
+        if (os_thread_create(&tombstoneThread, "seqrm", tombstonePriority, tombstoneThreadFunction, this, TOMBSTONE_STACK_SIZE) == 0) {
+            tombstoneThreadStarted = true;
+        }
+        else {
+            _log.error("failed to create tombstone thread");
+            tombstoneRunning = false;
+        }
+    }
+    os_mutex_unlock(tombstoneMutex);
+}
+
+// [static]
+void SequentialFile::tombstoneThreadFunction(void *param) {
+    SequentialFile *sf = (SequentialFile *)param;
+
+    while(true) {
+        os_mutex_lock(sf->tombstoneMutex);
+        if (sf->tombstones.empty() || sf->tombstoneStop) {
+            // Cleared with the mutex locked so tombstoneStart() starts a new thread if needed
+            sf->tombstoneRunning = false;
+            os_mutex_unlock(sf->tombstoneMutex);
+            break;
+        }
+        String path = sf->tombstones.front();
+        os_mutex_unlock(sf->tombstoneMutex);
+
+        sf->removeTree(path);
+
+        if (!sf->tombstoneStop) {
+            _log.trace("removed %s", path.c_str());
+
+            os_mutex_lock(sf->tombstoneMutex);
+            sf->tombstones.pop_front();
+            os_mutex_unlock(sf->tombstoneMutex);
+        }
+    }
+
+    os_thread_exit(NULL);
+}
+
+void SequentialFile::removeTree(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir) {
+        while(!tombstoneStop) {
+            struct dirent* ent = readdir(dir); 
+            if (!ent) {
+                break;
+            }
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+
+            char buf[PATH_BUF_SIZE];
+            String pathStr;
+            const char *entPath = buf;
+            if (!joinPath(buf, sizeof(buf), path, ent->d_name)) {
+                // Too long for the stack buffer
+                pathStr = String(path) + String("/") + ent->d_name;
+                entPath = pathStr.c_str();
+            }
+
+            if (ent->d_type == DT_DIR) {
+                // Shard subdirectories
+                removeTree(entPath);
+            }
+            else {
+                unlink(entPath);
+            }
+        }
+        closedir(dir);
+    }
+
+    if (!tombstoneStop) {
+        rmdir(path);
+    }
+}
+
+int SequentialFile::getQueueLen() const {
+    size_t size = 0;
+
+    queueContainerLock();
+    for(size_t lane = 0; lane < getNumLanes(); lane++) {
+        size += getLaneQueue(lane)->size();
+    }
+    queueContainerUnlock();
+
+    return (int) size;
+}
+
+int SequentialFile::getQueueLen(int priority) const {
+    int lane = findLane(priority);
+    if (lane < 0) {
+        return 0;
+    }
+
+    queueContainerLock();
+    int size = (int) getLaneQueue(lane)->size();
+    queueContainerUnlock();
+
+    return size;
+}
+
+
+bool SequentialFile::isQueueFull(size_t addFiles, uint64_t addBytes) const {
+    size_t held = 0;
+    if (maxFiles > 0) {
+        // Files in flight or waiting for a consumer group are still in the queue directory
+        queueMutexLock();
+        held = inFlight.size() + groupFiles.size();
+        queueMutexUnlock();
+    }
+    if (maxFiles > 0 && (size_t) getQueueLen() + held + addFiles > maxFiles) {
+        return true;
+    }
+    if (maxBytes > 0 && getQueuedBytes() + addBytes > maxBytes) {
+        return true;
+    }
+    if (manager && manager->isQuotaFull(addBytes)) {
+        return true;
+    }
+    return false;
+}
+
+bool SequentialFile::hasQueueLimit() const {
+    return maxFiles > 0 || maxBytes > 0 || (manager && manager->getMaxBytes() > 0);
+}
+
+bool SequentialFile::isAdmitChecked() const {
+    // DROP_OLDEST makes room instead when the file is queued
+    return hasQueueLimit() && overflowPolicy != OverflowPolicy::DROP_OLDEST;
+}
+
+bool SequentialFile::admitLock(size_t addFiles, uint64_t addBytes, bool wait) {
+    os_mutex_t mutex = manager ? manager->admitMutex : admitMutex;
+
+    if ((maxFiles > 0 && addFiles > maxFiles) || (maxBytes > 0 && addBytes > maxBytes) || 
+        (manager && manager->getMaxBytes() > 0 && addBytes > manager->getMaxBytes())) {
+        // Never fits, even in an empty queue
+        return false;
+    }
+
+    system_tick_t startMs = millis();
+
+    while(true) {
+        os_mutex_lock(mutex);
+        if (!isQueueFull(addFiles, addBytes)) {
+            // Left locked until admitUnlock()
+            return true;
+        }
+        os_mutex_unlock(mutex);
+
+        if (!wait || overflowPolicy != OverflowPolicy::BLOCK) {
+            return false;
+        }
+
+        system_tick_t waitMs = CONCURRENT_WAIT_FOREVER;
+        if (blockTimeoutMs != CONCURRENT_WAIT_FOREVER) {
+            system_tick_t elapsedMs = millis() - startMs;
+            if (elapsedMs >= blockTimeoutMs) {
+                _log.info("queue full, timed out waiting to add");
+                return false;
+            }
+            waitMs = blockTimeoutMs - elapsedMs;
+        }
+
+        // Signaled when files are taken from the queue
+        os_semaphore_take(spaceSemaphore, waitMs, false);
+    }
+}
+
+void SequentialFile::admitUnlock() {
+    os_mutex_unlock(manager ? manager->admitMutex : admitMutex);
+}
+
+bool SequentialFile::evictOldest() {
+    if (queue->isLockFree() && lanes.empty()) {
+        // Only the consumer thread can take files from a lock-free queue
+        _log.error("DROP_OLDEST is not supported with a lock-free queue");
+        return false;
+    }
+
+    int fileNum = 0;
+
+    queueContainerLock();
+    for(size_t lane = getNumLanes(); lane-- > 0; ) {
+        SequentialFileQueue *laneQueue = getLaneQueue(lane);
+        if (!laneQueue->empty()) {
+            fileNum = laneQueue->front();
+            laneQueue->pop_front();
+            break;
+        }
+    }
+    queueContainerUnlock();
+
+    if (fileNum == 0) {
+        return false;
+    }
+
+    metaTake(fileNum, NULL);
+
+    _log.info("queue full, removing %d", fileNum);
+
+    // Sidecar files are only removed if their extensions are known, to avoid reading the directory
+    removeFileNum(fileNum, !sidecarExtensions.empty());
+    return true;
+}
+
+void SequentialFile::evictIfFull(size_t addFiles, uint64_t addBytes) {
+    if (overflowPolicy != OverflowPolicy::DROP_OLDEST || !hasQueueLimit()) {
+        return;
+    }
+
+    while(isQueueFull(addFiles, addBytes) && evictOldest()) {
+    }
+}
+
+bool SequentialFile::inFlightRemove(int fileNum, InFlight &entry) {
+    // Usually acknowledged in the order acquired, so the entry is near the front
+    for(auto it = inFlight.begin(); it != inFlight.end(); it++) {
+        if (it->fileNum == fileNum) {
+            entry = *it;
+            inFlight.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void SequentialFile::inFlightRequeue(const InFlight &entry) {
+    SequentialFileQueue *laneQueue = getLaneQueue(entry.lane);
+
+    if (laneQueue->push_front(entry.fileNum)) {
+        return;
+    }
+    if (laneQueue->push_back(entry.fileNum)) {
+        _log.info("container does not support push_front, %d returned to the back of the queue", entry.fileNum);
+        return;
+    }
+    // Still on disk, so it's found by the next scanDir()
+    _log.error("queue full, %d not returned to the queue", entry.fileNum);
+}
+
+void SequentialFile::requeueFiles(const int *fileNums, const int *priorities, size_t count) {
+    if (queue->isLockFree() && lanes.empty()) {
+        // Only the producer thread can add files to a lock-free queue
+        if (count > 0) {
+            _log.info("%u files not returned to a lock-free queue, found by the next scanDir()", count);
+        }
+        return;
+    }
+
+    std::vector<int> fileLanes(count);
+    for(size_t ii = 0; ii < count; ii++) {
+        fileLanes[ii] = findLane(priorities[ii]);
+        if (fileLanes[ii] >= 0 && metadata) {
+            // Added before the file is queued so a consumer always finds it
+            SequentialFileMeta meta;
+            statFileMeta(fileNums[ii], meta, getLaneExt(fileLanes[ii]));
+            metaInsert(fileNums[ii], meta);
+        }
+    }
+
+    queueContainerLock();
+
+    // In reverse, so the files are back at the front of the queue in their original order
+    std::vector<bool> pushed(count, false);
+    for(size_t ii = count; ii-- > 0; ) {
+        if (fileLanes[ii] >= 0) {
+            pushed[ii] = getLaneQueue(fileLanes[ii])->push_front(fileNums[ii]);
+        }
+    }
+    for(size_t ii = 0; ii < count; ii++) {
+        if (fileLanes[ii] < 0 || pushed[ii]) {
+            continue;
+        }
+        if (getLaneQueue(fileLanes[ii])->push_back(fileNums[ii])) {
+            _log.info("container does not support push_front, %d returned to the back of the queue", fileNums[ii]);
+        }
+        else {
+            // Still on disk, so it's found by the next scanDir()
+            _log.error("queue full, %d not returned to the queue", fileNums[ii]);
+            metaTake(fileNums[ii], NULL);
+        }
+    }
+    statsQueueLen();
+
+    queueContainerUnlock();
+
+    if (count > 0) {
+        queueSignal();
+    }
+}
+
+void SequentialFile::groupDrain() {
+    for(size_t lane = 0; lane < getNumLanes(); lane++) {
+        SequentialFileQueue *laneQueue = getLaneQueue(lane);
+        while(!laneQueue->empty()) {
+            groupFiles.insert(laneQueue->front());
+            laneQueue->pop_front();
+        }
+    }
+}
+
+void SequentialFile::groupPrune(const std::vector<SequentialFileRunSet> &laneFileNums) {
+    for(auto it = groups.begin(); it != groups.end(); it++) {
+        it->acked = runSetIntersect(it->acked, laneFileNums.data(), laneFileNums.size());
+    }
+}
+
+void SequentialFile::spaceSignal() {
+    if (manager && manager->getMaxBytes() > 0) {
+        // Space freed in any queue counts toward the shared quota
+        manager->spaceSignal();
+    }
+    else
+    if (overflowPolicy == OverflowPolicy::BLOCK && hasQueueLimit()) {
+        os_semaphore_give(spaceSemaphore, false);
+    }
+}
+
+bool SequentialFile::getFileMeta(int fileNum, SequentialFileMeta &meta) const {
+    if (!metadata) {
+        return false;
+    }
+
+    bool found = false;
+
+    os_mutex_lock(metaMutex);
+    auto it = std::lower_bound(metaEntries.begin(), metaEntries.end(), fileNum, 
+        [](const MetaEntry &entry, int fileNum) { return entry.fileNum < fileNum; });
+    if (it != metaEntries.end() && it->fileNum == fileNum) {
+        meta = it->meta;
+        found = true;
+    }
+    os_mutex_unlock(metaMutex);
+
+    return found;
+}
+
+uint64_t SequentialFile::getQueuedBytes() const {
+    os_mutex_lock(metaMutex);
+    uint64_t result = queuedBytes;
+    os_mutex_unlock(metaMutex);
+
+    return result;
+}
+
+bool SequentialFile::statFileMeta(int fileNum, SequentialFileMeta &meta, const char *overrideExt) {
+    char buf[PATH_BUF_SIZE];
+    String pathStr;
+    const char *path = buf;
+
+    if (!getPathForFileNum(fileNum, buf, sizeof(buf), overrideExt)) {
+        // Too long for the stack buffer
+        pathStr = getPathForFileNum(fileNum, overrideExt);
+        path = pathStr.c_str();
+    }
+
+    struct stat sb;
+    if (stat(path, &sb) != 0) {
+        return false;
+    }
+    meta.size = (uint32_t) sb.st_size;
+    meta.mtime = (uint32_t) sb.st_mtime;
+    return true;
+}
+
+void SequentialFile::metaInsert(int fileNum, const SequentialFileMeta &meta) {
+    if (!metadata) {
+        return;
+    }
+
+    os_mutex_lock(metaMutex);
+    // Files are usually added in increasing order, so check the end first
+    auto it = metaEntries.end();
+    if (!metaEntries.empty() && metaEntries.back().fileNum >= fileNum) {
+        it = std::lower_bound(metaEntries.begin(), metaEntries.end(), fileNum, 
+            [](const MetaEntry &entry, int fileNum) { return entry.fileNum < fileNum; });
+    }
+    if (it != metaEntries.end() && it->fileNum == fileNum) {
+        queuedBytes -= it->meta.size;
+        it->meta = meta;
+    }
+    else {
+        MetaEntry entry;
+        entry.fileNum = fileNum;
+        entry.meta = meta;
+        metaEntries.insert(it, entry);
+    }
+    queuedBytes += meta.size;
+    os_mutex_unlock(metaMutex);
+}
+
+void SequentialFile::metaTake(int fileNum, SequentialFileMeta *meta) {
+    if (!metadata) {
+        return;
+    }
+
+    os_mutex_lock(metaMutex);
+    // Files are usually taken from the front
+    auto it = metaEntries.begin();
+    if (it != metaEntries.end() && it->fileNum != fileNum) {
+        it = std::lower_bound(metaEntries.begin(), metaEntries.end(), fileNum, 
+            [](const MetaEntry &entry, int fileNum) { return entry.fileNum < fileNum; });
+    }
+    if (it != metaEntries.end() && it->fileNum == fileNum) {
+        if (meta) {
+            *meta = it->meta;
+        }
+        queuedBytes -= it->meta.size;
+        metaEntries.erase(it);
+    }
+    os_mutex_unlock(metaMutex);
+}
+
+SequentialFileStats SequentialFile::getStats() const {
+    os_mutex_lock(statsMutex);
+    SequentialFileStats result = stats;
+    os_mutex_unlock(statsMutex);
+
+    return result;
+}
+
+void SequentialFile::resetStats() {
+    os_mutex_lock(statsMutex);
+    stats = SequentialFileStats();
+    os_mutex_unlock(statsMutex);
+}
+
+void SequentialFile::statsCount(uint32_t SequentialFileStats::*counter, size_t count) const {
+    if (collectStats) {
+        os_mutex_lock(statsMutex);
+        stats.*counter += count;
+        os_mutex_unlock(statsMutex);
+    }
+}
+
+void SequentialFile::statsTime(SequentialFileHistogram SequentialFileStats::*histogram, unsigned long startUs) const {
+    if (collectStats) {
+        uint32_t us = micros() - startUs;
+
+        os_mutex_lock(statsMutex);
+        (stats.*histogram).add(us);
+        os_mutex_unlock(statsMutex);
+    }
+}
+
+void SequentialFile::statsQueueLen() {
+    if (collectStats) {
+        size_t size = 0;
+        for(size_t lane = 0; lane < getNumLanes(); lane++) {
+            size += getLaneQueue(lane)->size();
+        }
+
+        os_mutex_lock(statsMutex);
+        if (size > stats.maxQueueLen) {
+            stats.maxQueueLen = size;
+        }
+        os_mutex_unlock(statsMutex);
+    }
+}
+
+void SequentialFile::statsScan(unsigned long startUs) {
+    if (collectStats) {
+        uint32_t us = micros() - startUs;
+
+        os_mutex_lock(statsMutex);
+        stats.scanTime.add(us);
+        stats.scanCount++;
+        stats.lastScanMs = us / 1000;
+        stats.lastScanEntries = scanEntries;
+        os_mutex_unlock(statsMutex);
+    }
+}
+
+void SequentialFile::queueMutexLock() const {
+    if (collectStats) {
+        unsigned long startUs = micros();
+        os_mutex_lock(queueMutex);
+        statsTime(&SequentialFileStats::queueMutexWait, startUs);
+    }
+    else {
+        os_mutex_lock(queueMutex);
+    }
+}
+
+void SequentialFile::queueMutexUnlock() const {
+    os_mutex_unlock(queueMutex);
+}
+
+void SequentialFile::queueContainerLock() const {
+    // The other priority lanes always use a container that requires locking
+    if (!queue->isLockFree() || !lanes.empty()) {
+        queueMutexLock();
+    }
+}
+
+void SequentialFile::queueContainerUnlock() const {
+    if (!queue->isLockFree() || !lanes.empty()) {
+        os_mutex_unlock(queueMutex);
+    }
+}
+
+void SequentialFile::queueSignal() {
+    os_semaphore_give(queueSemaphore, false);
+    if (manager) {
+        manager->queueSignal();
+    }
+}
+
+void SequentialFile::indexMutexLock() const {
+    os_mutex_lock(indexMutex);
+}
+
+void SequentialFile::indexMutexUnlock() const {
+    os_mutex_unlock(indexMutex);
+}
+
+String SequentialFile::getIndexPath() const {
+    return dirPath + String("/") + INDEX_FILENAME;
+}
+
+bool SequentialFile::indexLoad(SequentialFileRunSet &fileNums) {
+    int lastNum;
+    size_t recordCount;
+    std::vector<SequentialFileRunSet> groupAcked(groups.size());
+
+    indexMutexLock();
+    bool result = indexRead(fileNums, lastNum, recordCount, &groupAcked);
+    if (result) {
+        indexRecordCount = recordCount;
+        indexCompactAt = indexCompactThreshold;
+        if (recordCount >= indexCompactAt) {
+            result = indexWrite(fileNums, lastNum, &groupAcked);
+        }
+        else {
+            indexFd = open(getIndexPath(), O_WRONLY | O_APPEND);
+            result = (indexFd >= 0);
+        }
+    }
+    indexMutexUnlock();
+
+    if (!result) {
+        _log.info("index file not usable, scanning directory");
+        fileNums.clear();
+        return false;
+    }
+
+    updateLastFileNum(lastNum);
+
+    queueMutexLock();
+    for(size_t group = 0; group < groups.size(); group++) {
+        groups[group].acked = groupAcked[group];
+    }
+    queueMutexUnlock();
+
+    _log.trace("loaded %u files from index, lastFileNum=%d", fileNums.size(), lastFileNum.load());
+    return true;
+}
+
+void SequentialFile::setQueue(const std::vector<SequentialFileRunSet> &laneFileNums, bool append) {
+    bool queued = true;
+
+    if (metadata && append) {
+        for(size_t lane = 0; lane < laneFileNums.size(); lane++) {
+            const SequentialFileRunSet &fileNums = laneFileNums[lane];
+            for(auto it = fileNums.getRuns().begin(); it != fileNums.getRuns().end(); it++) {
+                for(int fileNum = it->first; fileNum <= it->last; fileNum++) {
+                    SequentialFileMeta meta;
+                    if (statFileMeta(fileNum, meta, getLaneExt(lane))) {
+                        metaInsert(fileNum, meta);
+                    }
+                }
+            }
+        }
+    }
+    else
+    if (metadata) {
+        // Built before locking since it calls stat() on each file
+        std::deque<MetaEntry> newEntries;
+        uint64_t newBytes = 0;
+
+        for(size_t lane = 0; lane < laneFileNums.size(); lane++) {
+            const SequentialFileRunSet &fileNums = laneFileNums[lane];
+            for(auto it = fileNums.getRuns().begin(); it != fileNums.getRuns().end(); it++) {
+                for(int fileNum = it->first; fileNum <= it->last; fileNum++) {
+                    MetaEntry entry;
+                    entry.fileNum = fileNum;
+                    if (statFileMeta(fileNum, entry.meta, getLaneExt(lane))) {
+                        newEntries.push_back(entry);
+                        newBytes += entry.meta.size;
+                    }
+                }
+            }
+        }
+        if (laneFileNums.size() > 1) {
+            // Each lane is in order, but the lanes are interleaved
+            std::sort(newEntries.begin(), newEntries.end(), 
+                [](const MetaEntry &a, const MetaEntry &b) { return a.fileNum < b.fileNum; });
+        }
+
+        os_mutex_lock(metaMutex);
+        metaEntries.swap(newEntries);
+        queuedBytes = newBytes;
+        os_mutex_unlock(metaMutex);
+    }
+
+    size_t size = 0;
+    size_t total = 0;
+
+    queueMutexLock();
+    if (!append) {
+        // In-flight files are still on disk, so they were found again
+        inFlight.clear();
+
+        // Consumer groups start over, skipping the files they acknowledged
+        groupFiles.clear();
+        for(auto it = groups.begin(); it != groups.end(); it++) {
+            it->cursor = 0;
+        }
+        groupPrune(laneFileNums);
+    }
+    for(size_t lane = 0; lane < laneFileNums.size(); lane++) {
+        const SequentialFileRunSet &fileNums = laneFileNums[lane];
+        SequentialFileQueue *laneQueue = getLaneQueue(lane);
+        bool laneQueued = true;
+
+        if (!append) {
+            laneQueue->clear();
+        }
+        for(auto it = fileNums.getRuns().begin(); it != fileNums.getRuns().end() && laneQueued; it++) {
+            laneQueued = laneQueue->push_back_range(it->first, it->last - it->first + 1);
+        }
+        if (!laneQueued) {
+            queued = false;
+        }
+        size += laneQueue->size();
+        total += fileNums.size();
+    }
+    statsQueueLen();
+    queueMutexUnlock();
+
+    if (size > 0) {
+        queueSignal();
+    }
+
+    if (!queued) {
+        _log.error("queue full, only %u of %u files queued", size, total);
+    }
+}
+
+bool SequentialFile::indexRead(SequentialFileRunSet &fileNums, int &lastNum, size_t &recordCount, std::vector<SequentialFileRunSet> *groupAcked) {
+    int fd = open(getIndexPath(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    IndexRecord buf[32];
+    bool result = true;
+    bool haveHeader = false;
+
+    fileNums.clear();
+    lastNum = 0;
+    recordCount = 0;
+    if (groupAcked) {
+        for(auto it = groupAcked->begin(); it != groupAcked->end(); it++) {
+            it->clear();
+        }
+    }
+
+    while(result) {
+        int count = read(fd, buf, sizeof(buf));
+        if (count <= 0) {
+            break;
+        }
+        // A partial record at the end is a write interrupted by a reset and is ignored
+        for(size_t ii = 0; ii < count / sizeof(IndexRecord); ii++) {
+            const IndexRecord &rec = buf[ii];
+            if (rec.crc != SequentialFile::crc32(&rec, offsetof(IndexRecord, crc))) {
+                _log.error("index checksum error at record %u", recordCount);
+                result = false;
+                break;
+            }
+            if (!haveHeader) {
+                if (rec.type != INDEX_RECORD_HEADER || rec.fileNum != INDEX_MAGIC || rec.count != INDEX_VERSION) {
+                    _log.error("invalid index header");
+                    result = false;
+                    break;
+                }
+                haveHeader = true;
+            }
+            
+            // Files still in the queue directory are the ones added, minus the ones removed
+            switch(rec.type & 0xff) {
+            case INDEX_RECORD_ADD:
+                if (rec.count > 0) {
+                    fileNums.insertRange(rec.fileNum, rec.fileNum + rec.count - 1);
+                    if (rec.fileNum + rec.count - 1 > lastNum) {
+                        lastNum = rec.fileNum + rec.count - 1;
+                    }
+                }
+                break;
+
+            case INDEX_RECORD_REMOVE:
+                if (rec.count > 0) {
+                    fileNums.removeRange(rec.fileNum, rec.fileNum + rec.count - 1);
+                }
+                break;
+
+            case INDEX_RECORD_LAST_NUM:
+                if (rec.fileNum > lastNum) {
+                    lastNum = rec.fileNum;
+                }
+                break;
+
+            case INDEX_RECORD_GROUP_ACK:
+                if (groupAcked && rec.count > 0 && (rec.type >> 8) < groupAcked->size()) {
+                    (*groupAcked)[rec.type >> 8].insertRange(rec.fileNum, rec.fileNum + rec.count - 1);
+                }
+                break;
+
+            default:
+                break;
+            }
+            recordCount++;
+        }
+    }
+    close(fd);
+
+    if (!haveHeader) {
+        result = false;
+    }
+    if (result && groupAcked) {
+        // Files that every group acknowledged were removed
+        for(auto it = groupAcked->begin(); it != groupAcked->end(); it++) {
+            *it = runSetIntersect(*it, &fileNums, 1);
+        }
+    }
+    return result;
+}
+
+bool SequentialFile::indexWrite(const SequentialFileRunSet &fileNums, int lastNum, const std::vector<SequentialFileRunSet> *groupAcked) {
+    indexClose();
+
+    std::vector<SequentialFileRunSet> ramAcked;
+    if (!groupAcked && !groups.empty()) {
+        queueMutexLock();
+        for(auto it = groups.begin(); it != groups.end(); it++) {
+            ramAcked.push_back(runSetIntersect(it->acked, &fileNums, 1));
+        }
+        queueMutexUnlock();
+        groupAcked = &ramAcked;
+    }
+
+    String path = getIndexPath();
+    String tempPath = path + ".tmp";
+
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        _log.error("failed to create %s errno=%d", tempPath.c_str(), errno);
+        return false;
+    }
+
+    IndexRecord buf[32];
+    size_t numRecords = 0;
+    size_t totalRecords = 0;
+    bool result = true;
+
+    auto flush = [&]() {
+        if (write(fd, buf, numRecords * sizeof(IndexRecord)) != (int)(numRecords * sizeof(IndexRecord))) {
+            _log.error("failed to write index errno=%d", errno);
+            result = false;
+        }
+        totalRecords += numRecords;
+        numRecords = 0;
+    };
+
+    indexRecordSet(buf[numRecords++], INDEX_RECORD_HEADER, INDEX_MAGIC, INDEX_VERSION);
+    indexRecordSet(buf[numRecords++], INDEX_RECORD_LAST_NUM, lastNum, 0);
+
+    // The files in the queue directory, then the files each consumer group has acknowledged
+    size_t numSets = 1 + (groupAcked ? groupAcked->size() : 0);
+    for(size_t set = 0; set < numSets && result; set++) {
+        const SequentialFileRunSet &runSet = (set == 0) ? fileNums : (*groupAcked)[set - 1];
+        uint32_t type = (set == 0) ? INDEX_RECORD_ADD : (INDEX_RECORD_GROUP_ACK | ((uint32_t)(set - 1) << 8));
+
+        const std::vector<SequentialFileRunSet::Run> &runs = runSet.getRuns();
+        for(auto it = runs.begin(); it != runs.end() && result; it++) {
+            indexRecordSet(buf[numRecords++], type, it->first, it->last - it->first + 1);
+            if (numRecords == sizeof(buf) / sizeof(buf[0])) {
+                flush();
+            }
+        }
+    }
+    if (result && numRecords > 0) {
+        flush();
+    }
+    close(fd);
+
+    if (result && rename(tempPath, path) != 0) {
+        _log.error("failed to rename index errno=%d", errno);
+        result = false;
+    }
+    if (!result) {
+        unlink(tempPath);
+        return false;
+    }
+
+    indexRecordCount = totalRecords;
+
+    // Don't compact again until the journal has grown enough to be worth it
+    indexCompactAt = std::max(indexCompactThreshold, indexRecordCount * 2);
+
+    indexFd = open(path, O_WRONLY | O_APPEND);
+    return (indexFd >= 0);
+}
+
+bool SequentialFile::indexCompact() {
+    SequentialFileRunSet fileNums;
+    int lastNum;
+    size_t recordCount;
+    std::vector<SequentialFileRunSet> groupAcked(groups.size());
+
+    indexClose();
+
+    if (!indexRead(fileNums, lastNum, recordCount, &groupAcked)) {
+        return false;
+    }
+    if (lastFileNum.load() > lastNum) {
+        lastNum = lastFileNum.load();
+    }
+    _log.trace("compacting index, %u records, %u files in %u runs", recordCount, fileNums.size(), fileNums.getRuns().size());
+
+    return indexWrite(fileNums, lastNum, &groupAcked);
+}
+
+void SequentialFile::indexAppend(uint32_t type, int fileNum, int count) {
+    if (!indexFile) {
+        return;
+    }
+
+    indexMutexLock();
+    if (indexFd < 0) {
+        // Index file is created by scanDir, and reopened if a previous append failed
+        indexFd = open(getIndexPath(), O_WRONLY | O_APPEND);
+    }
+    if (indexFd >= 0) {
+        IndexRecord rec;
+        indexRecordSet(rec, type, fileNum, count);
+
+        if (write(indexFd, &rec, sizeof(rec)) == sizeof(rec) && fsync(indexFd) == 0) {
+            if (++indexRecordCount >= indexCompactAt) {
+                indexCompact();
+            }
+        }
+        else {
+            _log.error("failed to append to index errno=%d", errno);
+            indexClose();
+        }
+    }
+    indexMutexUnlock();
+}
+
+void SequentialFile::indexClose() {
+    if (indexFd >= 0) {
+        close(indexFd);
+        indexFd = -1;
+    }
+}
+
+
+
+// [static]
+bool SequentialFile::createDirIfNecessary(const char *path) {
+    struct stat statbuf;
+
+    int result = stat(path, &statbuf);
+    if (result == 0) {
+        if ((statbuf.st_mode & S_IFDIR) != 0) {
+            _log.info("%s exists and is a directory", path);
+            return true;
+        }
+
+        _log.error("file in the way, deleting %s", path);
+        unlink(path);
+    }
+    else {
+        if (errno != ENOENT) {
+            // Error other than file does not exist
+            _log.error("stat filed errno=%d", errno);
+            return false;
+        }
+    }
+
+    // File does not exist (errno == 2)
+    result = mkdir(path, 0777);
+    if (result == 0) {
+        _log.info("created dir %s", path);
+        return true;
+    }
+    else {
+        _log.error("mkdir failed errno=%d", errno);
+        return false;
+    }
+}
+
+
+// [static]
+uint32_t SequentialFile::crc32(const void *data, size_t len, uint32_t crc) {
+    // CRC-32 (IEEE 802.3), using a 16 entry table to keep flash usage small
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    for(size_t ii = 0; ii < len; ii++) {
+        crc = (crc >> 4) ^ table[(crc ^ p[ii]) & 0x0f];
+        crc = (crc >> 4) ^ table[(crc ^ (p[ii] >> 4)) & 0x0f];
+    }
+    return ~crc;
+}
+
+// [static]
+size_t SequentialFile::lz4CompressBlock(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstSize, uint16_t *hashTable) {
+    if (srcLen > MAX_COMPRESSED_BLOCK_SIZE) {
+        return 0;
+    }
+
+    // Positions fit in 16 bits since the block is at most 64K, so every offset is valid
+    memset(hashTable, 0, LZ4_HASH_SIZE * sizeof(uint16_t));
+
+    auto hash = [](const uint8_t *p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return (size_t)((value * 2654435761u) >> 24) % LZ4_HASH_SIZE;
+    };
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    if (srcLen >= LZ4_MF_LIMIT) {
+        size_t ipLimit = srcLen - LZ4_MF_LIMIT;
+        size_t matchLimit = srcLen - LZ4_LAST_LITERALS;
+
+        while(ip <= ipLimit) {
+            size_t h = hash(&src[ip]);
+            size_t match = hashTable[h];
+            hashTable[h] = (uint16_t) ip;
+
+            if (match >= ip || memcmp(&src[match], &src[ip], LZ4_MIN_MATCH) != 0) {
+                ip++;
+                continue;
+            }
+
+            size_t matchLen = LZ4_MIN_MATCH;
+            while(ip + matchLen < matchLimit && src[match + matchLen] == src[ip + matchLen]) {
+                matchLen++;
+            }
+            while(ip > anchor && match > 0 && src[ip - 1] == src[match - 1]) {
+                ip--;
+                match--;
+                matchLen++;
+            }
+
+            if (!lz4AppendSequence(dst, dstSize, op, &src[anchor], ip - anchor, ip - match, matchLen)) {
+                return 0;
+            }
+            ip += matchLen;
+            anchor = ip;
+
+            if (ip - 2 <= ipLimit) {
+                // Improves the ratio for repeated data at little cost
+                hashTable[hash(&src[ip - 2])] = (uint16_t)(ip - 2);
+            }
+        }
+    }
+
+    if (!lz4AppendSequence(dst, dstSize, op, &src[anchor], srcLen - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+// [static]
+int SequentialFile::lz4DecompressBlock(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstSize) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    while(ip < srcLen) {
+        uint8_t token = src[ip++];
+
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !lz4ReadLength(src, srcLen, ip, litLen)) {
+            return -1;
+        }
+        if (litLen > srcLen - ip || litLen > dstSize - op) {
+            return -1;
+        }
+        memcpy(&dst[op], &src[ip], litLen);
+        ip += litLen;
+        op += litLen;
+
+        if (ip == srcLen) {
+            // The last sequence only has literals
+            break;
+        }
+
+        if (srcLen - ip < 2) {
+            return -1;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+
+        size_t matchLen = token & 0x0f;
+        if (matchLen == 15 && !lz4ReadLength(src, srcLen, ip, matchLen)) {
+            return -1;
+        }
+        matchLen += LZ4_MIN_MATCH;
+        if (matchLen > dstSize - op) {
+            return -1;
+        }
+
+        // Byte by byte since the match can overlap the data being written
+        for(size_t ii = 0; ii < matchLen; ii++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return (int) op;
+}
+
+// [static]
+bool SequentialFile::isCompressedHeader(const uint8_t *buf, size_t len) {
+    return len >= COMPRESSED_HEADER_SIZE && memcmp(buf, COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC)) == 0 && 
+        buf[sizeof(COMPRESSED_MAGIC)] == COMPRESSED_CODEC_LZ4;
+}
+
+// [static]
+String SequentialFile::getNameWithOptionalExt(const char *name, const char *ext) {
+    String result = name;
+
+    if (ext && *ext) {
+        result += ".";
+        result += ext;
+    }
+
+    return result;
+}
+
+
+void SequentialFileDigest::begin(SequentialFile::Digest type) {
+    static const uint32_t sha1Init[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+    this->type = type;
+    crc = 0;
+    memcpy(state, sha1Init, sizeof(state));
+    blockUsed = 0;
+    totalLen = 0;
+}
+
+void SequentialFileDigest::update(const void *data, size_t len) {
+    const uint8_t *src = (const uint8_t *)data;
+
+    switch(type) {
+    case SequentialFile::Digest::CRC32:
+        crc = SequentialFile::crc32(data, len, crc);
+        break;
+
+    case SequentialFile::Digest::SHA1:
+        totalLen += len;
+        while(len > 0) {
+            if (blockUsed == 0 && len >= sizeof(block)) {
+                // Whole blocks are processed in place
+                sha1Block(src);
+                src += sizeof(block);
+                len -= sizeof(block);
+                continue;
+            }
+            size_t count = sizeof(block) - blockUsed;
+            if (count > len) {
+                count = len;
+            }
+            memcpy(&block[blockUsed], src, count);
+            blockUsed += count;
+            src += count;
+            len -= count;
+            if (blockUsed == sizeof(block)) {
+                sha1Block(block);
+                blockUsed = 0;
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+size_t SequentialFileDigest::finishHex(char *buf, size_t bufSize) {
+    uint8_t digest[20];
+    size_t digestLen = 0;
+
+    switch(type) {
+    case SequentialFile::Digest::CRC32:
+        // Big endian, so the hex is the same as printing the value
+        for(size_t ii = 0; ii < 4; ii++) {
+            digest[ii] = (uint8_t)(crc >> (24 - ii * 8));
+        }
+        digestLen = 4;
+        break;
+
+    case SequentialFile::Digest::SHA1: {
+        uint64_t bitLen = totalLen * 8;
+
+        // Padding: 0x80, zeros, then the length in bits as a 64-bit big endian value
+        block[blockUsed++] = 0x80;
+        if (blockUsed > sizeof(block) - 8) {
+            memset(&block[blockUsed], 0, sizeof(block) - blockUsed);
+            sha1Block(block);
+            blockUsed = 0;
+        }
+        memset(&block[blockUsed], 0, sizeof(block) - 8 - blockUsed);
+        for(size_t ii = 0; ii < 8; ii++) {
+            block[sizeof(block) - 8 + ii] = (uint8_t)(bitLen >> (56 - ii * 8));
+        }
+        sha1Block(block);
+        blockUsed = 0;
+
+        for(size_t ii = 0; ii < 20; ii++) {
+            digest[ii] = (uint8_t)(state[ii / 4] >> (24 - (ii % 4) * 8));
+        }
+        digestLen = 20;
+        break;
+    }
+
+    default:
+        break;
+    }
+
+    if (digestLen == 0 || bufSize < digestLen * 2 + 1) {
+        return 0;
+    }
+
+    static const char hexDigits[] = "0123456789abcdef";
+    for(size_t ii = 0; ii < digestLen; ii++) {
+        buf[ii * 2] = hexDigits[digest[ii] >> 4];
+        buf[ii * 2 + 1] = hexDigits[digest[ii] & 0x0f];
+    }
+    buf[digestLen * 2] = 0;
+    return digestLen * 2;
+}
+
+void SequentialFileDigest::sha1Block(const uint8_t *data) {
+    uint32_t w[80];
+
+    for(size_t ii = 0; ii < 16; ii++) {
+        w[ii] = ((uint32_t)data[ii * 4] << 24) | ((uint32_t)data[ii * 4 + 1] << 16) | ((uint32_t)data[ii * 4 + 2] << 8) | data[ii * 4 + 3];
+    }
+    auto rotl = [](uint32_t value, int bits) { return (value << bits) | (value >> (32 - bits)); };
+    for(size_t ii = 16; ii < 80; ii++) {
+        w[ii] = rotl(w[ii - 3] ^ w[ii - 8] ^ w[ii - 14] ^ w[ii - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for(size_t ii = 0; ii < 80; ii++) {
+        uint32_t f, k;
+        if (ii < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else
+        if (ii < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else
+        if (ii < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t temp = rotl(a, 5) + f + e + k + w[ii];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+
+SequentialFile::Writer::Writer(SequentialFile &sequentialFile, size_t bufferSize) : 
+    sequentialFile(sequentialFile), bufferSize(bufferSize), freeBuffer(true) {
+    buffer = new uint8_t[bufferSize];
+}
+
+SequentialFile::Writer::Writer(SequentialFile &sequentialFile, uint8_t *buffer, size_t bufferSize) : 
+    sequentialFile(sequentialFile), buffer(buffer), bufferSize(bufferSize), freeBuffer(false) {
+}
+
+SequentialFile::Writer::~Writer() {
+    abort();
+
+    if (freeBuffer) {
+        delete[] buffer;
+    }
+    delete[] compressBuffer;
+    delete[] hashTable;
+}
+
+int SequentialFile::Writer::begin(const char *overrideExt) {
+    abort();
+
+    if (!buffer || bufferSize == 0) {
+        _log.error("no writer buffer");
+        return 0;
+    }
+
+    int newFileNum = sequentialFile.reserveFile();
+    if (newFileNum == 0) {
+        // Queue is full
+        return 0;
+    }
+    return beginReserved(newFileNum, overrideExt);
+}
+
+int SequentialFile::Writer::beginReserved(int newFileNum, const char *overrideExt) {
+    abort();
+
+    if (newFileNum == 0) {
+        return 0;
+    }
+    if (!buffer || bufferSize == 0) {
+        _log.error("no writer buffer");
+        sequentialFile.shardRelease(newFileNum, newFileNum);
+        return 0;
+    }
+
+    path = sequentialFile.getTempPathForFileNum(newFileNum, overrideExt);
+    finalPath = sequentialFile.getPathForFileNum(newFileNum, overrideExt);
+
+    // A spare file is empty, but O_TRUNC is still used in case it was not
+    sequentialFile.poolTake(path);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        _log.error("failed to create %s errno=%d", path.c_str(), errno);
+        // fileNum is not set, so abort() will not release the number either
+        sequentialFile.shardRelease(newFileNum, newFileNum);
+        return 0;
+    }
+
+    fileNum = newFileNum;
+    bufferUsed = 0;
+    size = 0;
+    error = false;
+
+    digest.begin(sequentialFile.getDigest());
+    digestPath = "";
+
+    compress = (sequentialFile.getCompression() == Compression::LZ4);
+    blockSize = (compress && bufferSize > MAX_COMPRESSED_BLOCK_SIZE) ? MAX_COMPRESSED_BLOCK_SIZE : bufferSize;
+    if (compress) {
+        if (!compressBuffer) {
+            // Allocated once; big enough for a block that is stored uncompressed
+            compressBuffer = new uint8_t[COMPRESSED_BLOCK_HEADER_SIZE + blockSize];
+            hashTable = new uint16_t[LZ4_HASH_SIZE];
+        }
+
+        uint8_t header[COMPRESSED_HEADER_SIZE];
+        memcpy(header, COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC));
+        header[sizeof(COMPRESSED_MAGIC)] = COMPRESSED_CODEC_LZ4;
+        // So a Reader with a smaller chunk size knows how large a buffer the blocks need
+        header[sizeof(COMPRESSED_MAGIC) + 1] = (uint8_t) blockSize;
+        header[sizeof(COMPRESSED_MAGIC) + 2] = (uint8_t) (blockSize >> 8);
+        if (!writeFully(header, sizeof(header))) {
+            abort();
+            return 0;
+        }
+    }
+
+    return fileNum;
+}
+
+bool SequentialFile::Writer::write(const void *data, size_t len) {
+    if (fd < 0 || error) {
+        return false;
+    }
+
+    const uint8_t *src = (const uint8_t *)data;
+    size += len;
+
+    while(len > 0) {
+        if (bufferUsed == 0 && len >= bufferSize && !compress) {
+            // Write whole chunks directly instead of copying them through the buffer
+            size_t count = len - (len % bufferSize);
+            if (!writeFully(src, count)) {
+                return false;
+            }
+            src += count;
+            len -= count;
+            continue;
+        }
+
+        size_t count = blockSize - bufferUsed;
+        if (count > len) {
+            count = len;
+        }
+        memcpy(&buffer[bufferUsed], src, count);
+        bufferUsed += count;
+        src += count;
+        len -= count;
+
+        if (bufferUsed == blockSize && !flushBuffer()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool SequentialFile::Writer::commit(bool addToQueue) {
+    if (fd < 0) {
+        return false;
+    }
+
+    if (error || !flushBuffer()) {
+        abort();
+        return false;
+    }
+
+    // close() commits the file to flash on LittleFS
+    if (close(fd) != 0) {
+        _log.error("failed to close %s errno=%d", path.c_str(), errno);
+        fd = -1;
+        abort();
+        return false;
+    }
+    fd = -1;
+
+    // Written before the file is renamed and queued so a consumer always finds the digest
+    if (hasDigest() && !writeDigest()) {
+        abort();
+        return false;
+    }
+
+    // Renamed here rather than by addFileToQueue() so overrideExt files are renamed too
+    if (path != finalPath) {
+        if (rename(path, finalPath) != 0) {
+            _log.error("failed to rename %s errno=%d", path.c_str(), errno);
+            abort();
+            return false;
+        }
+    }
+
+    if (addToQueue && !sequentialFile.addFileToQueue(fileNum)) {
+        // A file the queue limits rejected is already removed, but one the container had no
+        // room for is not. Either way the caller was told it failed, so scanDir() must not find it.
+        sequentialFile.removeFileNum(fileNum, true);
+        fileNum = 0;
+        digestPath = "";
+        return false;
+    }
+    _log.trace("committed %d (%u bytes)", fileNum, size);
+
+    fileNum = 0;
+    digestPath = "";
+    return true;
+}
+
+void SequentialFile::Writer::abort() {
+    closeFile();
+
+    if (fileNum != 0) {
+        sequentialFile.removeFile(path, true);
+        sequentialFile.shardRelease(fileNum, fileNum);
+        if (digestPath.length() > 0) {
+            unlink(digestPath);
+            digestPath = "";
+        }
+        _log.trace("aborted %s", path.c_str());
+        fileNum = 0;
+    }
+    bufferUsed = 0;
+}
+
+bool SequentialFile::Writer::flushBuffer() {
+    if (bufferUsed == 0) {
+        return true;
+    }
+
+    bool result = compress ? writeCompressedBlock() : writeFully(buffer, bufferUsed);
+    bufferUsed = 0;
+    return result;
+}
+
+bool SequentialFile::Writer::writeCompressedBlock() {
+    uint8_t *block = &compressBuffer[COMPRESSED_BLOCK_HEADER_SIZE];
+
+    // Only compressed if it gets smaller; equal lengths in the header mean stored
+    size_t codedLen = lz4CompressBlock(buffer, bufferUsed, block, bufferUsed - 1, hashTable);
+    if (codedLen == 0) {
+        memcpy(block, buffer, bufferUsed);
+        codedLen = bufferUsed;
+    }
+
+    compressBuffer[0] = (uint8_t)(bufferUsed & 0xff);
+    compressBuffer[1] = (uint8_t)(bufferUsed >> 8);
+    compressBuffer[2] = (uint8_t)(codedLen & 0xff);
+    compressBuffer[3] = (uint8_t)(codedLen >> 8);
+
+    return writeFully(compressBuffer, COMPRESSED_BLOCK_HEADER_SIZE + codedLen);
+}
+
+bool SequentialFile::Writer::writeFully(const uint8_t *data, size_t len) {
+    while(len > 0) {
+        int count = ::write(fd, data, len);
+        if (count <= 0) {
+            _log.error("failed to write %s errno=%d", path.c_str(), errno);
+            error = true;
+            return false;
+        }
+        digest.update(data, count);
+        data += count;
+        len -= count;
+    }
+    return true;
+}
+
+bool SequentialFile::Writer::writeDigest() {
+    char hex[SequentialFileDigest::HEX_BUF_SIZE];
+    size_t len = digest.finishHex(hex, sizeof(hex));
 
-SequentialFile::SequentialFile() {
+    String sidecarPath = sequentialFile.getPathForFileNum(fileNum, sequentialFile.getDigestExtension());
+    int digestFd = open(sidecarPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (digestFd < 0) {
+        _log.error("failed to create %s errno=%d", sidecarPath.c_str(), errno);
+        return false;
+    }
+    // Set first so abort() removes a partially written file
+    digestPath = sidecarPath;
+
+    bool result = (::write(digestFd, hex, len) == (int)len);
+    if (close(digestFd) != 0 || !result) {
+        _log.error("failed to write %s errno=%d", sidecarPath.c_str(), errno);
+        return false;
+    }
+    return true;
+}
 
+void SequentialFile::Writer::closeFile() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
 }
 
-SequentialFile::~SequentialFile() {
 
+SequentialFile::Reader::Reader(SequentialFile &sequentialFile, size_t chunkSize) : 
+    sequentialFile(sequentialFile), chunkSize(chunkSize), freeBuffer(true) {
+    buffer = new uint8_t[NUM_CHUNKS * chunkSize];
 }
 
-SequentialFile &SequentialFile::withDirPath(const char *dirPath) { 
-    this->dirPath = dirPath; 
-    if (this->dirPath.endsWith("/")) {
-        this->dirPath = this->dirPath.substring(0, this->dirPath.length() - 1);
-    }
-    return *this; 
-};
+SequentialFile::Reader::Reader(SequentialFile &sequentialFile, uint8_t *buffer, size_t chunkSize) : 
+    sequentialFile(sequentialFile), buffer(buffer), chunkSize(chunkSize), freeBuffer(false) {
+}
 
+SequentialFile::Reader::~Reader() {
+    stop();
 
-bool SequentialFile::scanDir(void) {
-    if (dirPath.length() <= 1) {
-        // Cannot use an unconfigured directory or "/"!
-        _log.error("unconfigured dirPath");
-        return false;
+    if (freeBuffer) {
+        delete[] buffer;
     }
+    delete[] decompressBuffer;
+    delete[] blockBuffer;
+}
 
-    if (!createDirIfNecessary(dirPath)) {
+bool SequentialFile::Reader::start(os_thread_prio_t priority, size_t stackSize) {
+    if (running || !buffer || chunkSize == 0) {
         return false;
     }
+    if (decompress && !decompressBuffer) {
+        decompressBuffer = new uint8_t[chunkSize];
+        decompressBufferSize = chunkSize;
+    }
 
-    _log.trace("scanning %s with pattern %s", dirPath.c_str(), pattern.c_str());
+    for(size_t ii = 0; ii < NUM_CHUNKS; ii++) {
+        chunks[ii] = Chunk();
+    }
+    fillIndex = readIndex = 0;
+    chunkHeld = false;
+    consumerFileNum = 0;
+    stopRequested = false;
 
-    DIR *dir = opendir(dirPath);
-    if (!dir) {
+    os_semaphore_create(&freeSemaphore, NUM_CHUNKS, NUM_CHUNKS);
+    os_semaphore_create(&filledSemaphore, NUM_CHUNKS, 0);
+
+    running = true;
+    if (os_thread_create(&thread, "seqread", priority, threadFunctionStatic, this, stackSize) != 0) {
+        _log.error("failed to create reader thread");
+        running = false;
+        os_semaphore_destroy(freeSemaphore);
+        os_semaphore_destroy(filledSemaphore);
         return false;
     }
-    
-    lastFileNum = 0;
+    return true;
+}
 
-    while(true) {
-        struct dirent* ent = readdir(dir); 
-        if (!ent) {
-            break;
-        }
-        
-        if (ent->d_type != DT_REG) {
-            // Not a plain file
-            continue;
-        }
-        
-        int fileNum;
-        if (sscanf(ent->d_name, pattern, &fileNum) == 1) {
-            if (filenameExtension.length() == 0 || String(ent->d_name).endsWith(filenameExtension)) {
-                // 
-                if (preScanAddHook(ent->d_name)) {
-                    if (fileNum > lastFileNum) {
-                        lastFileNum = fileNum;
-                    }
-                    _log.trace("adding to queue %d %s", fileNum, ent->d_name);
+void SequentialFile::Reader::stop() {
+    if (!running) {
+        return;
+    }
 
-                    queueMutexLock();
-                    queue.push_back(fileNum); 
-                    queueMutexUnlock();
-                }
-            }
+    stopRequested = true;
+    os_thread_join(thread);
+    running = false;
+
+    // Put back files that were taken from the queue but not completely returned, in the
+    // order they were taken
+    int fileNums[NUM_CHUNKS + 2];
+    int priorities[NUM_CHUNKS + 2];
+    size_t numFiles = 0;
+    auto addFileNum = [&](int fileNum, int priority) {
+        if (fileNum != 0 && (numFiles == 0 || fileNums[numFiles - 1] != fileNum)) {
+            priorities[numFiles] = priority;
+            fileNums[numFiles++] = fileNum;
         }
+    };
+
+    addFileNum(consumerFileNum, consumerPriority);
+    if (chunkHeld) {
+        addFileNum(chunks[readIndex].fileNum, chunks[readIndex].priority);
+        readIndex = (readIndex + 1) % NUM_CHUNKS;
     }
-    closedir(dir);
-    
-    scanDirCompleted = true;
-    return true;
+    while(os_semaphore_take(filledSemaphore, 0, false) == 0) {
+        addFileNum(chunks[readIndex].fileNum, chunks[readIndex].priority);
+        readIndex = (readIndex + 1) % NUM_CHUNKS;
+    }
+    if (readFd >= 0) {
+        close(readFd);
+        readFd = -1;
+        addFileNum(readFileNum, readPriority);
+    }
+    readFileNum = 0;
+    consumerFileNum = 0;
+    chunkHeld = false;
+
+    sequentialFile.requeueFiles(fileNums, priorities, numFiles);
+
+    os_semaphore_destroy(freeSemaphore);
+    os_semaphore_destroy(filledSemaphore);
 }
 
-int SequentialFile::reserveFile(void) {
-    if (!scanDirCompleted) {
-        scanDir();
+bool SequentialFile::Reader::readChunk(Chunk &chunk, system_tick_t timeoutMs) {
+    if (!running || chunkHeld) {
+        return false;
+    }
+
+    if (os_semaphore_take(filledSemaphore, timeoutMs, false) != 0) {
+        return false;
     }
 
-    return ++lastFileNum;
+    chunk = chunks[readIndex];
+    chunkHeld = true;
+    consumerFileNum = chunk.fileNum;
+    consumerPriority = chunk.priority;
+
+    return true;
 }
 
-void SequentialFile::addFileToQueue(int fileNum) {
-    if (!scanDirCompleted) {
-        scanDir();
+void SequentialFile::Reader::releaseChunk() {
+    if (!chunkHeld) {
+        return;
     }
-    if (fileNum > lastFileNum) {
-        lastFileNum = fileNum;
+
+    if (chunks[readIndex].lastChunk) {
+        consumerFileNum = 0;
     }
+    chunkHeld = false;
+    readIndex = (readIndex + 1) % NUM_CHUNKS;
 
-    queueMutexLock();
-    queue.push_back(fileNum); 
-    queueMutexUnlock();
+    os_semaphore_give(freeSemaphore, false);
 }
- 
-int SequentialFile::getFileFromQueue(bool remove) {
-    int fileNum = 0;
 
-    if (!scanDirCompleted) {
-        scanDir();
-    }
+// [static]
+void SequentialFile::Reader::threadFunctionStatic(void *param) {
+    ((SequentialFile::Reader *)param)->threadFunction();
+}
 
-    queueMutexLock();
-    if (!queue.empty()) {
-        fileNum = queue.front();
-        if (remove) {
-            queue.pop_front();
+void SequentialFile::Reader::threadFunction() {
+    while(!stopRequested) {
+        // Short timeouts so stop() is noticed
+        if (os_semaphore_take(freeSemaphore, 100, false) != 0) {
+            continue;
         }
-    }
-    queueMutexUnlock();
 
-    if (fileNum != 0) {
-        _log.trace("getFileFromQueue returned %d", fileNum);
+        Chunk &chunk = chunks[fillIndex];
+        if (!fillChunk(chunk)) {
+            break;
+        }
+        fillIndex = (fillIndex + 1) % NUM_CHUNKS;
+
+        os_semaphore_give(filledSemaphore, false);
     }
 
-    return fileNum;
+    os_thread_exit(NULL);
 }
 
+bool SequentialFile::Reader::fillChunk(Chunk &chunk) {
+    while(readFd < 0) {
+        if (stopRequested) {
+            return false;
+        }
 
-String SequentialFile::getNameForFileNum(int fileNum, const char *overrideExt) {
-    String name = String::format(pattern.c_str(), fileNum);
+        int priority = 0;
+        int fileNum = sequentialFile.waitFileFromQueue(100, NULL, &priority);
+        if (fileNum == 0) {
+            continue;
+        }
 
-    return getNameWithOptionalExt(name, (overrideExt ? overrideExt : filenameExtension.c_str()));
-}
+        const char *ext = sequentialFile.getExtensionForPriority(priority);
+        char buf[PATH_BUF_SIZE];
+        String pathStr;
+        const char *path = buf;
+        if (!sequentialFile.getPathForFileNum(fileNum, buf, sizeof(buf), ext)) {
+            // Too long for the stack buffer
+            pathStr = sequentialFile.getPathForFileNum(fileNum, ext);
+            path = pathStr.c_str();
+        }
 
-String SequentialFile::getPathForFileNum(int fileNum, const char *overrideExt) {
-    String result;
-    result.reserve(dirPath.length() + pattern.length() + 4);
+        readFd = open(path, O_RDONLY);
+        if (readFd < 0) {
+            _log.error("failed to open %s errno=%d, skipping", path, errno);
+            continue;
+        }
 
-    // dirPath never ends with a "/" because withDirName() removes it if it was passed in
-    result = dirPath + String("/") + getNameForFileNum(fileNum, overrideExt);
+        struct stat sb;
+        readFileSize = (fstat(readFd, &sb) == 0) ? (size_t) sb.st_size : 0;
+        readFileNum = fileNum;
+        readPriority = priority;
+        readOffset = 0;
 
-    return result;
-}
+        digest.begin(verify ? sequentialFile.getDigest() : Digest::NONE);
 
+        readCompressed = false;
+        if (decompress) {
+            uint8_t header[COMPRESSED_HEADER_SIZE];
+            if (readFully(readFd, header, sizeof(header)) && isCompressedHeader(header, sizeof(header))) {
+                readCompressed = true;
+                readFilePos = sizeof(header);
+                readBlockSize = header[sizeof(COMPRESSED_MAGIC) + 1] | (header[sizeof(COMPRESSED_MAGIC) + 2] << 8);
+                blockLen = blockPos = 0;
+                digest.update(header, sizeof(header));
 
-void SequentialFile::removeFileNum(int fileNum, bool allExtensions) {
-    if (allExtensions) {
-        DIR *dir = opendir(dirPath);
-        if (dir) {
-            while(true) {
-                struct dirent* ent = readdir(dir); 
-                if (!ent) {
-                    break;
-                }
-                
-                if (ent->d_type != DT_REG) {
-                    // Not a plain file
-                    continue;
+                // Written with a larger Writer buffer than chunkSize, so the buffers are 
+                // grown to fit a block and larger blocks are returned in several chunks
+                if (readBlockSize > decompressBufferSize) {
+                    delete[] decompressBuffer;
+                    decompressBuffer = new uint8_t[readBlockSize];
+                    decompressBufferSize = readBlockSize;
                 }
-                
-                int curFileNum;
-                if (sscanf(ent->d_name, pattern.c_str(), &curFileNum) == 1) {
-                    if (curFileNum == fileNum) {
-                        // dirPath never ends with a "/" because withDirName() removes it if it was passed in
-                        String path = dirPath + String("/") + ent->d_name;
-                        unlink(path);
-                        _log.trace("removed %s", path.c_str());
-                    }
+                if (readBlockSize > chunkSize && readBlockSize > blockBufferSize) {
+                    delete[] blockBuffer;
+                    blockBuffer = new uint8_t[readBlockSize];
+                    blockBufferSize = readBlockSize;
                 }
             }
-            closedir(dir);
+            else {
+                lseek(readFd, 0, SEEK_SET);
+            }
         }
     }
-    else {
-        String path = getPathForFileNum(fileNum); 
-        unlink(path);
-        _log.trace("removed %s", path.c_str());
-    }
-}
 
-void SequentialFile::removeAll(bool removeDir) {
-    DIR *dir = opendir(dirPath);
-    if (dir) {
-        while(true) {
-            struct dirent* ent = readdir(dir); 
-            if (!ent) {
+    chunk.data = &buffer[fillIndex * chunkSize];
+    chunk.fileNum = readFileNum;
+    chunk.priority = readPriority;
+    chunk.offset = readOffset;
+    chunk.error = false;
+
+    size_t len = 0;
+    if (readCompressed && readBlockSize <= chunkSize) {
+        // One block per chunk; readOffset is the offset in the decompressed data
+        int rawLen = (readFilePos < readFileSize) ? readCompressedBlock(&buffer[fillIndex * chunkSize], chunkSize) : 0;
+        if (rawLen < 0) {
+            _log.error("invalid compressed block in file %d", readFileNum);
+            chunk.error = true;
+        }
+        else {
+            len = rawLen;
+        }
+    }
+    else
+    if (readCompressed) {
+        // Blocks are larger than a chunk, so each block is decompressed into blockBuffer
+        // and returned in chunkSize pieces
+        if (blockPos >= blockLen && readFilePos < readFileSize) {
+            int rawLen = readCompressedBlock(blockBuffer, readBlockSize);
+            blockPos = 0;
+            if (rawLen < 0) {
+                _log.error("invalid compressed block in file %d", readFileNum);
+                chunk.error = true;
+                blockLen = 0;
+            }
+            else {
+                blockLen = rawLen;
+            }
+        }
+        len = blockLen - blockPos;
+        if (len > chunkSize) {
+            len = chunkSize;
+        }
+        memcpy(&buffer[fillIndex * chunkSize], &blockBuffer[blockPos], len);
+        blockPos += len;
+    }
+    else {
+        while(len < chunkSize && readOffset + len < readFileSize) {
+            int count = read(readFd, &buffer[fillIndex * chunkSize + len], chunkSize - len);
+            if (count < 0) {
+                _log.error("failed to read file %d errno=%d", readFileNum, errno);
+                chunk.error = true;
                 break;
             }
-            
-            if (ent->d_type != DT_REG) {
-                // Not a plain file
-                continue;
+            if (count == 0) {
+                break;
             }
-            
-            String path = dirPath + String("/") + ent->d_name;
-            unlink(path);
-            _log.trace("removed %s", path.c_str());
+            digest.update(&buffer[fillIndex * chunkSize + len], count);
+            len += count;
         }
-        closedir(dir);
-    }    
-    queueMutexLock();
-
-    queue.clear();
+    }
+    chunk.len = len;
+    readOffset += len;
 
-    if (removeDir) {
-        rmdir(dirPath);
+    if (readCompressed) {
+        chunk.lastChunk = chunk.error || (readFilePos >= readFileSize && blockPos >= blockLen);
+    }
+    else {
+        chunk.lastChunk = chunk.error || readOffset >= readFileSize || len < chunkSize;
+    }
+    if (chunk.lastChunk) {
+        if (!chunk.error) {
+            verifyDigest(chunk);
+        }
+        close(readFd);
+        readFd = -1;
+        readFileNum = 0;
     }
-    lastFileNum = 0;
-    scanDirCompleted = false;
 
-    queueMutexUnlock();
+    return true;
 }
 
-int SequentialFile::getQueueLen() const {
-    queueMutexLock();
-    int size = queue.size();
-    queueMutexUnlock();
+int SequentialFile::Reader::readCompressedBlock(uint8_t *dst, size_t dstSize) {
+    uint8_t header[COMPRESSED_BLOCK_HEADER_SIZE];
+    if (!readFile(header, sizeof(header))) {
+        return -1;
+    }
+    size_t rawLen = header[0] | (header[1] << 8);
+    size_t codedLen = header[2] | (header[3] << 8);
+    if (rawLen > dstSize || rawLen > readBlockSize || codedLen > rawLen) {
+        return -1;
+    }
 
-    return size;
+    // Stored blocks are read directly into the chunk
+    bool stored = (codedLen == rawLen);
+    uint8_t *src = stored ? dst : decompressBuffer;
+    if (!readFile(src, codedLen)) {
+        return -1;
+    }
+    readFilePos += sizeof(header) + codedLen;
+
+    if (stored) {
+        return (int) rawLen;
+    }
+    int len = lz4DecompressBlock(src, codedLen, dst, rawLen);
+    return (len == (int) rawLen) ? len : -1;
 }
 
+bool SequentialFile::Reader::readFile(uint8_t *buf, size_t len) {
+    if (!readFully(readFd, buf, len)) {
+        return false;
+    }
+    digest.update(buf, len);
+    return true;
+}
 
-void SequentialFile::queueMutexLock() const {
-    if (!queueMutex) {
-        os_mutex_create(&queueMutex);
+void SequentialFile::Reader::verifyDigest(Chunk &chunk) {
+    if (digest.getType() == Digest::NONE) {
+        // Not verifying, or withDigest() is not used
+        return;
     }
 
-    os_mutex_lock(queueMutex);
+    char actual[SequentialFileDigest::HEX_BUF_SIZE];
+    char expected[SequentialFileDigest::HEX_BUF_SIZE];
+
+    digest.finishHex(actual, sizeof(actual));
+    if (!sequentialFile.readDigest(readFileNum, expected, sizeof(expected)) || strcmp(actual, expected) != 0) {
+        _log.error("file %d does not match its digest", readFileNum);
+        chunk.error = true;
+        chunk.verifyError = true;
+    }
 }
 
-void SequentialFile::queueMutexUnlock() const {
-    os_mutex_unlock(queueMutex);
+
+SequentialFile::WriteScheduler::WriteScheduler(SequentialFile &sequentialFile, size_t maxPendingBytes, size_t writerBufferSize) : 
+    sequentialFile(sequentialFile), writer(sequentialFile, writerBufferSize), maxPendingBytes(maxPendingBytes) {
+    buffer = new uint8_t[2 * maxPendingBytes];
+
+    os_mutex_create(&mutex);
+    os_mutex_create(&writeMutex);
+    os_semaphore_create(&burstSemaphore, 1, 0);
 }
 
+SequentialFile::WriteScheduler::~WriteScheduler() {
+    stop();
+    flush();
 
+    os_semaphore_destroy(burstSemaphore);
+    os_mutex_destroy(writeMutex);
+    os_mutex_destroy(mutex);
 
-// [static]
-bool SequentialFile::createDirIfNecessary(const char *path) {
-    struct stat statbuf;
+    delete[] buffer;
+}
 
-    int result = stat(path, &statbuf);
-    if (result == 0) {
-        if ((statbuf.st_mode & S_IFDIR) != 0) {
-            _log.info("%s exists and is a directory", path);
+bool SequentialFile::WriteScheduler::addFile(const void *data, size_t len) {
+    if (PENDING_HEADER_SIZE + len > maxPendingBytes) {
+        _log.error("file of %u bytes is larger than the pending buffer", len);
+        return false;
+    }
+
+    while(true) {
+        os_mutex_lock(mutex);
+        if (pendingUsed + PENDING_HEADER_SIZE + len <= maxPendingBytes) {
+            uint8_t *dst = &buffer[fillIndex * maxPendingBytes + pendingUsed];
+            uint32_t len32 = (uint32_t)len;
+            memcpy(dst, &len32, PENDING_HEADER_SIZE);
+            memcpy(&dst[PENDING_HEADER_SIZE], data, len);
+            pendingUsed += PENDING_HEADER_SIZE + len;
+
+            if (pendingCount++ == 0) {
+                firstPendingMs = millis();
+            }
+            bool due = isBurstDue();
+            os_mutex_unlock(mutex);
+
+            if (due && running) {
+                os_semaphore_give(burstSemaphore, false);
+            }
             return true;
         }
+        os_mutex_unlock(mutex);
 
-        _log.error("file in the way, deleting %s", path);
-        unlink(path);
+        // Empties the pending buffer, so the file fits on the next pass
+        flush();
     }
-    else {
-        if (errno != ENOENT) {
-            // Error other than file does not exist
-            _log.error("stat filed errno=%d", errno);
-            return false;
-        }
+}
+
+bool SequentialFile::WriteScheduler::flush() {
+    os_mutex_lock(writeMutex);
+
+    // Swap buffers so addFile() can continue while this burst is written. The other buffer
+    // is not in use, since the previous burst finished while holding writeMutex.
+    os_mutex_lock(mutex);
+    const uint8_t *buf = &buffer[fillIndex * maxPendingBytes];
+    size_t count = pendingCount;
+    fillIndex ^= 1;
+    pendingUsed = 0;
+    pendingCount = 0;
+    os_mutex_unlock(mutex);
+
+    bool result = (count == 0) || writeBurst(buf, count);
+
+    os_mutex_unlock(writeMutex);
+
+    return result;
+}
+
+bool SequentialFile::WriteScheduler::loop() {
+    os_mutex_lock(mutex);
+    bool due = isBurstDue();
+    os_mutex_unlock(mutex);
+
+    if (!due) {
+        return false;
     }
+    flush();
+    return true;
+}
 
-    // File does not exist (errno == 2)
-    result = mkdir(path, 0777);
-    if (result == 0) {
-        _log.info("created dir %s", path);
-        return true;
+size_t SequentialFile::WriteScheduler::getPendingCount() const {
+    os_mutex_lock(mutex);
+    size_t count = pendingCount;
+    os_mutex_unlock(mutex);
+
+    return count;
+}
+
+bool SequentialFile::WriteScheduler::start(os_thread_prio_t priority, size_t stackSize) {
+    if (running || !buffer) {
+        return false;
     }
-    else {
-        _log.error("mkdir failed errno=%d", errno);
+
+    stopRequested = false;
+    running = true;
+    if (os_thread_create(&thread, "seqsched", priority, threadFunctionStatic, this, stackSize) != 0) {
+        _log.error("failed to create scheduler thread");
+        running = false;
         return false;
     }
+    return true;
 }
 
+void SequentialFile::WriteScheduler::stop() {
+    if (!running) {
+        return;
+    }
+
+    stopRequested = true;
+    os_semaphore_give(burstSemaphore, false);
+    os_thread_join(thread);
+    running = false;
+
+    flush();
+}
 
 // [static]
-String SequentialFile::getNameWithOptionalExt(const char *name, const char *ext) {
-    String result = name;
+void SequentialFile::WriteScheduler::threadFunctionStatic(void *param) {
+    SequentialFile::WriteScheduler *scheduler = (SequentialFile::WriteScheduler *)param;
 
-    if (ext && *ext) {
-        result += ".";
-        result += ext;
+    while(!scheduler->stopRequested) {
+        // Given by addFile() when withBurstFiles() files are pending. The timeout is short
+        // so withBurstIntervalMs() and stop() are noticed.
+        os_semaphore_take(scheduler->burstSemaphore, 100, false);
+        scheduler->loop();
     }
 
-    return result;
+    os_thread_exit(NULL);
+}
+
+bool SequentialFile::WriteScheduler::isBurstDue() const {
+    return pendingCount > 0 && (pendingCount >= burstFiles || (millis() - firstPendingMs) >= burstIntervalMs);
+}
+
+bool SequentialFile::WriteScheduler::writeBurst(const uint8_t *buf, size_t count) {
+    // One reservation for the whole burst, so the high-water mark is saved once
+    int firstFileNum = sequentialFile.reserveFiles((int)count);
+    if (firstFileNum == 0) {
+        _log.error("queue full, dropped %u files", count);
+        droppedCount += count;
+        return false;
+    }
+
+    fileNums.clear();
+
+    size_t offset = 0;
+    for(size_t ii = 0; ii < count; ii++) {
+        uint32_t len;
+        memcpy(&len, &buf[offset], PENDING_HEADER_SIZE);
+        const uint8_t *data = &buf[offset + PENDING_HEADER_SIZE];
+        offset += PENDING_HEADER_SIZE + len;
+
+        // Files that fail leave a gap in the file numbers, which is allowed
+        int fileNum = firstFileNum + (int)ii;
+        if (writer.beginReserved(fileNum) != 0 && writer.write(data, len) && writer.commit(false)) {
+            fileNums.push_back(fileNum);
+        }
+        else {
+            writer.abort();
+            droppedCount++;
+        }
+    }
+
+    // Queued together: one index record and one wakeup for the whole burst
+    size_t numQueued = sequentialFile.addFilesToQueue(fileNums.data(), fileNums.size());
+    droppedCount += fileNums.size() - numQueued;
+    _log.trace("wrote burst of %u files", numQueued);
+
+    return numQueued == count;
 }
@@ -3,7 +3,365 @@
 
 #include "Particle.h"
 
+#include <dirent.h>
+
+#include <atomic>
 #include <deque>
+#include <vector>
+
+/**
+ * @brief Sorted set of file numbers, stored as runs of sequential numbers
+ * 
+ * Since file numbers are assigned sequentially, the files in a queue directory are
+ * usually a small number of runs, so this uses much less RAM than storing each
+ * number. Inserting numbers in increasing order (the usual case) is fast.
+ * 
+ * This class is not thread-safe; SequentialFile only uses it under its own locks.
+ */
+class SequentialFileRunSet {
+public:
+    /**
+     * @brief A run of sequential file numbers, first to last inclusive
+     */
+    struct Run {
+        int first;  //!< First file number in the run
+        int last;   //!< Last file number in the run (inclusive)
+    };
+
+    /**
+     * @brief Adds a file number to the set. Does nothing if it's already in the set.
+     */
+    void insert(int fileNum) { insertRange(fileNum, fileNum); };
+
+    /**
+     * @brief Adds the file numbers first to last inclusive to the set
+     */
+    void insertRange(int first, int last);
+
+    /**
+     * @brief Removes a file number from the set. Does nothing if it's not in the set.
+     */
+    void remove(int fileNum) { removeRange(fileNum, fileNum); };
+
+    /**
+     * @brief Removes the file numbers first to last inclusive from the set
+     */
+    void removeRange(int first, int last);
+
+    /**
+     * @brief Returns true if fileNum is in the set
+     */
+    bool contains(int fileNum) const;
+
+    /**
+     * @brief Returns the smallest file number in the set that is greater than fileNum, or 0 if there is none
+     */
+    int next(int fileNum) const;
+
+    /**
+     * @brief Removes all file numbers from the set
+     */
+    void clear() { runs.clear(); count = 0; };
+
+    /**
+     * @brief Returns the number of file numbers (not runs) in the set
+     */
+    size_t size() const { return count; };
+
+    /**
+     * @brief Returns true if the set is empty
+     */
+    bool empty() const { return count == 0; };
+
+    /**
+     * @brief Returns the runs, sorted by file number and not overlapping or adjacent
+     */
+    const std::vector<Run> &getRuns() const { return runs; };
+
+protected:
+    /**
+     * @brief Sorted runs of file numbers
+     */
+    std::vector<Run> runs;
+
+    /**
+     * @brief Number of file numbers in all runs
+     */
+    size_t count = 0;
+};
+
+/**
+ * @brief Abstract container for the in-RAM queue of file numbers
+ * 
+ * SequentialFile uses a SequentialFileDequeQueue by default. You can use withQueue() to
+ * use a different container, such as SequentialFileRunQueue. All methods are called with 
+ * the SequentialFile queue mutex locked, so implementations do not need their own locking,
+ * unless isLockFree() returns true.
+ */
+class SequentialFileQueue {
+public:
+    /**
+     * @brief Destructor
+     */
+    virtual ~SequentialFileQueue() {};
+
+    /**
+     * @brief Adds a file number to the end of the queue
+     * 
+     * @return false if the queue is full
+     */
+    virtual bool push_back(int fileNum) = 0;
+
+    /**
+     * @brief Adds count sequential file numbers starting with first to the end of the queue
+     * 
+     * @return false if the queue is full. Some of the files may have been added.
+     */
+    virtual bool push_back_range(int first, int count);
+
+    /**
+     * @brief Adds a file number to the front of the queue
+     * 
+     * @return false if the queue is full or the container does not support adding to the front
+     * 
+     * Used by SequentialFile::nack() to return a file to the front of the queue. The default
+     * implementation returns false.
+     */
+    virtual bool push_front(int fileNum) { return false; };
+
+    /**
+     * @brief Returns the file number at the front of the queue. The queue must not be empty.
+     */
+    virtual int front() const = 0;
+
+    /**
+     * @brief Removes the file number at the front of the queue. The queue must not be empty.
+     */
+    virtual void pop_front() = 0;
+
+    /**
+     * @brief Returns the number of file numbers in the queue
+     */
+    virtual size_t size() const = 0;
+
+    /**
+     * @brief Removes all file numbers from the queue
+     */
+    virtual void clear() = 0;
+
+    /**
+     * @brief Returns true if the queue is empty
+     */
+    bool empty() const { return size() == 0; };
+
+    /**
+     * @brief Returns true if the container does its own synchronization
+     * 
+     * If true, SequentialFile does not lock the queue mutex when adding or getting files,
+     * and the container is responsible for thread safety.
+     */
+    virtual bool isLockFree() const { return false; };
+};
+
+/**
+ * @brief Queue container using a std::deque of file numbers. This is the default.
+ * 
+ * Uses 4 bytes of RAM per queued file, allocated from the heap as the queue grows.
+ */
+class SequentialFileDequeQueue : public SequentialFileQueue {
+public:
+    virtual bool push_back(int fileNum) { queue.push_back(fileNum); return true; };
+    virtual bool push_front(int fileNum) { queue.push_front(fileNum); return true; };
+    virtual int front() const { return queue.front(); };
+    virtual void pop_front() { queue.pop_front(); };
+    virtual size_t size() const { return queue.size(); };
+    virtual void clear() { queue.clear(); };
+
+protected:
+    /**
+     * @brief Queue of files
+     */
+    std::deque<int> queue;
+};
+
+/**
+ * @brief Queue container using a fixed-size ring buffer of runs of sequential file numbers
+ * 
+ * Each run is a (first, count) pair, so a queue of 20,000 sequential files uses one run.
+ * Adding a file number that is one more than the last one queued extends the last run,
+ * otherwise a new run is started. A gap in file numbers or files added out of order
+ * each use another run.
+ * 
+ * The ring buffer is allocated once, by the constructor, so the queue does not allocate
+ * from the heap after that. When all maxRuns runs are used, push_back() fails and the
+ * file is not queued; it will still be found by the next scanDir() that reads the
+ * directory (not one that loads the index from withIndexFile()).
+ */
+class SequentialFileRunQueue : public SequentialFileQueue {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param maxRuns Maximum number of runs (8 bytes of RAM each)
+     */
+    SequentialFileRunQueue(size_t maxRuns);
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~SequentialFileRunQueue();
+
+    virtual bool push_back(int fileNum) { return push_back_range(fileNum, 1); };
+    virtual bool push_back_range(int first, int count);
+    virtual bool push_front(int fileNum);
+    virtual int front() const { return runs[head].first; };
+    virtual void pop_front();
+    virtual size_t size() const { return count; };
+    virtual void clear() { head = 0; numRuns = 0; count = 0; };
+
+    /**
+     * @brief Returns the number of runs in use
+     */
+    size_t getNumRuns() const { return numRuns; };
+
+    /**
+     * @brief Returns the maximum number of runs
+     */
+    size_t getMaxRuns() const { return maxRuns; };
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialFileRunQueue(const SequentialFileRunQueue&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialFileRunQueue& operator=(const SequentialFileRunQueue&) = delete;
+
+protected:
+    /**
+     * @brief A run of count sequential file numbers starting with first
+     */
+    struct Run {
+        int first;  //!< First file number in the run
+        int count;  //!< Number of file numbers in the run
+    };
+
+    Run *runs;              //!< Ring buffer of maxRuns runs
+    size_t maxRuns;         //!< Capacity of runs
+    size_t head = 0;        //!< Index into runs of the front of the queue
+    size_t numRuns = 0;     //!< Number of runs in use
+    size_t count = 0;       //!< Number of file numbers in all runs
+};
+
+/**
+ * @brief Lock-free queue container for one producer thread and one consumer thread
+ * 
+ * This is a fixed-size ring buffer of file numbers with atomic head and tail indexes. 
+ * The producer (addFileToQueue(), addFilesToQueue()) only writes the tail and the consumer
+ * (getFileFromQueue(), getFilesFromQueue(), waitFileFromQueue()) only writes the head, so 
+ * neither ever blocks the other on the queue mutex.
+ * 
+ * Only one thread may add files and only one thread may get files. If you have multiple
+ * producers or consumers, use one of the mutex-protected containers instead. Call scanDir() 
+ * before starting the producer and consumer threads, since it replaces the contents of the 
+ * queue. If you use withIndexFile(), adding and removing files still lock the index file mutex.
+ * 
+ * The ring buffer is allocated once, by the constructor. When it's full, push_back() fails
+ * and the file is not queued; it will still be found by the next scanDir() that reads
+ * the directory (not one that loads the index from withIndexFile()).
+ */
+class SequentialFileSpscQueue : public SequentialFileQueue {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param maxFiles Maximum number of files in the queue (4 bytes of RAM each)
+     */
+    SequentialFileSpscQueue(size_t maxFiles);
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~SequentialFileSpscQueue();
+
+    virtual bool push_back(int fileNum);
+    virtual int front() const;
+    virtual void pop_front();
+    virtual size_t size() const;
+    virtual void clear();
+    virtual bool isLockFree() const { return true; };
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialFileSpscQueue(const SequentialFileSpscQueue&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialFileSpscQueue& operator=(const SequentialFileSpscQueue&) = delete;
+
+protected:
+    int *slots;                     //!< Ring buffer of numSlots file numbers
+    size_t numSlots;                //!< Capacity of slots, one more than the maximum number of files
+    std::atomic<size_t> head{0};    //!< Index into slots of the front of the queue, written by the consumer
+    std::atomic<size_t> tail{0};    //!< Index into slots of the next free slot, written by the producer
+};
+
+/**
+ * @brief Per-file metadata kept in RAM when SequentialFile::withMetadata() is enabled
+ */
+struct SequentialFileMeta {
+    uint32_t size = 0;      //!< Size of the file in bytes
+    uint32_t mtime = 0;     //!< Modification time of the file (Unix time, seconds)
+    uint32_t userData = 0;  //!< Caller-provided value, such as a priority. 0 for files found by scanDir().
+};
+
+/**
+ * @brief Fixed-size histogram of durations in microseconds, used in SequentialFileStats
+ * 
+ * buckets[0] counts durations under 10 microseconds, buckets[1] under 100 microseconds,
+ * and so on, so buckets[5] is under 1 second and buckets[6] is 1 second or longer.
+ */
+struct SequentialFileHistogram {
+    static const size_t NUM_BUCKETS = 7;        //!< Number of entries in buckets
+
+    uint32_t buckets[NUM_BUCKETS] = {0};        //!< Number of durations in each power-of-ten range
+    uint32_t count = 0;                         //!< Total number of durations
+    uint32_t maxUs = 0;                         //!< Longest duration in microseconds
+    uint32_t totalMs = 0;                       //!< Sum of the durations in milliseconds
+    uint32_t remainderUs = 0;                   //!< Part of the sum under 1 millisecond, not included in totalMs yet
+
+    /**
+     * @brief Adds a duration to the histogram
+     */
+    void add(uint32_t us);
+};
+
+/**
+ * @brief Statistics from SequentialFile::getStats(), when enabled using withStats()
+ * 
+ * Counts are numbers of files. They're 32-bit and wrap around on very long-running devices.
+ */
+struct SequentialFileStats {
+    uint32_t reserveCount = 0;                  //!< File numbers returned by reserveFile() and reserveFiles()
+    uint32_t addCount = 0;                      //!< Files added to the queue
+    uint32_t getCount = 0;                      //!< Files taken from the queue by getFileFromQueue(), waitFileFromQueue(), and getFilesFromQueue()
+    uint32_t removeCount = 0;                   //!< File numbers passed to removeFileNum() and removeFileNums()
+    uint32_t poolTakeCount = 0;                 //!< Files created by Writer by reusing a file from the pool (withFilePool())
+    uint32_t poolPutCount = 0;                  //!< Files moved to the pool instead of being deleted (withFilePool())
+    uint32_t maxQueueLen = 0;                   //!< Highest value of getQueueLen()
+    uint32_t scanCount = 0;                     //!< Number of times the queue was loaded by scanDir() or scanDirAsync()
+    uint32_t lastScanMs = 0;                    //!< Duration of the last scan in milliseconds
+    uint32_t lastScanEntries = 0;               //!< Directory entries read by the last scan, 0 if loaded from the index file
+    SequentialFileHistogram queueMutexWait;     //!< Time spent waiting to lock the queue mutex
+    SequentialFileHistogram unlinkTime;         //!< Time to remove each file
+    SequentialFileHistogram scanTime;           //!< Time to scan the queue directory
+};
+
+class SequentialFileManager;
 
 /**
  * @brief Class for maintaining a directory of files as a queue with unique filenames
@@ -31,6 +389,45 @@
  */
 class SequentialFile {
 public:
+    class Writer;
+    class Reader;
+    class WriteScheduler;
+
+    /**
+     * @brief What to do when the queue is full, when using withMaxFiles() or withMaxBytes()
+     */
+    enum class OverflowPolicy {
+        REJECT_NEW,     //!< reserveFile() returns 0 (default)
+        BLOCK,          //!< reserveFile() waits until files are taken from the queue
+        DROP_OLDEST     //!< addFileToQueue() removes the oldest files from the queue and the file system
+    };
+
+    /**
+     * @brief How Writer stores the data written to new files, set using withCompression()
+     */
+    enum class Compression {
+        NONE,           //!< Files contain the data as written (default)
+        LZ4             //!< Files have a header followed by blocks compressed in the LZ4 block format
+    };
+
+    /**
+     * @brief Digest Writer stores in a sidecar file for each new file, set using withDigest()
+     */
+    enum class Digest {
+        NONE,           //!< No digest (default)
+        CRC32,          //!< CRC-32 (IEEE 802.3), 8 hex digits
+        SHA1            //!< SHA-1, 40 hex digits
+    };
+
+    /**
+     * @brief Result of scanDirStep() and removeAllStep()
+     */
+    enum class StepResult {
+        IN_PROGRESS,    //!< More work remains. Call again, typically from the next loop().
+        DONE,           //!< Finished successfully
+        FAILED          //!< Finished with an error
+    };
+
     /**
      * @brief Default constructor
      * 
@@ -78,8 +475,13 @@ public:
      * 
      * This string is used when scanning the queue directory to find files. Do not include the
      * filename extension in this pattern!
+     * 
+     * Patterns of the form %0Nd, such as the default %08d, are formatted and parsed directly,
+     * which is faster than snprintf and sscanf, used for other patterns.
+     * 
+     * Ignored for a SequentialFileT, where the pattern is a template parameter.
      */
-    SequentialFile &withPattern(const char *pattern) { this->pattern = pattern; return *this; };
+    SequentialFile &withPattern(const char *pattern);
 
     /**
      * @brief Gets the filename pattern
@@ -92,8 +494,10 @@ public:
      * @param ext The filename extension (just the extension, no preceding dot)
      * 
      * For example, for JPEG files it might be "jpg".
+     * 
+     * Ignored for a SequentialFileT, where the extension is a template parameter.
      */
-    SequentialFile &withFilenameExtension(const char *ext) { this->filenameExtension = ext; return *this; };
+    SequentialFile &withFilenameExtension(const char *ext);
 
     /**
      * @brief Gets the filename extension
@@ -103,195 +507,2976 @@ public:
     const char *getFilenameExtension() const { return filenameExtension; };
 
     /**
-     * @brief Scans the queue directory for files. Typically called during setup().
+     * @brief Stores files in subdirectories of the queue directory (default: 0, no subdirectories)
+     * 
+     * @param shardSize Number of file numbers per subdirectory, or 0 to store all files in the queue directory
+     * 
+     * LittleFS directory operations get slower as the number of files in a directory grows.
+     * With a shard size of 256, files 0 - 255 are stored in dirPath/00000, 256 - 511 in
+     * dirPath/00001, and so on. getPathForFileNum() returns the path in the subdirectory
+     * and reserveFile() creates the subdirectory if necessary. scanDir(), removeFileNum(),
+     * and removeAll() handle the subdirectories, and a subdirectory is removed once all
+     * of its files have been removed and every file number reserved in it has been 
+     * queued or removed.
+     * 
+     * Set this before calling scanDir(). Files stored in the top level of the queue 
+     * directory are not found when sharding is enabled, and files in subdirectories are
+     * not found when it's disabled, so don't change the setting for an existing queue.
      */
-    bool scanDir(void);
+    SequentialFile &withShardSize(int shardSize);
 
     /**
-     * @brief Reserve a file number you will use to write data to
-     * 
-     * Use getPathForFileNum() to get the pathname to the file. Reservations are in-RAM only
-     * so if the device reboots before you write the file, the reservation will be lost.
+     * @brief Gets the shard size set using withShardSize(), 0 if not using subdirectories
      */
-    int reserveFile(void);
+    int getShardSize() const { return shardSize; };
 
     /**
-     * @brief Adds a previously reserved file to the queue
+     * @brief Gets the subdirectory number for a file number. Only used with withShardSize().
+     */
+    int getShardForFileNum(int fileNum) const { return (shardSize > 0) ? (fileNum / shardSize) : 0; };
+
+    /**
+     * @brief Gets the pathname to a subdirectory of the queue directory. Only used with withShardSize().
      * 
-     * Use reserveFile() to get the next file number, addFileToQueue() to add it to the queue
-     * and getFileFromQueue() to get an item from the queue.
+     * @param shard The subdirectory number, from getShardForFileNum()
      * 
-     * It's safe to call reserveFile(), addFileToQueue(), and getFileFromQueue() from different
-     * threads. Locking is handled internally.
+     * The returned path will not end with a slash.
      */
-    void addFileToQueue(int fileNum);
+    String getShardPath(int shard) const;
 
     /**
-     * @brief Gets a file from the queue
+     * @brief Registers a sidecar filename extension, for additional files stored with each fileNum
      * 
-     * @param remove (optional, default true). If true, removes the file from the queue in
-     * RAM. If false, calling getFileFromQueue() again will retrieve the same fileNum.
+     * @param ext The filename extension (just the extension, no preceding dot), for example "sha1".
      * 
-     * @return 0 if there are no items in the queue, or a fileNum for an item in the queue.
+     * You can call this multiple times to register more than one extension. When at least one
+     * sidecar extension is registered, removeFileNum() and removeFileNums() with allExtensions 
+     * true unlink the queue file and each sidecar file directly, instead of reading the whole 
+     * queue directory to find them. Files with other extensions are not removed in this case.
+     */
+    SequentialFile &withSidecarExtension(const char *ext) { sidecarExtensions.push_back(ext); return *this; };
+
+    /**
+     * @brief Gets the sidecar filename extensions registered using withSidecarExtension()
+     */
+    const std::vector<String> &getSidecarExtensions() const { return sidecarExtensions; };
+
+    /**
+     * @brief Enables crash-safe commit using a temporary filename extension (default: disabled)
      * 
-     * Use getPathForFileNum() to convert the number into a pathname for use with open().
+     * @param ext Temporary extension without the dot, such as "tmp", or NULL or an empty string 
+     * to disable.
      * 
-     * The queue is stored in RAM, so if the device reboots before you delete the file it
-     * will reappear in the queue when scanDir is called. This method does not need to access 
-     * the filesystem. You can call getFileFromQueue() on every loop if you want to to check 
-     * if there are files to process without affecting performance.
+     * Write new files to the path from getTempPathForFileNum() instead of getPathForFileNum().
+     * This is the queue file path with the temporary extension appended, for example
+     * 00000001.jpg.tmp. addFileToQueue() renames the temporary file to the queue filename 
+     * before adding it to the queue, so a file that was being written during a reset never
+     * has a queue filename. scanDir() deletes orphaned temporary files without opening them,
+     * but not ones whose file numbers are reserved and not yet queued or removed, since
+     * those are still being written. SequentialFile::Writer uses the temporary file automatically.
      * 
-     * It's safe to call reserveFile(), addFileToQueue(), and getFileFromQueue() from different
-     * threads. Locking is handled internally.
+     * If the temporary file does not exist, addFileToQueue() queues the file anyway, so files
+     * written directly to the queue filename still work. Only the queue file is renamed; 
+     * sidecar files are not.
      * 
+     * When scanDir() loads the queue from the index file it does not read the directory, so
+     * orphaned temporary files are only deleted by a scan of the directory, by removeAll(), 
+     * or by removeFileNum() with allExtensions and no sidecar extensions.
      */
-    int getFileFromQueue(bool remove = true);
+    SequentialFile &withTempExtension(const char *ext) { this->tempExtension = ext ? ext : ""; return *this; };
 
     /**
-     * @brief Uses pattern to create a filename given a fileNum
+     * @brief Gets the temporary extension set using withTempExtension(), empty if not enabled
+     */
+    const char *getTempExtension() const { return tempExtension; };
+
+    /**
+     * @brief Keeps the size and modification time of each queued file in RAM (default: disabled)
      * 
-     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * @param enable true to keep metadata, false to not keep it.
      * 
-     * @param overrideExt If non-null, use this extension instead of the configured
-     * filename extension. It should not contain the preceeding dot.
+     * When enabled, scanDir() and addFileToQueue() call stat() on each file and store the 
+     * size and mtime in a SequentialFileMeta (12 bytes per file, plus the file number). 
+     * getFileFromQueue(), waitFileFromQueue(), and getFilesFromQueue() can return it, and 
+     * getQueuedBytes() returns the total size of the queue, without accessing the file system.
+     * Use the addFileToQueue() overload that takes a SequentialFileMeta to provide the
+     * metadata yourself, including userData, without calling stat().
      * 
-     * The overrideExt is used when you create multiple files per queue entry fileNum,
-     * for example a data file and a .sha1 hash for the file. Or other metadata.
+     * scanDir() calls stat() on every queued file, even when loading the queue from the 
+     * index file. Call this before scanDir().
      */
-    String getNameForFileNum(int fileNum, const char *overrideExt = NULL);
+    SequentialFile &withMetadata(bool enable = true) { this->metadata = enable; return *this; };
 
     /**
-     * @brief Gets a full pathname based on dirName and getNameForFileNum
+     * @brief Sets whether Writer compresses new files (default: Compression::NONE)
      * 
-     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * @param compression Compression::LZ4 to compress files written using Writer
      * 
-     * @param overrideExt If non-null, use this extension instead of the configured
-     * filename extension.
+     * With Compression::LZ4, each Writer buffer is compressed as an independent LZ4 block
+     * when it's written to the file, so files use less flash and less data to upload. The
+     * file starts with a 6-byte header ("SQZ", the codec, 1 for LZ4, and the maximum 
+     * uncompressed block size, 16-bit little endian) so compressed files can be identified,
+     * and each block has a 4-byte header with the uncompressed and compressed lengths 
+     * (16-bit little endian). A block whose lengths are equal is stored 
+     * uncompressed because it did not get smaller.
      * 
-     * The overrideExt is used when you create multiple files per queue entry fileNum,
-     * for example a data file and a .sha1 hash for the file. Or other metadata.
+     * Consumers can upload the file as-is, or use Reader::withDecompression() or 
+     * lz4DecompressBlock() to decompress it on the device. The compressor uses 
+     * LZ4_HASH_SIZE * 2 bytes of RAM plus a second buffer the size of the Writer buffer,
+     * allocated the first time a Writer creates a compressed file. Only files created 
+     * using Writer are compressed.
      */
-    String getPathForFileNum(int fileNum, const char *overrideExt = NULL);
+    SequentialFile &withCompression(Compression compression) { this->compression = compression; return *this; };
 
     /**
-     * @brief Remove fileNum from the flash file system
-     *
-     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
-     * 
-     * @param allExtensions If true, all files with that number regardless of extension are removed.
-     * 
+     * @brief Gets the compression set using withCompression()
      */
-    void removeFileNum(int fileNum, bool allExtensions);
+    Compression getCompression() const { return compression; };
 
     /**
-     * @brief Removes all of the files in the queue directory
+     * @brief Sets a digest that Writer calculates while writing each file (default: Digest::NONE)
      * 
-     * @brief removeDir true to remove the queue directory itself, false to just remove the contents.
+     * @param digest Digest::CRC32 or Digest::SHA1
+     * 
+     * @param ext Filename extension of the sidecar file to store the digest in, without the 
+     * dot. For example, "sha1" stores the digest of 00000001.jpg in 00000001.sha1. It's also
+     * registered using withSidecarExtension().
+     * 
+     * The digest is updated as each buffer is written, so the file does not need to be read
+     * back to calculate it. It's the digest of the file as stored, after compression 
+     * (withCompression()), so it can also be checked by the server the file is uploaded to. 
+     * commit() writes it to the sidecar file in lowercase hex before the file is added to the
+     * queue. Use Reader::withVerify() to check it while reading the file, or readDigest() to 
+     * get it. Files that are not created using Writer don't get a digest.
+     */
+    SequentialFile &withDigest(Digest digest, const char *ext);
+
+    /**
+     * @brief Gets the digest set using withDigest()
+     */
+    Digest getDigest() const { return digest; };
+
+    /**
+     * @brief Gets the sidecar filename extension set using withDigest()
+     */
+    const char *getDigestExtension() const { return digestExtension.c_str(); };
+
+    /**
+     * @brief Reads the digest of a file from its sidecar file (withDigest())
+     * 
+     * @param fileNum The file number
+     * 
+     * @param buf Buffer to store the digest in, as a null-terminated hex string
+     * 
+     * @param bufSize Size of buf in bytes. SequentialFileDigest::HEX_BUF_SIZE is always large enough.
+     * 
+     * @return true if the digest was read
+     */
+    bool readDigest(int fileNum, char *buf, size_t bufSize);
+
+    /**
+     * @brief Returns true if metadata is enabled using withMetadata()
+     */
+    bool getMetadata() const { return metadata; };
+
+    /**
+     * @brief Adds a priority lane for files with a different filename extension
+     * 
+     * @param priority Priority of the lane. Higher numbers are returned first by
+     * getFileFromQueue(). Files with the filename extension set using withFilenameExtension()
+     * are priority 0, so this must not be 0. It can be negative for files that should be
+     * processed after the normal files.
+     * 
+     * @param ext Filename extension for files in this lane, without the dot. Must be different
+     * from the filename extension and the other lanes.
+     * 
+     * For example, with withFilenameExtension("jpg") and withPriorityExtension(1, "alarm"), 
+     * 00000005.alarm is returned by getFileFromQueue() before 00000003.jpg. All lanes share
+     * one directory, one mutex, and one sequence of file numbers, and scanDir() sorts the files
+     * into lanes in a single pass through the directory. Each lane other than priority 0 uses 
+     * a SequentialFileDequeQueue.
+     * 
+     * Use addFileToQueueWithPriority() to add a file to a lane, getExtensionForPriority() to 
+     * get the extension to write it with, and the priority parameter of getFileFromQueue() to 
+     * find out which lane a file came from. removeFileNum() removes the file in any lane.
+     * 
+     * Call this before scanDir(). The index file (withIndexFile()) does not record lanes,
+     * so if it's enabled this logs an error and does not add the lane.
+     */
+    SequentialFile &withPriorityExtension(int priority, const char *ext);
+
+    /**
+     * @brief Gets the filename extension for a priority lane
+     * 
+     * @param priority The priority. 0 returns the filename extension.
+     * 
+     * @return The extension, or NULL if there is no lane with that priority
+     * 
+     * Pass this as the overrideExt to getPathForFileNum() to get the path for a file in 
+     * that lane.
+     */
+    const char *getExtensionForPriority(int priority) const;
+
+    /**
+     * @brief Adds a named consumer group with its own read position in the queue
+     * 
+     * @param name Name of the group, for getConsumerGroup()
+     * 
+     * Use consumer groups to send the same files to more than one destination, each at its 
+     * own rate, without copying them. Each group gets files using getFileFromGroup() and 
+     * acknowledges them using ackGroup(). A file is only removed once every group has 
+     * acknowledged it.
+     * 
+     * With withIndexFile(), acknowledgements are stored in the index file, so after a reset
+     * each group continues with the files it has not acknowledged. Otherwise every file in 
+     * the queue directory is returned to every group again. Groups are identified in the 
+     * index file by the order they were added, so always add them in the same order.
+     * 
+     * Call this before scanDir(). Up to MAX_CONSUMER_GROUPS groups can be added. Files are 
+     * returned in file number order, regardless of priority lanes. When using consumer groups,
+     * don't use getFileFromQueue(), waitFileFromQueue(), getFilesFromQueue(), or acquire().
+     */
+    SequentialFile &withConsumerGroup(const char *name);
+
+    /**
+     * @brief Gets the group number for a consumer group added using withConsumerGroup()
+     * 
+     * @return The group number to pass to getFileFromGroup() and ackGroup(), or -1 if there 
+     * is no group with that name
+     */
+    int getConsumerGroup(const char *name) const;
+
+    /**
+     * @brief Limits the number of files in the queue (default: 0, no limit)
+     * 
+     * @param maxFiles Maximum number of files in the queue, or 0 for no limit
+     * 
+     * What happens when the queue is full depends on withOverflowPolicy(). The limit applies 
+     * to files in the RAM queue, so files that have been taken from the queue but not yet 
+     * removed don't count.
+     */
+    SequentialFile &withMaxFiles(size_t maxFiles) { this->maxFiles = maxFiles; return *this; };
+
+    /**
+     * @brief Limits the total size of the files in the queue (default: 0, no limit)
+     * 
+     * @param maxBytes Maximum total size in bytes, or 0 for no limit
+     * 
+     * This enables withMetadata(), since the file sizes are kept in RAM so enforcing the limit
+     * never requires reading the directory.
+     */
+    SequentialFile &withMaxBytes(uint64_t maxBytes) { this->maxBytes = maxBytes; if (maxBytes) { metadata = true; } return *this; };
+
+    /**
+     * @brief Sets what happens when the queue is full (default: OverflowPolicy::REJECT_NEW)
+     * 
+     * @param policy The policy:
+     * - REJECT_NEW: reserveFile() returns 0 if the queue is full, so don't write a file.
+     * - BLOCK: reserveFile() waits until another thread takes a file from the queue, for up 
+     * to blockTimeoutMs, then returns 0 if the queue is still full. 
+     * - DROP_OLDEST: addFileToQueue() removes the file at the head of the queue (from the
+     * lowest priority lane, with withPriorityExtension()) and deletes it, including sidecar
+     * files from withSidecarExtension(), until the new file fits. Not supported with a 
+     * SequentialFileSpscQueue, since only the consumer can take files from it.
+     * 
+     * @param blockTimeoutMs For BLOCK, maximum time to wait in milliseconds (default: 
+     * CONCURRENT_WAIT_FOREVER)
+     * 
+     * For REJECT_NEW and BLOCK the limits are checked when a file number is reserved, so
+     * a file is not written if the queue is already full, and again when the file is added
+     * to the queue and its size is known. addFileToQueue() removes a file that does not fit
+     * and returns false, so the limits are never exceeded. Files returned to the queue by 
+     * nack() or Reader::stop() are not checked again.
+     */
+    SequentialFile &withOverflowPolicy(OverflowPolicy policy, system_tick_t blockTimeoutMs = CONCURRENT_WAIT_FOREVER) { 
+        this->overflowPolicy = policy; this->blockTimeoutMs = blockTimeoutMs; return *this; 
+    };
+
+    /**
+     * @brief Returns true if the queue is at the limit set using withMaxFiles() or withMaxBytes(),
+     * or at the quota of its SequentialFileManager
+     */
+    bool isQueueFull() const { return isQueueFull(1, 0); };
+
+    /**
+     * @brief Enables the persistent queue index file. (Default: disabled)
+     * 
+     * @param enable true to use the index file, false to always scan the directory.
+     * 
+     * When enabled, a journal file (queue.idx) is kept in the queue directory. It records the
+     * files added using addFileToQueue() and removed using removeFileNum(), as well as
+     * lastFileNum, as small append-only records. scanDir() loads the queue from the index in
+     * one sequential read, and only falls back to reading the whole directory if the index
+     * is missing or fails a checksum. In that case the index is rebuilt from the directory.
+     * 
+     * When using the index file, add files using addFileToQueue() and remove them using
+     * removeFileNum() or removeAll(). Files copied into the directory by other means are not 
+     * found by scanDir() until the index is rebuilt, which you can force by deleting queue.idx.
+     * 
+     * preScanAddHook() is only called when reading the directory, not when loading from 
+     * the index, since the index only contains files passed to addFileToQueue().
+     * 
+     * The index does not record priority lanes, so if withPriorityExtension() was used this
+     * logs an error and leaves the index file disabled. Use getIndexFile() to check.
+     */
+    SequentialFile &withIndexFile(bool enable = true);
+
+    /**
+     * @brief Returns true if the persistent queue index file is enabled
+     */
+    bool getIndexFile() const { return indexFile; };
+
+    /**
+     * @brief Enables the persistent high-water mark file. (Default: disabled)
+     * 
+     * @param enable true to save the high-water mark for lastFileNum in the queue directory
+     * 
+     * When enabled, a small file (queue.hwm) in the queue directory holds a file number that
+     * is larger than any file number reserved so far. It's rewritten once every 64 file 
+     * numbers, not for every file. With scanDirAsync(),
+     * reserveFile() and addFileToQueue() start numbering above the saved value immediately,
+     * instead of waiting for the scan to find the last file. A few file numbers may be 
+     * skipped after a restart, which is harmless.
+     * 
+     * Call this before scanDir() or scanDirAsync().
+     */
+    SequentialFile &withHighWaterMark(bool enable = true) { this->highWaterMark = enable; return *this; };
+
+    /**
+     * @brief Returns true if the persistent high-water mark file is enabled
+     */
+    bool getHighWaterMark() const { return highWaterMark; };
+
+    /**
+     * @brief Sets the number of index records that triggers compaction (default: 512)
+     * 
+     * @param records Number of records in the index file journal
+     * 
+     * When the index file contains this many records it's rewritten to contain only 
+     * lastFileNum and the ranges of files still in the queue directory. Only used with
+     * withIndexFile().
+     */
+    SequentialFile &withIndexCompactThreshold(size_t records) { this->indexCompactThreshold = records; return *this; };
+
+    /**
+     * @brief Sets the container used for the in-RAM queue (default: SequentialFileDequeQueue)
+     * 
+     * @param queue The container to use. It's typically a global variable and must not be
+     * deleted while this object uses it. Pass NULL to use the default container.
+     * 
+     * For large backlogs, a SequentialFileRunQueue uses much less RAM and does not allocate
+     * from the heap. With one producer thread and one consumer thread, a SequentialFileSpscQueue
+     * avoids locking the queue mutex. Call this before scanDir().
+     */
+    SequentialFile &withQueue(SequentialFileQueue *queue);
+
+    /**
+     * @brief Scans the queue directory for files. Typically called during setup().
+     * 
+     * The queue is replaced by the files found in the directory, in increasing fileNum
+     * order with no duplicates, regardless of the order of directory entries. Calling
+     * scanDir() again rebuilds the queue, so files that were removed from the queue
+     * using getFileFromQueue() but not deleted will be in the queue again.
+     * 
+     * If withIndexFile() is enabled, the queue is loaded from the index file instead 
+     * if possible.
+     */
+    bool scanDir(void);
+
+    /**
+     * @brief Scans the queue directory on a worker thread, so setup() does not wait for it
+     * 
+     * @param priority Thread priority of the scan thread
+     * 
+     * @param stackSize Stack size of the scan thread
+     * 
+     * @return true if the scan thread was started
+     * 
+     * The queue is emptied, then getFileFromQueue() and waitFileFromQueue() return files as
+     * the scan finds them. With withShardSize(), each shard subdirectory is queued as soon 
+     * as it has been read, in increasing fileNum order. Otherwise the files are all queued 
+     * when the directory has been read. Files passed to addFileToQueue() during the scan 
+     * are queued after the files found by the scan, so the queue stays in fileNum order.
+     * 
+     * If withHighWaterMark() is enabled and the high-water mark file exists, reserveFile() 
+     * and addFileToQueue() do not wait for the scan. Otherwise they wait until the scan
+     * completes, the same as when scanDir() is called implicitly.
+     * 
+     * Use isScanning() to find out if the scan is still running; until it has completed,
+     * an empty queue does not mean there are no files. Not supported with a lock-free 
+     * queue container (SequentialFileSpscQueue), since the scan thread is another producer.
+     */
+    bool scanDirAsync(os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 3072);
+
+    /**
+     * @brief Scans the queue directory a slice at a time, for apps without SYSTEM_THREAD(ENABLED)
+     * 
+     * @param maxEntries Maximum number of directory entries to read in this call
+     * 
+     * @param maxMs If not 0, also return once this many milliseconds have elapsed
+     * 
+     * @return StepResult::IN_PROGRESS until the scan has finished. Call it again, typically
+     * once from each loop(), until it returns DONE or FAILED.
+     * 
+     * This does the same scan as scanDir(), but the open directory and the files found
+     * so far are kept in this object between calls, so it never blocks loop() and cloud
+     * processing for long. The first call starts the scan. The queue behaves as it does
+     * with scanDirAsync(): it's emptied, files are queued as each shard (withShardSize())
+     * or the whole directory has been read, and files passed to addFileToQueue() during
+     * the scan are queued after the files found by the scan. isScanning() returns true 
+     * until it's done.
+     * 
+     * If reserveFile() or addFileToQueue() is called before the scan is done and the 
+     * high-water mark (withHighWaterMark()) is not available, the rest of the scan is done
+     * immediately, the same as when scanDir() is called implicitly. 
+     * Loading the index file (withIndexFile()) is done in one call. Not supported with
+     * a lock-free queue container (SequentialFileSpscQueue).
+     */
+    StepResult scanDirStep(size_t maxEntries = 100, system_tick_t maxMs = 0);
+
+    /**
+     * @brief Returns true if scanDirAsync() or scanDirStep() is still scanning the directory
+     */
+    bool isScanning() const { return scanAsyncRunning; };
+
+    /**
+     * @brief Reserve a file number you will use to write data to
+     * 
+     * Use getPathForFileNum() to get the pathname to the file. Reservations are in-RAM only
+     * so if the device reboots before you write the file, the reservation will be lost.
+     * 
+     * It's safe to call reserveFile() from multiple threads at the same time; each call
+     * returns a different file number.
+     * 
+     * @return The file number, or 0 if the queue is full (see withOverflowPolicy()).
+     */
+    int reserveFile(void);
+
+    /**
+     * @brief Reserve a block of sequential file numbers
+     * 
+     * @param count Number of file numbers to reserve. Must be at least 1.
+     * 
+     * @return The first file number reserved. The reserved file numbers are the returned 
+     * value to the returned value + count - 1. Returns 0 if count is less than 1 or there 
+     * is no room for count files in the queue (see withOverflowPolicy()).
+     * 
+     * This is the same as calling reserveFile() count times, except that the file numbers
+     * are guaranteed to be sequential even if other threads are reserving files.
+     */
+    int reserveFiles(int count);
+
+    /**
+     * @brief Adds a previously reserved file to the queue
+     * 
+     * Use reserveFile() to get the next file number, addFileToQueue() to add it to the queue
+     * and getFileFromQueue() to get an item from the queue.
+     * 
+     * It's safe to call reserveFile(), addFileToQueue(), and getFileFromQueue() from different
+     * threads. Locking is handled internally.
+     * 
+     * @return true if the file was queued. With withMaxFiles() or withMaxBytes() and the
+     * REJECT_NEW or BLOCK policy, the limits are checked again here using the actual size 
+     * of the file. If it does not fit (after waiting, for BLOCK), the file and its sidecar
+     * files are removed and false is returned.
+     */
+    bool addFileToQueue(int fileNum);
+
+    /**
+     * @brief Adds a previously reserved file to the queue with caller-provided metadata
+     * 
+     * @param fileNum The file number to add
+     * 
+     * @param meta The metadata to store for the file. Only used with withMetadata(), and 
+     * stat() is not called on the file.
+     * 
+     * For example, if you just wrote the file you already know its size.
+     * 
+     * @return true if the file was queued, the same as addFileToQueue(int)
+     */
+    bool addFileToQueue(int fileNum, const SequentialFileMeta &meta);
+
+    /**
+     * @brief Adds a previously reserved file to a priority lane
+     * 
+     * @param fileNum The file number to add. The file has the extension from
+     * getExtensionForPriority(priority).
+     * 
+     * @param priority The priority lane, set up using withPriorityExtension(). 0 is the 
+     * same as addFileToQueue().
+     * 
+     * @param meta (optional) Metadata for the file, the same as addFileToQueue(). If NULL 
+     * and withMetadata() is enabled, stat() is used.
+     * 
+     * @return true if the file was queued, the same as addFileToQueue(int)
+     */
+    bool addFileToQueueWithPriority(int fileNum, int priority, const SequentialFileMeta *meta = NULL);
+
+    /**
+     * @brief Adds several previously reserved files to the queue
+     * 
+     * @param fileNums Array of file numbers to add, in order
+     * 
+     * @param count Number of file numbers in fileNums
+     * 
+     * @return The number of files queued
+     * 
+     * This is the same as calling addFileToQueue() for each file, except the queue is locked
+     * once for the whole batch, and sequential file numbers use a single index file record.
+     * If the limits don't allow all of the files to be added at once, they're added one at
+     * a time, in order, instead.
+     */
+    size_t addFilesToQueue(const int *fileNums, size_t count);
+
+    /**
+     * @brief Gets a file from the queue
+     * 
+     * @param remove (optional, default true). If true, removes the file from the queue in
+     * RAM. If false, calling getFileFromQueue() again will retrieve the same fileNum.
+     * 
+     * @param meta (optional) If not NULL and withMetadata() is enabled, filled in with the 
+     * metadata for the file.
+     * 
+     * @param priority (optional) If not NULL, filled in with the priority lane of the file.
+     * With withPriorityExtension(), files are returned from the highest priority lane that
+     * is not empty.
+     * 
+     * @return 0 if there are no items in the queue, or a fileNum for an item in the queue.
+     * 
+     * Use getPathForFileNum() to convert the number into a pathname for use with open().
+     * 
+     * The queue is stored in RAM, so if the device reboots before you delete the file it
+     * will reappear in the queue when scanDir is called. This method does not need to access 
+     * the filesystem. You can call getFileFromQueue() on every loop if you want to to check 
+     * if there are files to process without affecting performance. From a worker thread,
+     * use waitFileFromQueue() instead of polling.
+     * 
+     * It's safe to call reserveFile(), addFileToQueue(), and getFileFromQueue() from different
+     * threads. Locking is handled internally.
+     * 
+     */
+    int getFileFromQueue(bool remove = true, SequentialFileMeta *meta = NULL, int *priority = NULL);
+
+    /**
+     * @brief Waits for a file to be available in the queue and removes it from the queue in RAM
+     * 
+     * @param timeoutMs Maximum time to wait in milliseconds. 0 does not wait, the same as
+     * getFileFromQueue(). CONCURRENT_WAIT_FOREVER waits until a file is available.
+     * 
+     * @param meta (optional) If not NULL and withMetadata() is enabled, filled in with the 
+     * metadata for the file.
+     * 
+     * @param priority (optional) If not NULL, filled in with the priority lane of the file.
+     * 
+     * @return 0 if there were no items in the queue before the timeout, or a fileNum for an
+     * item in the queue.
+     * 
+     * This is intended for a consumer running in its own thread. Instead of polling 
+     * getFileFromQueue(), the thread blocks until addFileToQueue(), addFilesToQueue(), or
+     * scanDir() adds files to the queue, using little CPU or power while waiting.
+     */
+    int waitFileFromQueue(system_tick_t timeoutMs = CONCURRENT_WAIT_FOREVER, SequentialFileMeta *meta = NULL, int *priority = NULL);
+
+    /**
+     * @brief Gets up to maxFiles files from the queue, removing them from the queue in RAM
+     * 
+     * @param fileNums Array filled in with up to maxFiles file numbers, in queue order
+     * 
+     * @param maxFiles Maximum number of file numbers to return (size of the fileNums array)
+     * 
+     * @param metas (optional) If not NULL and withMetadata() is enabled, an array of maxFiles
+     * entries filled in with the metadata for each file.
+     * 
+     * @param priorities (optional) If not NULL, an array of maxFiles entries filled in with 
+     * the priority lane of each file.
+     * 
+     * @return The number of file numbers stored in fileNums, 0 if the queue is empty
+     * 
+     * This is the same as calling getFileFromQueue() until it returns 0 or maxFiles files
+     * have been retrieved, except the queue is locked once for the whole batch. This is 
+     * useful if you combine several small files into one upload.
+     */
+    size_t getFilesFromQueue(int *fileNums, size_t maxFiles, SequentialFileMeta *metas = NULL, int *priorities = NULL);
+
+    /**
+     * @brief Gets up to maxFiles files from the front of the queue and marks them in flight
+     * 
+     * @param fileNums Array filled in with up to maxFiles file numbers, in queue order
+     * 
+     * @param maxFiles Maximum number of file numbers to return (size of the fileNums array)
+     * 
+     * @param metas (optional) If not NULL and withMetadata() is enabled, an array of maxFiles
+     * entries filled in with the metadata for each file.
+     * 
+     * @param priorities (optional) If not NULL, an array of maxFiles entries filled in with 
+     * the priority lane of each file.
+     * 
+     * @return The number of file numbers stored in fileNums, 0 if the queue is empty
+     * 
+     * Like getFilesFromQueue(), the files are no longer in the queue, so other consumers
+     * won't get them. Each file must later be passed to ack() once it has been processed, 
+     * which removes it, or nack() if processing failed, which returns it to the front of 
+     * the queue. This allows several uploads to be in progress at the same time without
+     * losing a file if one fails.
+     * 
+     * In-flight files are still counted by withMaxFiles() and withMaxBytes(). They are 
+     * only tracked in RAM, so after a reset they're found by scanDir() again. Calling 
+     * scanDir() or removeAll() forgets all in-flight files.
+     * 
+     * Not supported with a lock-free queue container (SequentialFileSpscQueue) unless 
+     * priority lanes are used.
+     */
+    size_t acquire(int *fileNums, size_t maxFiles, SequentialFileMeta *metas = NULL, int *priorities = NULL);
+
+    /**
+     * @brief Acknowledges a file from acquire(), removing it from the file system
+     * 
+     * @param fileNum A file number from acquire()
+     * 
+     * @param allExtensions If true, all files with that number regardless of extension are removed.
+     * See removeFileNum().
+     * 
+     * @return true if the file was removed, false if fileNum is not in flight
+     */
+    bool ack(int fileNum, bool allExtensions = false);
+
+    /**
+     * @brief Returns a file from acquire() to the front of the queue
+     * 
+     * @param fileNum A file number from acquire()
+     * 
+     * @return true if the file was returned to the queue, false if fileNum is not in flight
+     * 
+     * The next getFileFromQueue() or acquire() returns this file again. If you return 
+     * several files, return them in reverse order to keep the original order, or use nackAll().
+     */
+    bool nack(int fileNum);
+
+    /**
+     * @brief Returns all in-flight files to the front of the queue, in their original order
+     */
+    void nackAll();
+
+    /**
+     * @brief Gets the number of files returned by acquire() that have not been passed to ack() or nack()
+     */
+    size_t getInFlightCount() const;
+
+    /**
+     * @brief Gets the next file for a consumer group
+     * 
+     * @param group Group number from getConsumerGroup()
+     * 
+     * @param meta (optional) If not NULL and withMetadata() is enabled, filled in with the 
+     * metadata for the file.
+     * 
+     * @return The next file number this group has not been given yet, or 0 if there are none
+     * 
+     * The file stays in the queue until each group has passed it to ackGroup(). Use 
+     * rewindGroup() if processing failed to get the files that were not acknowledged again.
+     */
+    int getFileFromGroup(int group, SequentialFileMeta *meta = NULL);
+
+    /**
+     * @brief Acknowledges a file for a consumer group
+     * 
+     * @param group Group number from getConsumerGroup()
+     * 
+     * @param fileNum A file number from getFileFromGroup()
+     * 
+     * @param allExtensions If true, when the file is removed all files with that number 
+     * regardless of extension are removed. See removeFileNum().
+     * 
+     * @return true if the acknowledgement was recorded, false if the group or fileNum is not 
+     * valid or the group already acknowledged the file
+     * 
+     * When the last group acknowledges a file, it's removed from the file system.
+     */
+    bool ackGroup(int group, int fileNum, bool allExtensions = false);
+
+    /**
+     * @brief Starts a consumer group from the beginning of the queue again
+     * 
+     * @param group Group number from getConsumerGroup()
+     * 
+     * getFileFromGroup() returns the files the group has been given but not acknowledged
+     * again, in file number order.
+     */
+    void rewindGroup(int group);
+
+    /**
+     * @brief Gets the number of files in the queue that a consumer group has not acknowledged
+     * 
+     * @param group Group number from getConsumerGroup()
+     */
+    size_t getGroupQueueLen(int group) const;
+
+    /**
+     * @brief Uses pattern to create a filename given a fileNum
+     * 
+     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * 
+     * @param overrideExt If non-null, use this extension instead of the configured
+     * filename extension. It should not contain the preceeding dot.
+     * 
+     * The overrideExt is used when you create multiple files per queue entry fileNum,
+     * for example a data file and a .sha1 hash for the file. Or other metadata.
+     */
+    String getNameForFileNum(int fileNum, const char *overrideExt = NULL);
+
+    /**
+     * @brief Gets a full pathname based on dirName and getNameForFileNum
+     * 
+     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * 
+     * @param overrideExt If non-null, use this extension instead of the configured
+     * filename extension.
+     * 
+     * The overrideExt is used when you create multiple files per queue entry fileNum,
+     * for example a data file and a .sha1 hash for the file. Or other metadata.
+     */
+    String getPathForFileNum(int fileNum, const char *overrideExt = NULL);
+
+    /**
+     * @brief Uses pattern to create a filename given a fileNum, without allocating memory
+     * 
+     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * 
+     * @param buf Buffer to store the filename in
+     * 
+     * @param bufSize Size of buf in bytes
+     * 
+     * @param overrideExt If non-null, use this extension instead of the configured
+     * filename extension. It should not contain the preceeding dot.
+     * 
+     * @return true if the filename was stored in buf, or false if it did not fit.
+     * 
+     * If the pattern is of the form %0Nd (such as the default %08d), the number is
+     * formatted directly instead of using snprintf.
+     */
+    bool getNameForFileNum(int fileNum, char *buf, size_t bufSize, const char *overrideExt = NULL) const;
+
+    /**
+     * @brief Gets a full pathname based on dirName and getNameForFileNum, without allocating memory
+     * 
+     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * 
+     * @param buf Buffer to store the pathname in
+     * 
+     * @param bufSize Size of buf in bytes
+     * 
+     * @param overrideExt If non-null, use this extension instead of the configured
+     * filename extension.
+     * 
+     * @return true if the pathname was stored in buf, or false if it did not fit.
+     * 
+     * Unlike the version that returns a String this does not allocate from the heap,
+     * so it's a good choice if you need the pathname frequently.
+     */
+    bool getPathForFileNum(int fileNum, char *buf, size_t bufSize, const char *overrideExt = NULL) const;
+
+    /**
+     * @brief Gets the pathname to write a new file to before it's added to the queue
+     * 
+     * @param fileNum A file number, typically from reserveFile()
+     * 
+     * @param overrideExt If non-null, use this extension instead of the configured
+     * filename extension.
+     * 
+     * With withTempExtension(), this is getPathForFileNum() with the temporary extension 
+     * appended. Otherwise it's the same as getPathForFileNum().
+     */
+    String getTempPathForFileNum(int fileNum, const char *overrideExt = NULL);
+
+    /**
+     * @brief Gets the pathname to write a new file to before it's added to the queue, without allocating memory
+     * 
+     * @param fileNum A file number, typically from reserveFile()
+     * 
+     * @param buf Buffer to store the pathname in
+     * 
+     * @param bufSize Size of buf in bytes
+     * 
+     * @param overrideExt If non-null, use this extension instead of the configured
+     * filename extension.
+     * 
+     * @return true if the pathname was stored in buf, or false if it did not fit.
+     */
+    bool getTempPathForFileNum(int fileNum, char *buf, size_t bufSize, const char *overrideExt = NULL) const;
+
+    /**
+     * @brief Remove fileNum from the flash file system
+     *
+     * @param fileNum A file number, typically from reserveFile() or getFileFromQueue()
+     * 
+     * @param allExtensions If true, all files with that number regardless of extension are removed.
+     * 
+     * If there are no sidecar extensions, allExtensions requires reading the whole queue directory.
+     * Use withSidecarExtension() to remove the sidecar files directly instead.
+     */
+    void removeFileNum(int fileNum, bool allExtensions);
+
+    /**
+     * @brief Remove a range of fileNums from the flash file system
+     * 
+     * @param fromFileNum The first file number to remove
+     * 
+     * @param toFileNum The last file number to remove (inclusive)
+     * 
+     * @param allExtensions If true, all files with those numbers regardless of extension are removed.
+     * 
+     * This is the same as calling removeFileNum() for each file number, except that with 
+     * allExtensions and no sidecar extensions the queue directory is only read once. 
+     * It's also a single index file record.
+     */
+    void removeFileNums(int fromFileNum, int toFileNum, bool allExtensions);
+
+    /**
+     * @brief Removes all of the files in the queue directory
+     * 
+     * @brief removeDir true to remove the queue directory itself, false to just remove the contents.
      * 
      * Note this is all files, not just the filenames with the matching extension. 
      * Also removes the entries from the RAM-based queue and sets lastFileNum to 0.
+     * 
+     * With withFastRemoveAll(), the queue directory is renamed and the files are deleted
+     * later by a worker thread, so this returns without waiting for them to be deleted.
+     */
+    void removeAll(bool removeDir);
+
+    /**
+     * @brief Removes all of the files in the queue directory a slice at a time
+     * 
+     * @param removeDir true to remove the queue directory itself, false to just remove the contents.
+     * 
+     * @param maxEntries Maximum number of directory entries to read in this call
+     * 
+     * @param maxMs If not 0, also return once this many milliseconds have elapsed
+     * 
+     * @return StepResult::IN_PROGRESS until all of the files have been removed. Call it 
+     * again, with the same removeDir, until it returns DONE.
+     * 
+     * This is the same as removeAll(), for apps without SYSTEM_THREAD(ENABLED). The RAM-based
+     * queue is emptied by the first call, and lastFileNum is set to 0 when it's done. Don't 
+     * reserve or add files until then, since they would be removed. A scanDirStep() in 
+     * progress is abandoned. With withFastRemoveAll(), the first call renames the directory 
+     * and returns DONE.
+     */
+    StepResult removeAllStep(bool removeDir, size_t maxEntries = 100, system_tick_t maxMs = 0);
+
+    /**
+     * @brief Makes removeAll() rename the queue directory instead of deleting each file (default: disabled)
+     * 
+     * @param enable true to enable
+     * 
+     * @param priority Thread priority of the thread that deletes the files (default: one
+     * below OS_THREAD_PRIORITY_DEFAULT)
+     * 
+     * When enabled, removeAll() renames the queue directory to a tombstone directory 
+     * (the queue directory name with .rm1, .rm2, ... appended) and creates a new empty queue
+     * directory, so files can be queued again immediately. The tombstone directory is 
+     * deleted by a low-priority worker thread, one file at a time. If the device resets 
+     * before it has been deleted, scanDir() starts deleting it again.
+     * 
+     * If the directory can't be renamed, removeAll() deletes the files itself.
+     */
+    SequentialFile &withFastRemoveAll(bool enable = true, os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT - 1) { 
+        this->fastRemoveAll = enable; this->tombstonePriority = priority; return *this; 
+    };
+
+    /**
+     * @brief Returns true if the worker thread from withFastRemoveAll() is still deleting files
+     */
+    bool isRemoving() const { return tombstoneRunning; };
+
+    /**
+     * @brief Keeps spare files in the queue directory for Writer to reuse (default: 0, disabled)
+     * 
+     * @param poolSize Number of spare files to keep, at most MAX_POOL_SIZE
+     * 
+     * Normally each file is created by Writer::begin() and deleted by removeFileNum(). With
+     * a pool, scanDir() creates poolSize empty spare files (pool.0, pool.1, ... in the queue
+     * directory) while the device is not busy, Writer::begin() renames a spare file to the
+     * new file instead of creating one, and removeFileNum() renames the file back to a free
+     * spare and truncates it instead of deleting it. When the pool is empty or full, files 
+     * are created and deleted as usual.
+     * 
+     * This moves file creation out of the write path and keeps the set of directory 
+     * entries stable under sustained load. Whether it reduces write latency depends on 
+     * the file system, so compare getStats() with and without it. Only files with the 
+     * filenameExtension and priority lane extensions are pooled, not sidecar files. 
+     * Call this before scanDir().
+     */
+    SequentialFile &withFilePool(size_t poolSize) { this->poolSize = (poolSize > MAX_POOL_SIZE) ? MAX_POOL_SIZE : poolSize; return *this; };
+
+    /**
+     * @brief Gets the pool size set using withFilePool()
+     */
+    size_t getFilePoolSize() const { return poolSize; };
+
+    /**
+     * @brief Gets the number of spare files in the pool that are available for reuse
+     */
+    size_t getFilePoolAvailable() const;
+
+    /**
+     * @brief Maximum pool size for withFilePool()
+     */
+    static const size_t MAX_POOL_SIZE = 32;
+
+    /**
+     * @brief Gets the length of the queue
+     */
+    int getQueueLen() const;
+
+    /**
+     * @brief Gets the length of one priority lane
+     * 
+     * @param priority The priority lane, 0 for files with the filename extension
+     */
+    int getQueueLen(int priority) const;
+
+    /**
+     * @brief Gets the metadata for a file in the queue
+     * 
+     * @param fileNum The file number
+     * 
+     * @param meta Filled in with the metadata
+     * 
+     * @return true if the file is in the queue and withMetadata() is enabled
+     */
+    bool getFileMeta(int fileNum, SequentialFileMeta &meta) const;
+
+    /**
+     * @brief Gets the total size in bytes of the files in the queue
+     * 
+     * Only available with withMetadata(); returns 0 otherwise. This does not access the file system.
+     */
+    uint64_t getQueuedBytes() const;
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialFile(const SequentialFile&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialFile& operator=(const SequentialFile&) = delete;
+
+    /**
+     * @brief Creates the directory path if it does not exist
+     * 
+     * Note: This only creates the last element of the path if it does not
+     * exist. If you use directories nested more than one level deep,
+     * you'll need to call this separately to create parent directories!
+     */
+    static bool createDirIfNecessary(const char *path);
+
+    /**
+     * @brief Combines name and ext into a filename with an optional filename extension
+     * 
+     * @param name Filename (required)
+     * 
+     * @param ext Filename extension (optional). If you pass is NULL or an 
+     * empty string, the dot and extension are not appended.
+     * 
+     * Only adds the . when ext is non-null and non-empty.
+     */
+    static String getNameWithOptionalExt(const char *name, const char *ext);
+
+    /**
+     * @brief Calculates a CRC-32 (IEEE 802.3, the same as zlib)
+     * 
+     * @param data Data to checksum
+     * 
+     * @param len Length of data in bytes
+     * 
+     * @param crc The previous value when calculating the CRC of data in multiple pieces, or 0.
+     * 
+     * Used to check records in the index file and segment files.
+     */
+    static uint32_t crc32(const void *data, size_t len, uint32_t crc = 0);
+
+    /**
+     * @brief Compresses data using the LZ4 block format
+     * 
+     * @param src Data to compress
+     * 
+     * @param srcLen Length of src in bytes. Must be no larger than MAX_COMPRESSED_BLOCK_SIZE.
+     * 
+     * @param dst Buffer to store the compressed block in
+     * 
+     * @param dstSize Size of dst in bytes
+     * 
+     * @param hashTable Work area of LZ4_HASH_SIZE entries. It does not need to be initialized.
+     * 
+     * @return The length of the compressed block, or 0 if it did not fit in dstSize bytes
+     * 
+     * The result can be decompressed by lz4DecompressBlock() or LZ4_decompress_safe() from 
+     * the standard LZ4 library. Pass srcLen - 1 as dstSize to only compress data that gets smaller.
+     */
+    static size_t lz4CompressBlock(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstSize, uint16_t *hashTable);
+
+    /**
+     * @brief Decompresses a block in the LZ4 block format
+     * 
+     * @param src The compressed block
+     * 
+     * @param srcLen Length of the compressed block in bytes
+     * 
+     * @param dst Buffer to store the decompressed data in
+     * 
+     * @param dstSize Size of dst in bytes
+     * 
+     * @return The length of the decompressed data, or -1 if the block is invalid or does 
+     * not fit in dstSize bytes
+     */
+    static int lz4DecompressBlock(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t dstSize);
+
+    /**
+     * @brief Returns true if buf starts with the header of a file compressed using withCompression()
+     * 
+     * @param buf The first bytes of the file
+     * 
+     * @param len Number of bytes in buf. COMPRESSED_HEADER_SIZE bytes are checked.
+     */
+    static bool isCompressedHeader(const uint8_t *buf, size_t len);
+
+    /**
+     * @brief Size of the header at the start of a compressed file
+     */
+    static const size_t COMPRESSED_HEADER_SIZE = 6;
+
+    /**
+     * @brief Size of the header before each block in a compressed file
+     */
+    static const size_t COMPRESSED_BLOCK_HEADER_SIZE = 4;
+
+    /**
+     * @brief Maximum uncompressed size of a block in a compressed file
+     */
+    static const size_t MAX_COMPRESSED_BLOCK_SIZE = 65535;
+
+    /**
+     * @brief Number of entries in the hashTable passed to lz4CompressBlock()
+     */
+    static const size_t LZ4_HASH_SIZE = 256;
+
+    /**
+     * @brief Enables collecting statistics in RAM (default: disabled)
+     * 
+     * @param enable true to collect statistics, returned by getStats()
+     * 
+     * Collecting statistics adds a few calls to micros() and a mutex lock to each queue 
+     * operation, so it's off by default.
+     */
+    SequentialFile &withStats(bool enable = true) { this->collectStats = enable; return *this; };
+
+    /**
+     * @brief Gets a copy of the statistics collected since the object was created or resetStats()
+     * 
+     * All values are 0 unless withStats() is enabled. The struct is small enough to format
+     * into a Particle.publish() event or return from a cloud variable.
+     */
+    SequentialFileStats getStats() const;
+
+    /**
+     * @brief Sets all of the statistics back to 0
+     */
+    void resetStats();
+
+    /**
+     * @brief Maximum number of consumer groups (withConsumerGroup())
+     */
+    static const size_t MAX_CONSUMER_GROUPS = 8;
+
+protected:
+    // Scans the queue and signals it using the protected members
+    friend class SequentialFileManager;
+
+    /**
+     * @brief Allows a subclass to choose whether to queue a file or not during scanDir.
+     * 
+     * @param name A potential filename in the queue directory. If using withShardSize(),
+     * it's the filename within the shard subdirectory.
+     * 
+     * @return true to add the file to the queue or false to not queue the file.
+     * 
+     * This would allow a subclass to do some validation of the file before adding
+     * it to the queue when reading the files from disk after reboot.
+     */
+    virtual bool preScanAddHook(const char *name) { return true; };
+
+    /**
+     * @brief Adds the files in one directory to fileNums. Used by scanDir().
+     * 
+     * @param path The queue directory, or a shard subdirectory
+     * 
+     * @param shard The shard number of path, or -1 if not using shards
+     * 
+     * @param laneFileNums The file numbers are added to the set for their priority lane
+     * 
+     * @param scanLastNum Updated if a file number higher than it is found
+     * 
+     * @return The number of files that match the pattern, or -1 if the directory could not be opened
+     */
+    int scanDirFiles(const char *path, int shard, std::vector<SequentialFileRunSet> &laneFileNums, int &scanLastNum);
+
+    /**
+     * @brief Removes a range of file numbers that are all in the directory path
+     */
+    void removeFileNumsInDir(const char *path, int fromFileNum, int toFileNum, bool allExtensions);
+
+    /**
+     * @brief Gets the pathname to a shard subdirectory, without allocating memory
+     * 
+     * @return true if the pathname was stored in buf, or false if it did not fit.
+     */
+    bool getShardPath(int shard, char *buf, size_t bufSize) const;
+
+    /**
+     * @brief Creates the shard subdirectories for a range of file numbers if they don't exist
+     */
+    void createShardDirs(int fromFileNum, int toFileNum);
+
+    /**
+     * @brief Forgets reserved file numbers once their files are queued or removed. Only used with shards or a temporary extension.
+     */
+    void shardRelease(int fromFileNum, int toFileNum);
+
+    /**
+     * @brief Returns true if reserved file numbers are kept in shardReserved, which is needed with shards or a temporary extension
+     */
+    bool isReserveTracked() const { return shardSize > 0 || tempExtension.length() > 0; };
+
+    /**
+     * @brief Returns true if fileNum was reserved and its file has not been queued or removed yet
+     */
+    bool isReserved(int fileNum);
+
+    /**
+     * @brief Returns true if no reserved or future file number is in the shard, so its directory can be removed
+     */
+    bool isShardRemovable(int shard);
+
+    /**
+     * @brief Removes the shard directories found empty by a scan, if isShardRemovable()
+     */
+    void removeEmptyShards(const std::vector<int> &shards);
+
+    /**
+     * @brief Parses a shard subdirectory name
+     * 
+     * @return true if name is a shard subdirectory name
+     */
+    static bool parseShard(const char *name, int &shard);
+
+    /**
+     * @brief Removes all plain files in a directory, but not the directory itself
+     */
+    static void removeDirFiles(const char *path);
+
+    /**
+     * @brief Adds count to one of the counters in stats, if withStats() is enabled
+     */
+    void statsCount(uint32_t SequentialFileStats::*counter, size_t count) const;
+
+    /**
+     * @brief Adds the time since startUs to one of the histograms in stats, if withStats() is enabled
+     */
+    void statsTime(SequentialFileHistogram SequentialFileStats::*histogram, unsigned long startUs) const;
+
+    /**
+     * @brief Updates stats.maxQueueLen. Call with the queue container locked, after adding files.
+     */
+    void statsQueueLen();
+
+    /**
+     * @brief Records a completed scan that started at startUs, if withStats() is enabled
+     */
+    void statsScan(unsigned long startUs);
+
+    /**
+     * @brief Renames the queue directory to a new tombstone directory for removeAll()
+     * 
+     * @param removeDir true to remove the queue directory, false to create a new empty one
+     * 
+     * @return false if the directory could not be renamed, so the files must be removed now
+     */
+    bool tombstoneDir(bool removeDir);
+
+    /**
+     * @brief Adds tombstone directories left over from before a reset. Called from scanDir().
+     */
+    void tombstoneResume();
+
+    /**
+     * @brief Starts the tombstone thread if there are tombstone directories and it's not running
+     */
+    void tombstoneStart();
+
+    /**
+     * @brief Tombstone thread entry point, param is the SequentialFile
+     */
+    static void tombstoneThreadFunction(void *param);
+
+    /**
+     * @brief Removes a directory, its subdirectories, and all of the files in them
+     * 
+     * Stops early if tombstoneStop is set.
+     */
+    void removeTree(const char *path);
+
+    /**
+     * @brief Parses a filename in the queue directory
+     * 
+     * @param name The filename (not the full path)
+     * 
+     * @param fileNum Filled in with the file number if the name matches
+     * 
+     * @param anyExtension If true, the name can have any extension or no extension. If false,
+     * it must have the filename extension (or no extension, if the filename extension is empty).
+     * 
+     * @return true if the name matches the pattern
+     * 
+     * This does not allocate memory. For %0Nd patterns it does not use sscanf.
+     */
+    bool parseFileNum(const char *name, int &fileNum, bool anyExtension) const;
+
+    /**
+     * @brief Parses the number at the start of a filename
+     * 
+     * @return The part of name after the number, or NULL if it does not start with a number
+     * that matches the pattern
+     */
+    const char *parseFileNumPrefix(const char *name, int &fileNum) const;
+
+    /**
+     * @brief Parses a filename in the queue directory and finds its priority lane
+     * 
+     * @return The lane index, or -1 if the name does not match the pattern and the 
+     * extension of a lane
+     */
+    int parseLane(const char *name, int &fileNum) const;
+
+    /**
+     * @brief Renames the temporary file for fileNum to its queue filename. Only used with withTempExtension().
+     * 
+     * @return true if the file was renamed or there was no temporary file
+     */
+    bool commitTempFile(int fileNum, const char *overrideExt = NULL);
+
+    /**
+     * @brief Adds files to the RAM queue and index without renaming temporary files
+     */
+    size_t queueFileNums(const int *fileNums, size_t count);
+
+    /**
+     * @brief Implements addFileToQueue(). meta is NULL to get the metadata using stat().
+     */
+    bool queueFile(int fileNum, size_t lane, const SequentialFileMeta *meta);
+
+    /**
+     * @brief Gets the size and mtime of a file using stat()
+     * 
+     * @return true if the file exists
+     */
+    bool statFileMeta(int fileNum, SequentialFileMeta &meta, const char *overrideExt = NULL);
+
+    /**
+     * @brief Adds or replaces the metadata for fileNum. Only used with withMetadata().
+     */
+    void metaInsert(int fileNum, const SequentialFileMeta &meta);
+
+    /**
+     * @brief Removes the metadata for fileNum, optionally copying it to meta first. Only used with withMetadata().
+     */
+    void metaTake(int fileNum, SequentialFileMeta *meta);
+
+    /**
+     * @brief Returns true if adding addFiles files with a total of addBytes bytes would exceed the limits
+     */
+    bool isQueueFull(size_t addFiles, uint64_t addBytes) const;
+
+    /**
+     * @brief Returns true if withMaxFiles(), withMaxBytes(), or a SequentialFileManager quota limits the queue
+     */
+    bool hasQueueLimit() const;
+
+    /**
+     * @brief Returns true if files are checked against the limits when they are queued (REJECT_NEW and BLOCK)
+     */
+    bool isAdmitChecked() const;
+
+    /**
+     * @brief Locks admitMutex if addFiles files of addBytes bytes fit in the queue
+     * 
+     * @param wait true to wait for space with the BLOCK policy
+     * 
+     * @return true if they fit. Call admitUnlock() once they're queued.
+     */
+    bool admitLock(size_t addFiles, uint64_t addBytes, bool wait);
+
+    /**
+     * @brief Unlocks the mutex locked by admitLock()
+     */
+    void admitUnlock();
+
+    /**
+     * @brief Removes the oldest file in the lowest priority lane from the queue and deletes it
+     * 
+     * @return false if the queue is empty
+     */
+    bool evictOldest();
+
+    /**
+     * @brief Makes room for addFiles files with a total of addBytes bytes. Only used with DROP_OLDEST.
+     */
+    void evictIfFull(size_t addFiles, uint64_t addBytes);
+
+    /**
+     * @brief Wakes a producer blocked in reserveFile(), if using limits. Called when files are taken from the queue.
+     */
+    void spaceSignal();
+
+    /**
+     * @brief Gets the number of priority lanes, 1 if not using withPriorityExtension()
+     */
+    size_t getNumLanes() const { return lanes.empty() ? 1 : lanes.size(); };
+
+    /**
+     * @brief Gets the queue container for a lane index
+     */
+    SequentialFileQueue *getLaneQueue(size_t lane) const { return (lanes.empty() || !lanes[lane].queue) ? queue : lanes[lane].queue; };
+
+    /**
+     * @brief Gets the filename extension for a lane index, or NULL for the filename extension (priority 0)
+     */
+    const char *getLaneExt(size_t lane) const { return (lanes.empty() || !lanes[lane].queue) ? NULL : lanes[lane].ext.c_str(); };
+
+    /**
+     * @brief Gets the priority of a lane index
+     */
+    int getLanePriority(size_t lane) const { return lanes.empty() ? 0 : lanes[lane].priority; };
+
+    /**
+     * @brief Gets the lane index for a priority, or -1 if there is no lane with that priority
+     */
+    int findLane(int priority) const;
+
+    /**
+     * @brief Gets the lane index of the highest priority lane with files in it, or -1. Call with the queue locked.
+     */
+    int getFrontLane() const;
+
+    /**
+     * @brief A priority lane, when using withPriorityExtension()
+     */
+    struct Lane {
+        int priority;                   //!< Priority, higher numbers are returned first
+        String ext;                     //!< Filename extension, empty for priority 0
+        SequentialFileQueue *queue;     //!< Queue container, or NULL for priority 0, which uses queue
+    };
+
+    /**
+     * @brief Metadata for one queued file, when using withMetadata()
+     */
+    struct MetaEntry {
+        int fileNum;                //!< File number
+        SequentialFileMeta meta;    //!< File metadata
+    };
+
+    /**
+     * @brief A file returned by acquire() that has not been passed to ack() or nack()
+     */
+    struct InFlight {
+        int fileNum;                //!< File number
+        size_t lane;                //!< Priority lane the file came from, so nack() can return it
+    };
+
+    /**
+     * @brief Removes fileNum from inFlight. Call with queueMutex locked.
+     * 
+     * @return false if fileNum is not in flight
+     */
+    bool inFlightRemove(int fileNum, InFlight &entry);
+
+    /**
+     * @brief Returns an in-flight file to the front of its lane. Call with queueMutex locked.
+     */
+    void inFlightRequeue(const InFlight &entry);
+
+    /**
+     * @brief Returns files taken from the queue to the front of their lanes, in order. Used by Reader::stop().
+     * 
+     * The files were already counted by the queue limits when they were added, so they are not checked again.
+     * Not done with a lock-free queue container; the files stay on disk and are found by the next scanDir().
+     */
+    void requeueFiles(const int *fileNums, const int *priorities, size_t count);
+
+    /**
+     * @brief State of a consumer group added using withConsumerGroup()
+     */
+    struct ConsumerGroup {
+        String name;                    //!< Name of the group
+        int cursor;                     //!< Last file number returned by getFileFromGroup(), or 0
+        SequentialFileRunSet acked;     //!< Files the group has acknowledged that have not been removed yet
+    };
+
+    /**
+     * @brief Moves the files in the queue containers into groupFiles. Call with queueMutex locked.
+     */
+    void groupDrain();
+
+    /**
+     * @brief Removes files that are not in laneFileNums from the acknowledged files of each group. Call with queueMutex locked.
+     */
+    void groupPrune(const std::vector<SequentialFileRunSet> &laneFileNums);
+
+    /**
+     * @brief Removes the file for fileNum with the filename extension or overrideExt
+     * 
+     * @return The result from unlink(), 0 on success
+     */
+    int unlinkFileNum(int fileNum, const char *overrideExt);
+
+    /**
+     * @brief Removes a file, moving it to the pool instead if it's a queue file and the pool has a free slot
+     * 
+     * @param path Path of the file to remove
+     * 
+     * @param poolable true if the file can be moved to the pool
+     * 
+     * @return 0 on success or -1 on error, like unlink()
+     */
+    int removeFile(const char *path, bool poolable);
+
+    /**
+     * @brief Gets the path to a spare file in the pool
+     */
+    String getPoolPath(size_t slot) const;
+
+    /**
+     * @brief Finds the spare files from before a reset and creates the missing ones. Called by scans.
+     */
+    void poolLoad();
+
+    /**
+     * @brief Renames a spare file from the pool to path, so it does not need to be created
+     * 
+     * @return true if a spare file was renamed to path, false if the pool is empty
+     */
+    bool poolTake(const char *path);
+
+    /**
+     * @brief Renames the file at path to a free slot in the pool and truncates it
+     * 
+     * @return true if the file was moved to the pool, false if it should be deleted
+     */
+    bool poolPut(const char *path);
+
+    /**
+     * @brief Sets lastFileNum to fileNum if fileNum is larger, atomically
+     */
+    void updateLastFileNum(int fileNum);
+
+    /**
+     * @brief Calls scanDir() if it has not been called yet
+     * 
+     * @param needLastFileNum true if the caller uses lastFileNum, such as reserveFile()
+     * 
+     * If multiple threads call this at the same time, only one calls scanDir() and the 
+     * others wait for it to complete. While scanDirAsync() is running this returns 
+     * immediately, unless needLastFileNum is true and the high-water mark was not loaded,
+     * in which case it waits for the scan to complete.
+     */
+    void scanDirIfNecessary(bool needLastFileNum = false);
+
+    /**
+     * @brief Implementation of scanDir() and scanDirAsync()
+     * 
+     * @param async true if called from the scanDirAsync() thread. Files are appended to the
+     * queue as they are found, and files added during the scan are queued at the end.
+     */
+    bool scanDirInternal(bool async);
+
+    /**
+     * @brief Scan thread entry point, param is the SequentialFile
+     */
+    static void scanThreadFunction(void *param);
+
+    /**
+     * @brief Checks the configuration and prepares the queue directory before a scan
+     */
+    bool scanPrepare();
+
+    /**
+     * @brief Empties the queue and sets up deferred adds before scanDirAsync() or scanDirStep()
+     */
+    void scanAsyncBegin();
+
+    /**
+     * @brief Handles one directory entry read by a scan
+     * 
+     * @return true if it's a queue file in the right shard, even if preScanAddHook() skipped it
+     */
+    bool scanDirEntry(const char *path, int shard, const struct dirent *ent, std::vector<SequentialFileRunSet> &laneFileNums, int &scanLastNum);
+
+    /**
+     * @brief Implementation of scanDirStep(). Call with scanMutex locked.
+     * 
+     * @param maxEntries Maximum number of directory entries to read, 0 to finish the scan
+     */
+    StepResult scanStepInternal(size_t maxEntries, system_tick_t maxMs);
+
+    /**
+     * @brief Starts a step-wise scan, the first part of scanDirStep(). Call with scanMutex locked.
+     * 
+     * @return IN_PROGRESS if the directory is open for scanStepInternal(), DONE if the 
+     * queue was loaded from the index file, or FAILED
+     */
+    StepResult scanStepBegin();
+
+    /**
+     * @brief Ends a step-wise scan or removeAll, closing any open directories
+     */
+    void stepClose();
+
+    /**
+     * @brief Empties the RAM-based queue, in-flight files, consumer groups, and metadata. Call with queueMutex locked.
+     */
+    void queueClear();
+
+    /**
+     * @brief Resets the queue state after removing all files. Call with scanMutex locked.
+     */
+    void removeAllFinish(bool removeDir);
+
+    /**
+     * @brief If scanDirAsync() is running, saves files being added so they are queued at the end of the scan
+     * 
+     * @return true if the files were saved, false if they should be queued now
+     */
+    bool scanDeferAdd(size_t lane, const int *fileNums, size_t count);
+
+    /**
+     * @brief Queues the files deferred by scanDeferAdd() and marks the async scan completed
+     * 
+     * @param laneFileNums The files found by the scan. Deferred files are added to it.
+     * 
+     * @param completed true if the scan succeeded, false to leave scanDirCompleted false
+     */
+    void scanAsyncFinish(std::vector<SequentialFileRunSet> &laneFileNums, bool completed);
+
+    /**
+     * @brief Gets the pathname to the high-water mark file in the queue directory
+     */
+    String getHighWaterMarkPath() const;
+
+    /**
+     * @brief Reads the high-water mark file
+     * 
+     * @param fileNum Filled in with the saved high-water mark
+     * 
+     * @return false if the file does not exist or fails its checksum
+     */
+    bool highWaterMarkRead(int &fileNum);
+
+    /**
+     * @brief Saves a new high-water mark if fileNum is at or above the saved one
+     * 
+     * Call after reserving or adding fileNum. Does nothing if withHighWaterMark() is not enabled.
+     */
+    void highWaterMarkUpdate(int fileNum);
+
+    /**
+     * @brief Lock the mutex used to protect the queue
+     */
+    void queueMutexLock() const;
+
+    /**
+     * @brief Unlock the mutex used to protect the queue
+     */
+    void queueMutexUnlock() const;
+
+    /**
+     * @brief Lock the queue mutex, unless the queue container is lock-free
+     */
+    void queueContainerLock() const;
+
+    /**
+     * @brief Unlock the queue mutex, unless the queue container is lock-free
+     */
+    void queueContainerUnlock() const;
+
+    /**
+     * @brief Wakes up a thread in waitFileFromQueue(). Call after adding files to the queue.
+     */
+    void queueSignal();
+
+    /**
+     * @brief Gets the pathname to the index file in the queue directory
+     */
+    String getIndexPath() const;
+
+    /**
+     * @brief Loads the file numbers from the index file. Used from scanDir().
+     * 
+     * @param fileNums Filled in with the file numbers in the queue directory
+     * 
+     * @return false if the index file does not exist or is corrupted. 
+     */
+    bool indexLoad(SequentialFileRunSet &fileNums);
+
+    /**
+     * @brief Replaces the queue for each lane with the files in laneFileNums, in order
+     * 
+     * If append is true, the files are added to the end of each lane instead.
+     */
+    void setQueue(const std::vector<SequentialFileRunSet> &laneFileNums, bool append = false);
+
+    /**
+     * @brief Reads the index file and returns the files still in the queue directory
+     * 
+     * @param fileNums Filled in with the file numbers
+     * 
+     * @param lastNum Filled in with the highest file number recorded
+     * 
+     * @param recordCount Filled in with the number of valid records in the file
+     * 
+     * @param groupAcked (optional) If not NULL, filled in with the files in fileNums that 
+     * each consumer group has acknowledged. Must have one entry per group.
+     * 
+     * @return false if the index file does not exist or a record fails a checksum.
+     */
+    bool indexRead(SequentialFileRunSet &fileNums, int &lastNum, size_t &recordCount, std::vector<SequentialFileRunSet> *groupAcked = NULL);
+
+    /**
+     * @brief Writes a compacted index file containing fileNums and lastNum
+     * 
+     * @param fileNums File numbers in the queue directory
+     * 
+     * @param lastNum Highest file number used
+     * 
+     * @param groupAcked (optional) Files acknowledged by each consumer group. If NULL, the
+     * acknowledgements in RAM are written.
+     * 
+     * The file is written to a temporary file and renamed over the old index file,
+     * then opened for appending. Call with the index mutex locked.
+     */
+    bool indexWrite(const SequentialFileRunSet &fileNums, int lastNum, const std::vector<SequentialFileRunSet> *groupAcked = NULL);
+
+    /**
+     * @brief Reads the index file and writes a compacted version. Call with the index mutex locked.
+     */
+    bool indexCompact();
+
+    /**
+     * @brief Appends a record to the index file, if the index file is enabled
+     * 
+     * @param type The record type (INDEX_RECORD_ADD or INDEX_RECORD_REMOVE)
+     * 
+     * @param fileNum The first file number affected
+     * 
+     * @param count Number of sequential file numbers affected starting at fileNum
+     */
+    void indexAppend(uint32_t type, int fileNum, int count);
+
+    /**
+     * @brief Closes the index file if open. Call with the index mutex locked.
+     */
+    void indexClose();
+
+    /**
+     * @brief Lock the mutex used to protect the index file
+     */
+    void indexMutexLock() const;
+
+    /**
+     * @brief Unlock the mutex used to protect the index file
+     */
+    void indexMutexUnlock() const;
+
+protected:
+    /**
+     * @brief The path to the queue directory. Must be configured, using the top level directory is not allowed
+     */
+    String dirPath;
+
+    /**
+     * @brief Filename pattern, used with snprintf and sscanf to parse and generate filenames.
+     */
+    String pattern = "%08d";
+
+    /**
+     * @brief If pattern is of the form %0Nd, the number of digits N, otherwise 0
+     */
+    int patternDigits = 8;
+
+    /**
+     * @brief pattern with %n appended, used with sscanf to parse filenames when patternDigits is 0
+     */
+    String scanPattern = "%08d%n";
+
+    /**
+     * @brief Filename extension, without the dot. May be an empty string for no extension.
+     */
+    String filenameExtension = "";
+
+    /**
+     * @brief Set by SequentialFileT so withPattern() and withFilenameExtension() can't change its fixed name format
+     */
+    bool nameFixed = false;
+
+    /**
+     * @brief Set to true after scanDir() is called
+     */
+    std::atomic<bool> scanDirCompleted{false};
+
+    /**
+     * @brief Last file number used.
+     * 
+     * Set during scanDir() and incremented by reserveFile(). May be updated by addFileToQueue() if
+     * you didn't reserveFile() first. Only decreases when removeAll() sets it to 0.
+     */
+    std::atomic<int> lastFileNum{0};
+
+    /**
+     * @brief Mutex used so only one thread scans the directory in scanDirIfNecessary()
+     */
+    os_mutex_t scanMutex = 0;
+
+    /**
+     * @brief True while the scanDirAsync() thread is scanning. The thread holds scanMutex while scanning.
+     */
+    std::atomic<bool> scanAsyncRunning{false};
+
+    /**
+     * @brief True if the high-water mark was loaded by scanDirAsync(), so lastFileNum is usable during the scan
+     */
+    std::atomic<bool> scanAsyncHaveLastNum{false};
+
+    /**
+     * @brief The high-water mark loaded by scanDirAsync(). Files above it were reserved during the scan.
+     */
+    int scanAsyncLastNum = 0;
+
+    /**
+     * @brief Files added to each lane while scanDirAsync() is running. Protected by queueMutex.
+     */
+    std::vector<SequentialFileRunSet> scanDeferred;
+
+    /**
+     * @brief Progress of scanDirStep() or removeAllStep(), kept between calls. Protected by scanMutex.
+     */
+    struct StepState {
+        enum class Op { NONE, SCAN, REMOVE };
+
+        Op op = Op::NONE;                   //!< Operation in progress
+        DIR *dir = NULL;                    //!< Directory being read (dirPath or a shard), or NULL
+        DIR *topDir = NULL;                 //!< removeAllStep() with shards: dirPath, while a shard is being emptied
+        String path;                        //!< Path of dir
+        int shard = -1;                     //!< Shard of dir, or -1 for dirPath
+        int shardCount = 0;                 //!< Queue files found in the shard so far
+        std::vector<std::pair<int, String>> shards; //!< scanDirStep(): shards to scan, in increasing order
+        size_t shardIndex = 0;              //!< scanDirStep(): next entry in shards
+        bool listingShards = false;         //!< scanDirStep(): dir is dirPath, being read to find the shards
+        std::vector<SequentialFileRunSet> laneFileNums;     //!< scanDirStep(): files found so far
+        std::vector<SequentialFileRunSet> shardFileNums;    //!< scanDirStep(): files found in the current shard
+        int scanLastNum = 0;                //!< scanDirStep(): highest file number found
+        std::vector<int> emptyShards;       //!< scanDirStep(): shards with no queue files, removed at the end
+        unsigned long elapsedUs = 0;        //!< scanDirStep(): time spent in calls so far, for getStats()
+    };
+    StepState step;                         //!< State for scanDirStep() and removeAllStep()
+
+    /**
+     * @brief The SequentialFileManager this queue was added to, or NULL
+     */
+    SequentialFileManager *manager = NULL;
+
+    /**
+     * @brief The scanDirAsync() thread. Only valid if scanThreadStarted is true.
+     */
+    os_thread_t scanThread = 0;
+
+    /**
+     * @brief True if scanThread has been started and not joined yet
+     */
+    bool scanThreadStarted = false;
+
+    /**
+     * @brief Semaphore given by the scanDirAsync() thread once it has locked scanMutex
+     */
+    os_semaphore_t scanStartedSemaphore = 0;
+
+    /**
+     * @brief Mutex used to protect queue
+     */
+    mutable os_mutex_t queueMutex = 0;
+
+    /**
+     * @brief Semaphore signaled when files are added to the queue
+     */
+    os_semaphore_t queueSemaphore = 0;
+
+    /**
+     * @brief Semaphore signaled when files are taken from the queue, for OverflowPolicy::BLOCK
+     */
+    os_semaphore_t spaceSemaphore = 0;
+
+    size_t maxFiles = 0;                                        //!< Maximum files in the queue, 0 for no limit. Set using withMaxFiles().
+    uint64_t maxBytes = 0;                                      //!< Maximum bytes in the queue, 0 for no limit. Set using withMaxBytes().
+    OverflowPolicy overflowPolicy = OverflowPolicy::REJECT_NEW; //!< Set using withOverflowPolicy()
+    Compression compression = Compression::NONE;                //!< Set using withCompression()
+    Digest digest = Digest::NONE;                               //!< Set using withDigest()
+    String digestExtension;                                     //!< Sidecar extension for the digest, set using withDigest()
+    system_tick_t blockTimeoutMs = CONCURRENT_WAIT_FOREVER;     //!< Set using withOverflowPolicy()
+
+    /**
+     * @brief Queue of files
+     * 
+     * Items are added using scanDir() and addFileToQueue(). Removed using getFileFromQueue().
+     * Points to defaultQueue unless withQueue() is used.
+     */
+    SequentialFileQueue *queue = &defaultQueue;
+
+    /**
+     * @brief Queue container used if withQueue() is not used
+     */
+    SequentialFileDequeQueue defaultQueue;
+
+    /**
+     * @brief Number of file numbers per shard subdirectory, or 0 for no subdirectories. Set using withShardSize().
+     */
+    int shardSize = 0;
+
+    /**
+     * @brief Highest shard subdirectory number known to exist, or -1
+     */
+    std::atomic<int> lastShardCreated{-1};
+
+    /**
+     * @brief With shards or a temporary extension, file numbers reserved by reserveFiles() that have not been queued or removed yet. Protected by shardMutex.
+     */
+    SequentialFileRunSet shardReserved;
+
+    /**
+     * @brief Mutex used to protect shardReserved
+     */
+    os_mutex_t shardMutex = 0;
+
+    /**
+     * @brief Held while a file is checked against the limits and queued. The SequentialFileManager one is used instead if there is one.
+     */
+    os_mutex_t admitMutex = 0;
+
+    /**
+     * @brief Minimum number of digits in shard subdirectory names
+     */
+    static const int SHARD_DIGITS = 5;
+
+    /**
+     * @brief Sidecar filename extensions, without the dot. Set using withSidecarExtension().
+     */
+    std::vector<String> sidecarExtensions;
+
+    /**
+     * @brief Temporary filename extension, without the dot, or empty. Set using withTempExtension().
+     */
+    String tempExtension;
+
+    /**
+     * @brief Priority lanes in decreasing priority order, including priority 0. Empty if not
+     * using withPriorityExtension().
+     */
+    std::vector<Lane> lanes;
+
+    /**
+     * @brief Files returned by acquire() and not yet passed to ack() or nack(), protected by queueMutex
+     */
+    std::deque<InFlight> inFlight;
+
+    /**
+     * @brief Consumer groups added using withConsumerGroup(), protected by queueMutex
+     */
+    std::vector<ConsumerGroup> groups;
+
+    /**
+     * @brief Files taken from the queue containers for the consumer groups, and not yet 
+     * acknowledged by every group. Protected by queueMutex.
+     */
+    SequentialFileRunSet groupFiles;
+
+    /**
+     * @brief Whether to keep per-file metadata. Set using withMetadata().
+     */
+    bool metadata = false;
+
+    /**
+     * @brief Metadata for the queued files, in fileNum order. Only used with withMetadata().
+     */
+    std::deque<MetaEntry> metaEntries;
+
+    /**
+     * @brief Total size of the files in metaEntries
+     */
+    uint64_t queuedBytes = 0;
+
+    /**
+     * @brief Mutex used to protect metaEntries and queuedBytes
+     * 
+     * This is separate from queueMutex so metadata also works with a lock-free queue container.
+     */
+    mutable os_mutex_t metaMutex = 0;
+
+    /**
+     * @brief Whether to use the index file. Set using withIndexFile().
+     */
+    bool indexFile = false;
+
+    /**
+     * @brief Number of index records that triggers compaction. Set using withIndexCompactThreshold().
+     */
+    size_t indexCompactThreshold = 512;
+
+    /**
+     * @brief Number of records currently in the index file
+     */
+    size_t indexRecordCount = 0;
+
+    /**
+     * @brief Number of index records that triggers the next compaction
+     * 
+     * This is at least indexCompactThreshold, but larger if the compacted index itself is large.
+     */
+    size_t indexCompactAt = 512;
+
+    /**
+     * @brief File descriptor for the index file, opened for append, or -1 if not open
+     */
+    int indexFd = -1;
+
+    /**
+     * @brief Mutex used to protect the index file
+     */
+    mutable os_mutex_t indexMutex = 0;
+
+    /**
+     * @brief Whether to collect statistics. Set using withStats().
+     */
+    bool collectStats = false;
+
+    /**
+     * @brief Statistics returned by getStats(). Protected by statsMutex.
+     */
+    mutable SequentialFileStats stats;
+
+    /**
+     * @brief Directory entries read by the scan in progress
+     */
+    uint32_t scanEntries = 0;
+
+    /**
+     * @brief Mutex used to protect stats
+     */
+    mutable os_mutex_t statsMutex = 0;
+
+    /**
+     * @brief Whether removeAll() renames the queue directory. Set using withFastRemoveAll().
+     */
+    bool fastRemoveAll = false;
+
+    /**
+     * @brief Thread priority of the tombstone thread. Set using withFastRemoveAll().
+     */
+    os_thread_prio_t tombstonePriority = OS_THREAD_PRIORITY_DEFAULT - 1;
+
+    /**
+     * @brief Tombstone directories waiting to be deleted, oldest first. Protected by tombstoneMutex.
+     */
+    std::deque<String> tombstones;
+
+    /**
+     * @brief Set once scanDir() has looked for tombstone directories left over from before a reset
+     */
+    bool tombstoneResumed = false;
+
+    /**
+     * @brief Mutex used to protect tombstones and starting the tombstone thread
+     */
+    os_mutex_t tombstoneMutex = 0;
+
+    /**
+     * @brief Number of spare files to keep. Set using withFilePool().
+     */
+    size_t poolSize = 0;
+
+    /**
+     * @brief For each pool slot, true if its spare file exists. Empty until the pool is loaded by a scan. Protected by poolMutex.
+     */
+    std::vector<bool> poolFiles;
+
+    /**
+     * @brief Mutex used to protect poolFiles
+     */
+    mutable os_mutex_t poolMutex = 0;
+
+    /**
+     * @brief Thread that deletes the tombstone directories. Only valid if tombstoneThreadStarted is true.
+     */
+    os_thread_t tombstoneThread = 0;
+
+    /**
+     * @brief True if tombstoneThread has been started and not joined yet
+     */
+    bool tombstoneThreadStarted = false;
+
+    /**
+     * @brief True while tombstoneThread is deleting tombstone directories
+     */
+    std::atomic<bool> tombstoneRunning{false};
+
+    /**
+     * @brief Set by the destructor to stop tombstoneThread. The rest is deleted after the next scanDir().
+     */
+    std::atomic<bool> tombstoneStop{false};
+
+    /**
+     * @brief Whether to use the high-water mark file. Set using withHighWaterMark().
+     */
+    bool highWaterMark = false;
+
+    /**
+     * @brief The high-water mark saved in the high-water mark file, or 0. Written with indexMutex locked.
+     */
+    std::atomic<int> highWaterMarkSaved{0};
+
+    /**
+     * @brief Size of the stack buffers used to build pathnames internally
+     * 
+     * Longer pathnames still work, but are built using String.
+     */
+    static const size_t PATH_BUF_SIZE = 128;
+
+    /**
+     * @brief Filename of the index file in the queue directory
+     */
+    static const char *INDEX_FILENAME;
+
+    /**
+     * @brief Filename of the high-water mark file in the queue directory
+     */
+    static const char *HIGH_WATER_MARK_FILENAME;
+
+    /**
+     * @brief How far above lastFileNum the saved high-water mark is set, so it's not rewritten for every file
+     */
+    static const int HIGH_WATER_MARK_STEP = 64;
+
+    /**
+     * @brief Appended to the queue directory name, followed by a number, for tombstone directories
+     */
+    static const char *TOMBSTONE_SUFFIX;
+
+    /**
+     * @brief Filename of a spare file in the pool, followed by the slot number (withFilePool())
+     */
+    static const char *POOL_FILENAME_PREFIX;
+
+    /**
+     * @brief Stack size of the tombstone thread
+     */
+    static const size_t TOMBSTONE_STACK_SIZE = 2048;
+
+    static const uint32_t INDEX_RECORD_HEADER = 1;      //!< First record in the index file, fileNum is INDEX_MAGIC, count is the version
+    static const uint32_t INDEX_RECORD_ADD = 2;         //!< Files fileNum to fileNum + count - 1 were added
+    static const uint32_t INDEX_RECORD_REMOVE = 3;      //!< Files fileNum to fileNum + count - 1 were removed
+    static const uint32_t INDEX_RECORD_LAST_NUM = 4;    //!< fileNum is the value of lastFileNum
+    static const uint32_t INDEX_RECORD_GROUP_ACK = 5;   //!< Files were acknowledged by the consumer group in bits 8 - 15 of the type
+
+    static const int INDEX_MAGIC = 0x58495153;          //!< "SQIX", in the header record
+    static const int INDEX_VERSION = 1;                 //!< Index file format version, in the header record
+};
+
+/**
+ * @brief Calculates a CRC-32 or SHA-1 digest incrementally
+ * 
+ * Used by SequentialFile::Writer and SequentialFile::Reader for withDigest(). You can also
+ * use it to calculate the digest of data you have in RAM, for example to check a file
+ * after it's uploaded.
+ */
+class SequentialFileDigest {
+public:
+    /**
+     * @brief Starts a new digest
+     * 
+     * @param type The digest to calculate
+     */
+    void begin(SequentialFile::Digest type);
+
+    /**
+     * @brief Adds data to the digest
+     */
+    void update(const void *data, size_t len);
+
+    /**
+     * @brief Finishes the digest and stores it as a lowercase hex string
+     * 
+     * @param buf Buffer to store the digest in. HEX_BUF_SIZE bytes is always large enough.
+     * 
+     * @param bufSize Size of buf in bytes
+     * 
+     * @return The length of the hex string, or 0 if the type is Digest::NONE or it did not fit.
+     * Call begin() before using the object again.
+     */
+    size_t finishHex(char *buf, size_t bufSize);
+
+    /**
+     * @brief Gets the type passed to begin()
+     */
+    SequentialFile::Digest getType() const { return type; };
+
+    /**
+     * @brief Size of a buffer that holds any digest as hex, including the null terminator
+     */
+    static const size_t HEX_BUF_SIZE = 41;
+
+protected:
+    /**
+     * @brief Processes one 64-byte SHA-1 block
+     */
+    void sha1Block(const uint8_t *data);
+
+    SequentialFile::Digest type = SequentialFile::Digest::NONE; //!< Digest being calculated
+    uint32_t crc = 0;               //!< CRC-32 so far
+    uint32_t state[5];              //!< SHA-1 state
+    uint8_t block[64];              //!< Partial SHA-1 block
+    size_t blockUsed = 0;           //!< Bytes in block
+    uint64_t totalLen = 0;          //!< Bytes added to the SHA-1
+};
+
+/**
+ * @brief Buffered writer for a new file in a SequentialFile queue
+ * 
+ * Instead of calling reserveFile(), opening the path from getPathForFileNum(), and making
+ * many small write() calls that each update the file system, use a Writer. Small writes
+ * are collected in a RAM buffer and written to the file in full buffer-size chunks, so
+ * every write to the file system except the last starts at a multiple of the buffer size.
+ * 
+ * ```cpp
+ * SequentialFile::Writer writer(sequentialFile);
+ * 
+ * if (writer.begin()) {
+ *     writer.write(data, dataLen);
+ *     writer.commit();
+ * }
+ * ```
+ * 
+ * commit() closes the file and calls addFileToQueue(). abort(), or destroying the Writer
+ * without calling commit(), removes the partially written file so it never reaches the queue.
+ * With withTempExtension(), the file is written to the temporary path and renamed by commit(),
+ * so it does not have a queue filename until it is complete, even after a reset.
+ * 
+ * A Writer can be reused for another file by calling begin() again after commit() or abort().
+ * Each Writer should only be used from one thread at a time.
+ */
+class SequentialFile::Writer {
+public:
+    /**
+     * @brief Construct a Writer that allocates its buffer on the heap
+     * 
+     * @param sequentialFile The queue to add files to
+     * 
+     * @param bufferSize Size of the RAM buffer in bytes (default: 512). Use a multiple of the
+     * flash page size (256). The buffer is allocated once, here, and reused for each file.
+     */
+    Writer(SequentialFile &sequentialFile, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+
+    /**
+     * @brief Construct a Writer that uses a caller-provided buffer
+     * 
+     * @param sequentialFile The queue to add files to
+     * 
+     * @param buffer Buffer to use, typically a global or static variable. It must remain
+     * valid until the Writer is deleted.
+     * 
+     * @param bufferSize Size of buffer in bytes. Use a multiple of the flash page size (256).
+     */
+    Writer(SequentialFile &sequentialFile, uint8_t *buffer, size_t bufferSize);
+
+    /**
+     * @brief Destructor. If a file is open and commit() has not been called, it's removed.
+     */
+    virtual ~Writer();
+
+    /**
+     * @brief Reserves a file number and creates the file for writing
+     * 
+     * @param overrideExt If not NULL, use this extension instead of the one set using withFilenameExtension()
+     * 
+     * @return The file number, or 0 if the file could not be created
+     * 
+     * If a file is already open, it's aborted first. With withFilePool(), a spare file 
+     * from the pool is reused if one is available.
+     */
+    int begin(const char *overrideExt = NULL);
+
+    /**
+     * @brief Creates the file for writing using a file number that was already reserved
+     * 
+     * @param fileNum A file number from reserveFile() or reserveFiles() that has not been used yet
+     * 
+     * @param overrideExt If not NULL, use this extension instead of the one set using withFilenameExtension()
+     * 
+     * @return fileNum, or 0 if the file could not be created
+     * 
+     * The same as begin(), except that it does not reserve the file number, so a block of
+     * file numbers from reserveFiles() can be written one after another.
+     * If the file cannot be created, the file number is released so it does not keep an
+     * empty shard directory from being removed.
+     */
+    int beginReserved(int fileNum, const char *overrideExt = NULL);
+
+    /**
+     * @brief Writes data to the file
+     * 
+     * @param data Data to write
+     * 
+     * @param len Length of data in bytes
+     * 
+     * @return true on success. After an error, later writes and commit() fail.
+     * 
+     * Data is copied into the buffer and only written to the file when the buffer is
+     * full. When the buffer is empty, whole buffer-size chunks are written directly from 
+     * data without copying, unless the file is compressed (withCompression()).
+     */
+    bool write(const void *data, size_t len);
+
+    /**
+     * @brief Writes any buffered data, closes the file, and adds it to the queue
+     * 
+     * @param addToQueue true to call addFileToQueue() (the default). If false, the file is 
+     * complete but not queued; call addFileToQueue() or addFilesToQueue() yourself, for
+     * example to queue several files at once.
+     * 
+     * @return true if the file was written (and queued). On failure, including when addFileToQueue() finds the queue full, the file is removed.
+     */
+    bool commit(bool addToQueue = true);
+
+    /**
+     * @brief Closes and removes the file without adding it to the queue
+     */
+    void abort();
+
+    /**
+     * @brief Returns true if begin() created a file and it has not been committed or aborted
+     */
+    bool isOpen() const { return fd >= 0; };
+
+    /**
+     * @brief Gets the file number of the file being written, or 0 if none
+     */
+    int getFileNum() const { return fileNum; };
+
+    /**
+     * @brief Gets the number of bytes written to the file so far, including buffered data
+     * 
+     * This is the length of the data passed to write(), before compression.
+     */
+    size_t getSize() const { return size; };
+
+    /**
+     * @brief Returns true if the file being written is compressed (withCompression())
+     */
+    bool isCompressed() const { return compress; };
+
+    /**
+     * @brief Returns true if a digest is being calculated for the file (withDigest())
+     */
+    bool hasDigest() const { return digest.getType() != Digest::NONE; };
+
+    /**
+     * @brief This class is not copyable
      */
-    void removeAll(bool removeDir);
+    Writer(const Writer&) = delete;
 
     /**
-     * @brief Gets the length of the queue
+     * @brief This class is not copyable
      */
-    int getQueueLen() const;
+    Writer& operator=(const Writer&) = delete;
+
+    /**
+     * @brief Default buffer size in bytes
+     */
+    static const size_t DEFAULT_BUFFER_SIZE = 512;
+
+protected:
+    /**
+     * @brief Writes all of the buffered data to the file
+     */
+    bool flushBuffer();
+
+    /**
+     * @brief Writes len bytes to the file, retrying partial writes
+     */
+    bool writeFully(const uint8_t *data, size_t len);
+
+    /**
+     * @brief Closes the file descriptor if open
+     */
+    void closeFile();
+
+    /**
+     * @brief Compresses the buffered data and writes it to the file as one block
+     */
+    bool writeCompressedBlock();
+
+    /**
+     * @brief Writes the digest to its sidecar file
+     */
+    bool writeDigest();
+
+    SequentialFile &sequentialFile;     //!< The queue to add files to
+    uint8_t *buffer;                    //!< RAM buffer
+    size_t bufferSize;                  //!< Size of buffer in bytes
+    size_t bufferUsed = 0;              //!< Bytes of data in buffer
+    size_t blockSize = 0;               //!< Bytes buffered before writing, at most MAX_COMPRESSED_BLOCK_SIZE when compressing
+    bool freeBuffer;                    //!< true if buffer was allocated by the constructor
+
+    int fd = -1;                        //!< File descriptor, or -1 if not open
+    int fileNum = 0;                    //!< File number being written, or 0
+    size_t size = 0;                    //!< Bytes written so far, including buffered data
+    bool error = false;                 //!< A write failed
+    String path;                        //!< Path of the file being written, the temporary path with withTempExtension()
+    String finalPath;                   //!< Path of the file once it's committed
+
+    bool compress = false;              //!< The file being written is compressed
+    uint8_t *compressBuffer = NULL;     //!< Block header and compressed data, allocated when first needed
+    uint16_t *hashTable = NULL;         //!< LZ4_HASH_SIZE entry work area for lz4CompressBlock()
+
+    SequentialFileDigest digest;        //!< Digest of the data written to the file, with withDigest()
+    String digestPath;                  //!< Path of the digest sidecar file, once written
+};
+
+/**
+ * @brief Streaming reader with read-ahead for the files in a SequentialFile queue
+ * 
+ * A worker thread takes files from the queue in order and reads them into two chunk 
+ * buffers. While your code is sending one chunk, for example over cellular, the next 
+ * chunk is read from flash, including the first chunk of the next file in the queue.
+ * 
+ * ```cpp
+ * SequentialFile::Reader reader(sequentialFile);
+ * 
+ * void setup() {
+ *     sequentialFile.withDirPath("/usr/myqueue").scanDir();
+ *     reader.start();
+ * }
+ * 
+ * void loop() {
+ *     SequentialFile::Reader::Chunk chunk;
+ *     if (reader.readChunk(chunk)) {
+ *         // Send chunk.data, chunk.len bytes at chunk.offset in file chunk.fileNum
+ *         reader.releaseChunk();
+ *         if (chunk.lastChunk) {
+ *             sequentialFile.removeFileNum(chunk.fileNum, false);
+ *         }
+ *     }
+ * }
+ * ```
+ * 
+ * Chunks are returned as pointers into the chunk buffers, so there is no copy. You can 
+ * pass your own buffers to the constructor, for example a buffer that the network code
+ * sends from directly.
+ * 
+ * Files are removed from the RAM queue by the worker thread when it starts reading them.
+ * They are not removed from the file system; do that after the last chunk is processed.
+ * 
+ * Only one thread should call readChunk() and releaseChunk(). Other threads can still 
+ * add files to the queue, but should not take files from it while the Reader is running.
+ * 
+ * Files compressed using withCompression() are returned as stored, unless 
+ * withDecompression() is used.
+ */
+class SequentialFile::Reader {
+public:
+    /**
+     * @brief A chunk of a file, returned by readChunk()
+     */
+    struct Chunk {
+        const uint8_t *data = NULL;     //!< Chunk data, valid until releaseChunk() is called
+        size_t len = 0;                 //!< Number of bytes in data. May be 0 for an empty file.
+        size_t offset = 0;              //!< Offset of data in the file
+        int fileNum = 0;                //!< File number the data is from
+        int priority = 0;               //!< Priority lane the file is from, see withPriorityExtension()
+        bool lastChunk = false;         //!< This is the last chunk of the file
+        bool error = false;             //!< A read error occurred. This is also the last chunk of the file.
+        bool verifyError = false;       //!< With withVerify(), the file does not match its digest. error is also set.
+    };
+
+    /**
+     * @brief Construct a Reader that allocates its chunk buffers on the heap
+     * 
+     * @param sequentialFile The queue to read files from
+     * 
+     * @param chunkSize Size of each chunk buffer in bytes (default: 512). Two are allocated,
+     * once, here.
+     */
+    Reader(SequentialFile &sequentialFile, size_t chunkSize = DEFAULT_CHUNK_SIZE);
+
+    /**
+     * @brief Construct a Reader that uses caller-provided chunk buffers
+     * 
+     * @param sequentialFile The queue to read files from
+     * 
+     * @param buffer Buffer of at least 2 * chunkSize bytes, typically a global or static 
+     * variable. It must remain valid until the Reader is deleted.
+     * 
+     * @param chunkSize Size of each chunk in bytes
+     */
+    Reader(SequentialFile &sequentialFile, uint8_t *buffer, size_t chunkSize);
+
+    /**
+     * @brief Destructor. Calls stop().
+     */
+    virtual ~Reader();
+
+    /**
+     * @brief Decompresses files compressed using withCompression() (default: disabled)
+     * 
+     * @param enable true to return the decompressed data for compressed files
+     * 
+     * Each chunk is one block of the file, so chunks may be shorter than the chunk size,
+     * and chunk.offset is the offset in the decompressed data. If the file was written with 
+     * a Writer buffer larger than the chunk size, each block is returned in several chunks 
+     * instead, and two buffers the size of a block are allocated the first time such a file 
+     * is read. Files that are not compressed are returned unchanged. An additional chunk-size 
+     * buffer is allocated by start(). Call this before start().
+     */
+    Reader &withDecompression(bool enable = true) { this->decompress = enable; return *this; };
+
+    /**
+     * @brief Checks each file against the digest in its sidecar file (default: disabled)
+     * 
+     * @param enable true to check the digest set using withDigest()
+     * 
+     * The digest is calculated from the data as it's read, so each byte is only read from 
+     * flash once. If the digest does not match, or the file has no digest sidecar file, the
+     * last chunk of the file has error and verifyError set; earlier chunks of the file have
+     * already been returned, so don't act on the file until its last chunk. Call this before
+     * start().
+     */
+    Reader &withVerify(bool enable = true) { this->verify = enable; return *this; };
+
+    /**
+     * @brief Starts the read-ahead worker thread
+     * 
+     * @param priority Thread priority (default: OS_THREAD_PRIORITY_DEFAULT)
+     * 
+     * @param stackSize Thread stack size in bytes (default: 2048)
+     * 
+     * Call after scanDir().
+     */
+    bool start(os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 2048);
+
+    /**
+     * @brief Stops the worker thread
+     * 
+     * Files that were taken from the queue but not completely returned by readChunk() are 
+     * returned to the front of the queue, in order, so they are read again first. Release 
+     * any chunk first.
+     * 
+     * With a lock-free queue container (SequentialFileSpscQueue) and no priority lanes, the 
+     * files are not returned to the queue, since only the producer thread can add to it. 
+     * They stay on disk and are found by the next scanDir().
+     */
+    void stop();
+
+    /**
+     * @brief Gets the next chunk of data
+     * 
+     * @param chunk Filled in with the chunk
+     * 
+     * @param timeoutMs How long to wait for a chunk. The default is 0 (don't wait).
+     * 
+     * @return true if a chunk was returned. Call releaseChunk() when done with it.
+     */
+    bool readChunk(Chunk &chunk, system_tick_t timeoutMs = 0);
+
+    /**
+     * @brief Releases the chunk from readChunk() so its buffer can be used to read ahead
+     */
+    void releaseChunk();
 
     /**
      * @brief This class is not copyable
      */
-    SequentialFile(const SequentialFile&) = delete;
+    Reader(const Reader&) = delete;
 
     /**
      * @brief This class is not copyable
      */
-    SequentialFile& operator=(const SequentialFile&) = delete;
+    Reader& operator=(const Reader&) = delete;
 
     /**
-     * @brief Creates the directory path if it does not exist
+     * @brief Default chunk size in bytes
+     */
+    static const size_t DEFAULT_CHUNK_SIZE = 512;
+
+    /**
+     * @brief Number of chunk buffers
+     */
+    static const size_t NUM_CHUNKS = 2;
+
+protected:
+    /**
+     * @brief Worker thread function
+     */
+    void threadFunction();
+
+    /**
+     * @brief Worker thread entry point, param is the Reader
+     */
+    static void threadFunctionStatic(void *param);
+
+    /**
+     * @brief Fills a chunk from the file being read ahead, taking the next file from the queue if needed
      * 
-     * Note: This only creates the last element of the path if it does not
-     * exist. If you use directories nested more than one level deep,
-     * you'll need to call this separately to create parent directories!
+     * @return false if stop was requested before a file was available
      */
-    static bool createDirIfNecessary(const char *path);
+    bool fillChunk(Chunk &chunk);
 
     /**
-     * @brief Combines name and ext into a filename with an optional filename extension
+     * @brief Reads the next block of a compressed file into dst
      * 
-     * @param name Filename (required)
+     * @param dst Buffer to store the decompressed block in
      * 
-     * @param ext Filename extension (optional). If you pass is NULL or an 
-     * empty string, the dot and extension are not appended.
+     * @param dstSize Size of dst in bytes
      * 
-     * Only adds the . when ext is non-null and non-empty.
+     * @return The length of the decompressed block, or -1 on error
      */
-    static String getNameWithOptionalExt(const char *name, const char *ext);
+    int readCompressedBlock(uint8_t *dst, size_t dstSize);
 
-protected:
     /**
-     * @brief Allows a subclass to choose whether to queue a file or not during scanDir.
+     * @brief Reads exactly len bytes from readFd, adding them to the digest if verifying
+     */
+    bool readFile(uint8_t *buf, size_t len);
+
+    /**
+     * @brief Checks the digest of the file that was just read. Sets error and verifyError in chunk if it does not match.
+     */
+    void verifyDigest(Chunk &chunk);
+
+    SequentialFile &sequentialFile;     //!< The queue to read files from
+    uint8_t *buffer;                    //!< NUM_CHUNKS chunk buffers of chunkSize bytes
+    size_t chunkSize;                   //!< Size of each chunk buffer
+    bool freeBuffer;                    //!< true if buffer was allocated by the constructor
+
+    Chunk chunks[NUM_CHUNKS];           //!< Chunk metadata, data points into buffer
+    size_t fillIndex = 0;               //!< Next chunk the worker thread fills
+    size_t readIndex = 0;               //!< Next chunk readChunk() returns
+    bool chunkHeld = false;             //!< readChunk() returned a chunk that has not been released
+    int consumerFileNum = 0;            //!< File readChunk() is returning, until its last chunk is released
+    int consumerPriority = 0;           //!< Priority lane of consumerFileNum
+
+    int readFd = -1;                    //!< File the worker thread is reading, or -1
+    int readFileNum = 0;                //!< File number of readFd
+    int readPriority = 0;               //!< Priority lane of readFd
+    size_t readOffset = 0;              //!< Offset of the next chunk in readFd
+    size_t readFileSize = 0;            //!< Size of readFd
+    bool readCompressed = false;        //!< readFd is compressed and is being decompressed
+    size_t readFilePos = 0;             //!< Position in readFd, when readCompressed
+
+    bool decompress = false;            //!< Set using withDecompression()
+    uint8_t *decompressBuffer = NULL;   //!< Buffer for compressed blocks, allocated by start() and grown for larger blocks
+    size_t decompressBufferSize = 0;    //!< Size of decompressBuffer
+    uint8_t *blockBuffer = NULL;        //!< Decompressed block, only for files whose blocks are larger than chunkSize
+    size_t blockBufferSize = 0;         //!< Size of blockBuffer
+    size_t readBlockSize = 0;           //!< Maximum block size from the header of readFd, when readCompressed
+    size_t blockLen = 0;                //!< Bytes in blockBuffer
+    size_t blockPos = 0;                //!< Bytes of blockBuffer already returned in chunks
+
+    bool verify = false;                //!< Set using withVerify()
+    SequentialFileDigest digest;        //!< Digest of readFd so far, with withVerify()
+
+    os_thread_t thread = 0;             //!< Worker thread
+    std::atomic<bool> running{false};   //!< Worker thread has been started and not stopped
+    std::atomic<bool> stopRequested{false}; //!< stop() was called
+    os_semaphore_t freeSemaphore = 0;   //!< Count of chunks the worker thread can fill
+    os_semaphore_t filledSemaphore = 0; //!< Count of chunks readChunk() can return
+};
+
+/**
+ * @brief Collects small files in RAM and writes them to the queue in bursts
+ * 
+ * When many small files are produced in bursts, writing each one as soon as it's produced
+ * interleaves file creation, writes, and queue updates with everything else, and the
+ * producer waits for the file system each time. With a WriteScheduler, addFile() only 
+ * copies the data into a RAM buffer. The pending files are written back-to-back once 
+ * withBurstFiles() files are pending or the oldest has waited withBurstIntervalMs():
+ * 
+ * - The file numbers are reserved with one reserveFiles() call, so the high-water mark
+ *   (withHighWaterMark()) is updated at most once per burst
+ * - Each file is written using a Writer, so withCompression(), withDigest(), 
+ *   withTempExtension() and withFilePool() apply
+ * - The files are queued with one addFilesToQueue() call, which is a single index file 
+ *   record (withIndexFile()) and a single wakeup of waitFileFromQueue()
+ * 
+ * ```cpp
+ * SequentialFile::WriteScheduler scheduler(sequentialFile);
+ * 
+ * void setup() {
+ *     sequentialFile.withDirPath("/usr/events").withFilePool(8).scanDir();
+ *     scheduler.withBurstFiles(8).start();
+ * }
+ * 
+ * void loop() {
+ *     if (haveEvent) {
+ *         scheduler.addFile(eventData, eventLen);
+ *     }
+ * }
+ * ```
+ * 
+ * Without start(), call loop() from the application loop() to write the burst when it's
+ * due. There are two pending buffers, so producers can add files while a burst is being
+ * written. Pending files are only in RAM, so they are lost on reset; call flush() before
+ * a planned reset or sleep. addFile() can be called from any thread.
+ */
+class SequentialFile::WriteScheduler {
+public:
+    /**
+     * @brief Construct a WriteScheduler that allocates its buffers on the heap
      * 
-     * @param name A potential filename in the queue directory
+     * @param sequentialFile The queue to add files to
      * 
-     * @return true to add the file to the queue or false to not queue the file.
+     * @param maxPendingBytes Size of each pending buffer (default: 4096). Each file uses 
+     * its length plus 4 bytes. Two are allocated, once, here.
      * 
-     * This would allow a subclass to do some validation of the file before adding
-     * it to the queue when reading the files from disk after reboot.
+     * @param writerBufferSize Size of the Writer buffer (default: 512)
      */
-    virtual bool preScanAddHook(const char *name) { return true; };
+    WriteScheduler(SequentialFile &sequentialFile, size_t maxPendingBytes = DEFAULT_PENDING_BYTES, size_t writerBufferSize = 512);
 
     /**
-     * @brief Lock the mutex used to protect the queue
+     * @brief Destructor. Stops the worker thread and writes any pending files.
      */
-    void queueMutexLock() const;
+    virtual ~WriteScheduler();
 
     /**
-     * @brief Unlock the mutex used to protect the queue
+     * @brief Sets the number of pending files that starts a burst (default: 4)
      */
-    void queueMutexUnlock() const;
+    WriteScheduler &withBurstFiles(size_t burstFiles) { this->burstFiles = burstFiles; return *this; };
+
+    /**
+     * @brief Sets the longest time a file waits before a burst is written (default: 2000 milliseconds)
+     */
+    WriteScheduler &withBurstIntervalMs(system_tick_t burstIntervalMs) { this->burstIntervalMs = burstIntervalMs; return *this; };
+
+    /**
+     * @brief Adds a file to be written in the next burst
+     * 
+     * @param data The file data. It's copied, so it does not need to remain valid.
+     * 
+     * @param len Length of data in bytes. Must be no larger than maxPendingBytes - 4.
+     * 
+     * @return true if the file is pending. After it's written successfully it's added to 
+     * the queue with the next file number, the same as using a Writer.
+     * 
+     * If the pending buffer is full, the pending files are written on the calling thread first.
+     */
+    bool addFile(const void *data, size_t len);
+
+    /**
+     * @brief Writes all of the pending files now, on the calling thread
+     * 
+     * @return true if all of the files were written and queued
+     */
+    bool flush();
+
+    /**
+     * @brief Writes the pending files if a burst is due. Call from loop() if not using start().
+     * 
+     * @return true if a burst was written
+     */
+    bool loop();
+
+    /**
+     * @brief Gets the number of files waiting to be written
+     */
+    size_t getPendingCount() const;
+
+    /**
+     * @brief Gets the number of files that could not be written, for example because the queue was full
+     */
+    uint32_t getDroppedCount() const { return droppedCount; };
+
+    /**
+     * @brief Starts a worker thread that writes each burst when it's due
+     * 
+     * @param priority Thread priority (default: OS_THREAD_PRIORITY_DEFAULT)
+     * 
+     * @param stackSize Thread stack size in bytes (default: 2048)
+     * 
+     * Call after scanDir().
+     */
+    bool start(os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 2048);
+
+    /**
+     * @brief Stops the worker thread, after writing any pending files
+     */
+    void stop();
+
+    /**
+     * @brief This class is not copyable
+     */
+    WriteScheduler(const WriteScheduler&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    WriteScheduler& operator=(const WriteScheduler&) = delete;
+
+    /**
+     * @brief Default size of each pending buffer in bytes
+     */
+    static const size_t DEFAULT_PENDING_BYTES = 4096;
+
+    /**
+     * @brief Bytes stored before each pending file, its length
+     */
+    static const size_t PENDING_HEADER_SIZE = 4;
 
 protected:
     /**
-     * @brief The path to the queue directory. Must be configured, using the top level directory is not allowed
+     * @brief Worker thread entry point, param is the WriteScheduler
      */
-    String dirPath;
+    static void threadFunctionStatic(void *param);
 
     /**
-     * @brief Filename pattern, used with snprintf and sscanf to parse and generate filenames.
+     * @brief Returns true if a burst should be written now. Call with mutex locked.
      */
-    String pattern = "%08d";
+    bool isBurstDue() const;
 
     /**
-     * @brief Filename extension, without the dot. May be an empty string for no extension.
+     * @brief Writes and queues count files stored in buf
      */
-    String filenameExtension = "";
+    bool writeBurst(const uint8_t *buf, size_t count);
+
+    SequentialFile &sequentialFile;     //!< The queue to add files to
+    Writer writer;                      //!< Writes each file in a burst
+    uint8_t *buffer;                    //!< Two pending buffers of maxPendingBytes
+    size_t maxPendingBytes;             //!< Size of each pending buffer
+
+    size_t burstFiles = 4;              //!< Set using withBurstFiles()
+    system_tick_t burstIntervalMs = 2000; //!< Set using withBurstIntervalMs()
+
+    size_t fillIndex = 0;               //!< Pending buffer addFile() adds to, 0 or 1
+    size_t pendingUsed = 0;             //!< Bytes used in the fillIndex buffer
+    size_t pendingCount = 0;            //!< Files in the fillIndex buffer
+    system_tick_t firstPendingMs = 0;   //!< millis() when the oldest pending file was added
+    std::atomic<uint32_t> droppedCount{0}; //!< Returned by getDroppedCount()
+    std::vector<int> fileNums;          //!< Files written in the current burst, kept to reuse its allocation
+
+    mutable os_mutex_t mutex = 0;       //!< Protects the pending buffer state
+    os_mutex_t writeMutex = 0;          //!< Held while a burst is written, so only one is written at a time
+
+    os_thread_t thread = 0;             //!< Worker thread
+    std::atomic<bool> running{false};   //!< Worker thread has been started and not stopped
+    std::atomic<bool> stopRequested{false}; //!< stop() was called
+    os_semaphore_t burstSemaphore = 0;  //!< Given when a burst is due
+};
+
+/**
+ * @brief SequentialFile with the filename pattern and extension fixed at compile time, plus 
+ * caller-side helpers that format and parse those names inline
+ * 
+ * @tparam Digits Minimum number of digits in the file number, like the 8 in the default %08d pattern
+ * 
+ * @tparam Ext The filename extension as characters, or nothing for no extension
+ * 
+ * ```cpp
+ * SequentialFileT<8, 'j', 'p', 'g'> sequentialFile;    // 00000001.jpg
+ * ```
+ * 
+ * This is a SequentialFile in every other way, but the pattern and extension can't be 
+ * changed: withPattern() and withFilenameExtension() don't compile when called on a 
+ * SequentialFileT, and are ignored when called through a SequentialFile reference. Since 
+ * the name length is known at compile time, formatName() and formatPath() write to 
+ * fixed-size stack buffers (NameBuffer, or any char array) inline without snprintf, 
+ * allocation, or length checks on the name, and parseName() checks the extension with a
+ * fixed-length compare. Use the dynamic SequentialFile if the pattern or extension is 
+ * configured at runtime.
+ * 
+ * Only these helpers use the template parameters. The library's own formatting and parsing,
+ * in getNameForFileNum(), getPathForFileNum(), scanDir(), and removeFileNum(), still use 
+ * the runtime pattern and extension, the same as a SequentialFile; they produce the same 
+ * names, using the %0Nd fast path, but are not any faster. formatName(), formatPath(), and 
+ * parseName() only handle the priority 0 extension, not withPriorityExtension() lanes or
+ * withSidecarExtension() files; use getPathForFileNum() with overrideExt for those.
+ */
+template<int Digits, char... Ext>
+class SequentialFileT : public SequentialFile {
+public:
+    static_assert(Digits >= 1 && Digits <= 9, "Digits must be 1 to 9");
 
     /**
-     * @brief Set to true after scanDir() is called
+     * @brief Length of the filename extension, not including the dot
      */
-    bool scanDirCompleted = false;
+    static const size_t EXT_LEN = sizeof...(Ext);
 
     /**
-     * @brief Last file number used.
+     * @brief Size of a buffer that holds any filename, including the null terminator
      * 
-     * Set during scanDir() and incremented by reserveFile(). May be updated by addFileToQueue() if
-     * you didn't reserveFile() first.
+     * File numbers larger than Digits digits use more digits, up to 10.
      */
-    int lastFileNum = 0;
+    static const size_t NAME_BUF_SIZE = 10 + (EXT_LEN ? EXT_LEN + 1 : 0) + 1;
 
     /**
-     * @brief Mutex used to protect queue
+     * @brief Buffer type for getNameForFileNum()
      */
-    mutable os_mutex_t queueMutex = 0;
+    typedef char NameBuffer[NAME_BUF_SIZE];
 
     /**
-     * @brief Queue of files
+     * @brief Default constructor. Sets the pattern and filename extension.
+     */
+    SequentialFileT() {
+        const char pattern[] = { '%', '0', (char)('0' + Digits), 'd', 0 };
+        SequentialFile::withPattern(pattern);
+        SequentialFile::withFilenameExtension(getExt());
+
+        // Calls through a SequentialFile reference, or chained after another withXXX(), are ignored
+        nameFixed = true;
+    }
+
+    /**
+     * @brief The pattern is fixed by the Digits template parameter
+     */
+    SequentialFileT &withPattern(const char *pattern) = delete;
+
+    /**
+     * @brief The filename extension is fixed by the Ext template parameter
+     */
+    SequentialFileT &withFilenameExtension(const char *ext) = delete;
+
+    /**
+     * @brief Gets the filename extension, without the dot. An empty string for no extension.
+     */
+    static const char *getExt() {
+        static const char ext[] = { Ext..., 0 };
+        return ext;
+    }
+
+    /**
+     * @brief Formats the filename for fileNum into buf
      * 
-     * Items are added using scanDir() and addFileToQueue(). Removed using getFileFromQueue().
+     * @param fileNum The file number, 0 or greater
+     * 
+     * @param buf Buffer of at least NAME_BUF_SIZE bytes
+     * 
+     * @return The length of the filename, not including the null terminator
      */
-    std::deque<int> queue;
+    static size_t formatName(int fileNum, char *buf) {
+        unsigned int value = (unsigned int) fileNum;
+        size_t len = Digits;
+        for(unsigned int limit = pow10(Digits); len < 10 && value >= limit; limit *= 10) {
+            // Larger numbers use more digits, like %08d
+            len++;
+        }
+        for(size_t ii = len; ii-- > 0; ) {
+            buf[ii] = '0' + (value % 10);
+            value /= 10;
+        }
+        if (EXT_LEN) {
+            buf[len++] = '.';
+            memcpy(&buf[len], getExt(), EXT_LEN);
+            len += EXT_LEN;
+        }
+        buf[len] = 0;
+        return len;
+    }
+
+    /**
+     * @brief Parses a filename in the queue directory
+     * 
+     * @param name The filename, without a directory
+     * 
+     * @param fileNum Filled in with the file number
+     * 
+     * @return true if name is a file number with exactly the filename extension
+     */
+    static bool parseName(const char *name, int &fileNum) {
+        uint32_t value = 0;
+        int numDigits = 0;
+        const char *cp = name;
+
+        while(*cp >= '0' && *cp <= '9') {
+            // Checked before multiplying, since 10 digits can overflow uint32_t
+            uint32_t digit = *cp++ - '0';
+            if (++numDigits > 10 || value > (0x7fffffff - digit) / 10) {
+                return false;
+            }
+            value = value * 10 + digit;
+        }
+        if (numDigits == 0) {
+            return false;
+        }
+        if (EXT_LEN) {
+            if (*cp++ != '.' || memcmp(cp, getExt(), EXT_LEN) != 0) {
+                return false;
+            }
+            cp += EXT_LEN;
+        }
+        if (*cp != 0) {
+            return false;
+        }
+        fileNum = (int) value;
+        return true;
+    }
+
+    /**
+     * @brief Formats the pathname for fileNum into a stack buffer
+     * 
+     * @param fileNum The file number
+     * 
+     * @param buf A char array. The array size is known at compile time.
+     * 
+     * @return false if the pathname does not fit, for example if withDirPath() is very long.
+     * 
+     * This is the same as getPathForFileNum(), but the filename is formatted inline.
+     */
+    template<size_t N>
+    bool formatPath(int fileNum, char (&buf)[N]) const {
+        size_t dirLen;
+
+        if (shardSize > 0) {
+            if (!getShardPath(getShardForFileNum(fileNum), buf, N)) {
+                return false;
+            }
+            dirLen = strlen(buf);
+        }
+        else {
+            dirLen = dirPath.length();
+            if (dirLen >= N) {
+                return false;
+            }
+            memcpy(buf, dirPath.c_str(), dirLen);
+        }
+
+        if (dirLen + 1 + NAME_BUF_SIZE > N) {
+            return false;
+        }
+        buf[dirLen++] = '/';
+        formatName(fileNum, &buf[dirLen]);
+        return true;
+    }
+
+protected:
+    /**
+     * @brief 10 to the power n, evaluated at compile time for constant n
+     */
+    static constexpr unsigned int pow10(int n) {
+        return (n <= 0) ? 1 : 10 * pow10(n - 1);
+    }
 };
 
 #endif // __SEQUENTIALFILERK_H
@@ -0,0 +1,351 @@
+#include "SequentialSegmentFileRK.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+
+static Logger _log("app.seqfile");
+
+namespace {
+
+/**
+ * @brief Header before each record in a segment file. The crc is the CRC-32 of the record data.
+ */
+struct RecordHeader {
+    uint16_t magic;
+    uint16_t length;
+    uint32_t crc;
+};
+
+}
+
+
+SequentialSegmentFile::SequentialSegmentFile() {
+    segments.withFilenameExtension("seg");
+
+    os_mutex_create(&mutex);
+}
+
+SequentialSegmentFile::~SequentialSegmentFile() {
+    closeWriteSegment();
+    if (readFd >= 0) {
+        close(readFd);
+    }
+
+    os_mutex_destroy(mutex);
+}
+
+bool SequentialSegmentFile::scanDir(void) {
+    os_mutex_lock(mutex);
+
+    closeWriteSegment();
+    if (readFd >= 0) {
+        close(readFd);
+        readFd = -1;
+    }
+    readSegment = 0;
+    states.clear();
+
+    bool result = segments.scanDir();
+
+    os_mutex_unlock(mutex);
+
+    return result;
+}
+
+bool SequentialSegmentFile::addRecord(const void *data, size_t len) {
+    if (len + RECORD_HEADER_SIZE > segmentSize || len > 0xffff) {
+        _log.error("record too large %u", len);
+        return false;
+    }
+
+    bool result = false;
+
+    os_mutex_lock(mutex);
+
+    while(true) {
+        if (writeFd >= 0 && writeOffset + RECORD_HEADER_SIZE + len > segmentSize) {
+            // Records are not split, so start a new segment
+            closeWriteSegment();
+        }
+        if (writeFd >= 0 || reservedSegment != 0) {
+            break;
+        }
+
+        // Not reserved while holding mutex, since with withOverflowPolicy(BLOCK) this waits
+        // for a consumer to free space, and consumers need mutex
+        uint32_t curGeneration = generation;
+        os_mutex_unlock(mutex);
+        int segment = segments.reserveFile();
+        os_mutex_lock(mutex);
+
+        if (segment == 0) {
+            // Segment queue is full (SequentialFile::withMaxFiles())
+            break;
+        }
+        if (generation != curGeneration) {
+            // removeAll() was called, so the file number may be handed out again
+            continue;
+        }
+        if (reservedSegment == 0) {
+            reservedSegment = segment;
+        }
+        else {
+            // Another producer reserved one while the mutex was released
+            segments.removeFileNum(segment, false);
+        }
+    }
+
+    if (writeFd < 0 && reservedSegment != 0) {
+        int segment = reservedSegment;
+        reservedSegment = 0;
+        String path = segments.getPathForFileNum(segment);
+
+        writeFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (writeFd >= 0) {
+            writeSegment = segment;
+            writeOffset = syncedOffset = 0;
+
+            // Queued now so getRecordFromQueue() can read records before the segment is full
+            if (segments.addFileToQueue(segment)) {
+                states.push_back(SegmentState{segment, {}, false});
+                _log.trace("created segment %s", path.c_str());
+            }
+            else {
+                // Segment queue is full, and the file was removed
+                close(writeFd);
+                writeFd = -1;
+                writeSegment = 0;
+            }
+        }
+        else {
+            _log.error("failed to create %s errno=%d", path.c_str(), errno);
+        }
+    }
+
+    if (writeFd >= 0) {
+        RecordHeader hdr;
+        hdr.magic = RECORD_MAGIC;
+        hdr.length = (uint16_t) len;
+        hdr.crc = SequentialFile::crc32(data, len);
+
+        if (write(writeFd, &hdr, sizeof(hdr)) == sizeof(hdr) && write(writeFd, data, len) == (int)len) {
+            writeOffset += sizeof(hdr) + len;
+            if (syncEachRecord) {
+                fsync(writeFd);
+                syncedOffset = writeOffset;
+            }
+            result = true;
+        }
+        else {
+            // The partial record fails its CRC check and ends the segment when read
+            _log.error("failed to write record errno=%d", errno);
+            closeWriteSegment();
+        }
+    }
+
+    os_mutex_unlock(mutex);
+
+    return result;
+}
+
+void SequentialSegmentFile::sync() {
+    os_mutex_lock(mutex);
+    if (writeFd >= 0) {
+        fsync(writeFd);
+        syncedOffset = writeOffset;
+    }
+    os_mutex_unlock(mutex);
+}
+
+bool SequentialSegmentFile::getRecordFromQueue(SequentialSegmentRecord &record, void *buf, size_t bufSize) {
+    bool result = false;
+
+    os_mutex_lock(mutex);
+
+    while(true) {
+        if (readSegment == 0) {
+            readSegment = segments.getFileFromQueue();
+            if (readSegment == 0) {
+                break;
+            }
+            readOffset = 0;
+            readFd = open(segments.getPathForFileNum(readSegment), O_RDONLY);
+            if (!findState(readSegment)) {
+                // Segment files from before scanDir() are not in states yet
+                states.push_back(SegmentState{readSegment, {}, false});
+            }
+        }
+
+        bool isWriteSegment = (readSegment == writeSegment && writeFd >= 0);
+        if (isWriteSegment && readOffset >= syncedOffset) {
+            // Caught up with the producer
+            break;
+        }
+
+        int len = (readFd >= 0) ? readRecordAt(readFd, readOffset, buf, bufSize) : -1;
+        if (len >= 0) {
+            record.segment = readSegment;
+            record.offset = readOffset;
+            record.length = (uint16_t) len;
+            if ((size_t)len > bufSize) {
+                _log.error("record %d:%lu truncated to %u bytes", readSegment, (unsigned long)readOffset, bufSize);
+            }
+
+            readOffset += RECORD_HEADER_SIZE + len;
+            findState(readSegment)->unacked.push_back(record.offset);
+            result = true;
+            break;
+        }
+
+        if (isWriteSegment) {
+            break;
+        }
+
+        // End of the segment, or a record that was only partially written before a reset
+        if (readFd >= 0) {
+            close(readFd);
+            readFd = -1;
+        }
+        findState(readSegment)->fullyRead = true;
+
+        int segment = readSegment;
+        readSegment = 0;
+        reclaimIfDone(segment);
+    }
+
+    os_mutex_unlock(mutex);
+
+    return result;
+}
+
+bool SequentialSegmentFile::readRecord(const SequentialSegmentRecord &record, void *buf, size_t bufSize) {
+    int fd = open(segments.getPathForFileNum(record.segment), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    int len = readRecordAt(fd, record.offset, buf, bufSize);
+    close(fd);
+
+    return len >= 0 && (size_t)len <= bufSize;
+}
+
+void SequentialSegmentFile::ackRecord(const SequentialSegmentRecord &record) {
+    os_mutex_lock(mutex);
+
+    SegmentState *state = findState(record.segment);
+    if (state) {
+        // Usually acknowledged in the order read, so the offset is near the front. A record
+        // that was already acknowledged is not found, so a retried ack is ignored.
+        for(auto it = state->unacked.begin(); it != state->unacked.end(); it++) {
+            if (*it == record.offset) {
+                state->unacked.erase(it);
+                reclaimIfDone(record.segment);
+                break;
+            }
+        }
+    }
+
+    os_mutex_unlock(mutex);
+}
+
+void SequentialSegmentFile::removeAll(bool removeDir) {
+    os_mutex_lock(mutex);
+
+    closeWriteSegment();
+    if (readFd >= 0) {
+        close(readFd);
+        readFd = -1;
+    }
+    readSegment = 0;
+    states.clear();
+    // File numbers start over
+    reservedSegment = 0;
+    generation++;
+
+    segments.removeAll(removeDir);
+
+    os_mutex_unlock(mutex);
+}
+
+int SequentialSegmentFile::getSegmentCount() const {
+    os_mutex_lock(mutex);
+    int count = segments.getQueueLen() + ((readSegment != 0) ? 1 : 0);
+    os_mutex_unlock(mutex);
+
+    return count;
+}
+
+void SequentialSegmentFile::closeWriteSegment() {
+    if (writeFd >= 0) {
+        close(writeFd);
+        writeFd = -1;
+
+        // The segment may already be fully read and acknowledged
+        int segment = writeSegment;
+        writeSegment = 0;
+        SegmentState *state = findState(segment);
+        if (state && segment == readSegment && readOffset >= writeOffset) {
+            state->fullyRead = true;
+            if (readFd >= 0) {
+                close(readFd);
+                readFd = -1;
+            }
+            readSegment = 0;
+        }
+        reclaimIfDone(segment);
+    }
+}
+
+SequentialSegmentFile::SegmentState *SequentialSegmentFile::findState(int segment) {
+    for(auto it = states.begin(); it != states.end(); it++) {
+        if (it->segment == segment) {
+            return &*it;
+        }
+    }
+    return NULL;
+}
+
+void SequentialSegmentFile::reclaimIfDone(int segment) {
+    for(auto it = states.begin(); it != states.end(); it++) {
+        if (it->segment == segment) {
+            if (it->fullyRead && it->unacked.empty() && segment != writeSegment) {
+                segments.removeFileNum(segment, false);
+                states.erase(it);
+            }
+            break;
+        }
+    }
+}
+
+// [static]
+int SequentialSegmentFile::readRecordAt(int fd, uint32_t offset, void *buf, size_t bufSize) {
+    RecordHeader hdr;
+
+    if (lseek(fd, offset, SEEK_SET) != (off_t)offset || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != RECORD_MAGIC) {
+        return -1;
+    }
+
+    // The whole record is read to check the CRC, even if buf is too small to hold it
+    uint8_t chunk[64];
+    uint32_t crc = 0;
+    size_t dataOffset = 0;
+
+    while(dataOffset < hdr.length) {
+        uint8_t *dst = (dataOffset < bufSize) ? &((uint8_t *)buf)[dataOffset] : chunk;
+        size_t count = (dataOffset < bufSize) ? (bufSize - dataOffset) : sizeof(chunk);
+        if (count > hdr.length - dataOffset) {
+            count = hdr.length - dataOffset;
+        }
+        if (read(fd, dst, count) != (int)count) {
+            return -1;
+        }
+        crc = SequentialFile::crc32(dst, count, crc);
+        dataOffset += count;
+    }
+
+    if (crc != hdr.crc) {
+        return -1;
+    }
+    return hdr.length;
+}
@@ -0,0 +1,250 @@
+#ifndef __SEQUENTIALSEGMENTFILERK_H
+#define __SEQUENTIALSEGMENTFILERK_H
+
+#include "SequentialFileRK.h"
+
+/**
+ * @brief Location of a record in a segment file
+ *
+ * Returned by SequentialSegmentFile::getRecordFromQueue() and passed to ackRecord().
+ */
+struct SequentialSegmentRecord {
+    int segment = 0;        //!< File number of the segment file
+    uint32_t offset = 0;    //!< Offset of the record header in the segment file
+    uint16_t length = 0;    //!< Length of the record data in bytes, not including the header
+};
+
+/**
+ * @brief Class for maintaining a queue of small records packed into segment files
+ *
+ * For small records, such as 50 - 200 byte telemetry payloads, one file per record wastes
+ * a flash block per record and requires an open, create, and close for each one. This class
+ * appends records to fixed-size segment files instead (00000001.seg, 00000002.seg, ...)
+ * with a small header containing the length and CRC-32 of each record.
+ *
+ * The segment files are managed by a SequentialFile, so they are in a queue directory and
+ * numbered the same way. You typically instantiate this class as a global variable. In
+ * global setup(), configure it using the withXXX() methods, then call the scanDir() method
+ * to read the queue from disk. You must use withDirPath() to set the queue directory!
+ *
+ * Producers call addRecord(). The code that processes records calls getRecordFromQueue()
+ * and then ackRecord() after processing the record successfully. A segment file is deleted
+ * once all of its records have been read and acknowledged.
+ *
+ * Acknowledgements are only kept in RAM, so after a reboot all of the records in segment
+ * files that have not been deleted are returned again, including records that were
+ * acknowledged. Delivery is at-least-once.
+ *
+ * It's safe to call addRecord(), getRecordFromQueue(), and ackRecord() from different
+ * threads. Locking is handled internally.
+ */
+class SequentialSegmentFile {
+public:
+    /**
+     * @brief Default constructor
+     */
+    SequentialSegmentFile();
+
+    /**
+     * @brief Destructor
+     */
+    virtual ~SequentialSegmentFile();
+
+    /**
+     * @brief Sets the directory to use as the queue directory. This is required!
+     *
+     * @param dirPath the pathname, Unix-style with / as the directory separator.
+     *
+     * See SequentialFile::withDirPath(). Only the segment files should be stored in
+     * this directory.
+     */
+    SequentialSegmentFile &withDirPath(const char *dirPath) { segments.withDirPath(dirPath); return *this; };
+
+    /**
+     * @brief Sets the maximum size of a segment file in bytes (default: 8192)
+     *
+     * @param segmentSize Size in bytes. A good value is a small multiple of the flash block size (4096).
+     *
+     * Records are not split across segment files, so a record can be at most segmentSize - 8 bytes.
+     */
+    SequentialSegmentFile &withSegmentSize(size_t segmentSize) { this->segmentSize = segmentSize; return *this; };
+
+    /**
+     * @brief Gets the maximum size of a segment file in bytes
+     */
+    size_t getSegmentSize() const { return segmentSize; };
+
+    /**
+     * @brief Sets whether addRecord() syncs the segment file to flash for each record (default: true)
+     *
+     * @param syncEachRecord true to sync after each record, false to sync only when a segment
+     * is full or sync() is called.
+     *
+     * Syncing each record guarantees that it's still there after a reset, but writes file
+     * metadata each time. If false, records that have not been synced are lost on reset, and
+     * are not returned by getRecordFromQueue() until they are synced.
+     */
+    SequentialSegmentFile &withSyncEachRecord(bool syncEachRecord) { this->syncEachRecord = syncEachRecord; return *this; };
+
+    /**
+     * @brief Scans the queue directory for segment files. Typically called during setup().
+     *
+     * New records are always written to a new segment file after scanDir().
+     */
+    bool scanDir(void);
+
+    /**
+     * @brief Adds a record to the queue
+     *
+     * @param data Data to store
+     *
+     * @param len Length of data in bytes. Must be no larger than segmentSize - 8.
+     *
+     * @return true if the record was written
+     */
+    bool addRecord(const void *data, size_t len);
+
+    /**
+     * @brief Syncs the segment file being written so all records added so far are saved
+     *
+     * Only needed with withSyncEachRecord(false).
+     */
+    void sync();
+
+    /**
+     * @brief Gets the next record from the queue
+     *
+     * @param record Filled in with the location and length of the record. Pass this to
+     * ackRecord() after processing the record.
+     *
+     * @param buf Buffer to read the record data into
+     *
+     * @param bufSize Size of buf in bytes. If the record is larger, only bufSize bytes are
+     * copied, but record.length is the full length.
+     *
+     * @return true if a record was returned, false if there are no records in the queue.
+     */
+    bool getRecordFromQueue(SequentialSegmentRecord &record, void *buf, size_t bufSize);
+
+    /**
+     * @brief Reads a record again, for example to retry processing it
+     *
+     * @param record A record from getRecordFromQueue() that has not been acknowledged
+     *
+     * @param buf Buffer to read the record data into
+     *
+     * @param bufSize Size of buf in bytes
+     *
+     * @return true if the record was read and its CRC is valid
+     */
+    bool readRecord(const SequentialSegmentRecord &record, void *buf, size_t bufSize);
+
+    /**
+     * @brief Acknowledges a record from getRecordFromQueue()
+     *
+     * Once all records in a segment file have been read and acknowledged the file is deleted.
+     * Acknowledging a record more than once, or a record that was not returned by
+     * getRecordFromQueue(), has no effect.
+     */
+    void ackRecord(const SequentialSegmentRecord &record);
+
+    /**
+     * @brief Removes all of the segment files and records
+     *
+     * @param removeDir true to remove the queue directory itself, false to just remove the contents.
+     */
+    void removeAll(bool removeDir);
+
+    /**
+     * @brief Gets the number of segment files waiting to be read, including the one being read
+     */
+    int getSegmentCount() const;
+
+    /**
+     * @brief Gets the SequentialFile that manages the segment files
+     *
+     * You can use this for additional configuration, such as withIndexFile(). Don't change
+     * the filename extension, and don't use it to add or remove files.
+     */
+    SequentialFile &getSequentialFile() { return segments; };
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialSegmentFile(const SequentialSegmentFile&) = delete;
+
+    /**
+     * @brief This class is not copyable
+     */
+    SequentialSegmentFile& operator=(const SequentialSegmentFile&) = delete;
+
+    /**
+     * @brief Size of the header stored before each record in a segment file
+     */
+    static const size_t RECORD_HEADER_SIZE = 8;
+
+protected:
+    /**
+     * @brief State of a segment file that has been written or read since scanDir()
+     */
+    struct SegmentState {
+        int segment;            //!< File number of the segment file
+        std::vector<uint32_t> unacked;  //!< Offsets of records returned by getRecordFromQueue() and not acknowledged yet, in increasing order
+        bool fullyRead;         //!< All records in the segment file have been returned
+    };
+
+    /**
+     * @brief Closes the segment file being written, if any. Call with the mutex locked.
+     */
+    void closeWriteSegment();
+
+    /**
+     * @brief Gets the state for a segment, or NULL if it's not known. Call with the mutex locked.
+     */
+    SegmentState *findState(int segment);
+
+    /**
+     * @brief Deletes the segment file if all of its records have been read and acknowledged. Call with the mutex locked.
+     */
+    void reclaimIfDone(int segment);
+
+    /**
+     * @brief Reads a record header and data at offset in fd
+     *
+     * @return The length of the record data, or -1 if there is not a valid record at offset
+     */
+    static int readRecordAt(int fd, uint32_t offset, void *buf, size_t bufSize);
+
+    /**
+     * @brief Manages the segment files
+     */
+    SequentialFile segments;
+
+    size_t segmentSize = 8192;      //!< Maximum size of a segment file. Set using withSegmentSize().
+    bool syncEachRecord = true;     //!< Sync after each record. Set using withSyncEachRecord().
+
+    int writeSegment = 0;           //!< Segment file being written, or 0
+    int writeFd = -1;               //!< File descriptor of writeSegment, or -1
+    int reservedSegment = 0;        //!< Segment file number reserved for the next segment, or 0
+    uint32_t generation = 0;        //!< Incremented by removeAll(), which starts the file numbers over
+    uint32_t writeOffset = 0;       //!< Size of writeSegment
+    uint32_t syncedOffset = 0;      //!< Size of writeSegment as of the last sync
+
+    int readSegment = 0;            //!< Segment file being read, or 0
+    int readFd = -1;                //!< File descriptor of readSegment, or -1
+    uint32_t readOffset = 0;        //!< Offset of the next record in readSegment
+
+    /**
+     * @brief State of segment files written or read since scanDir(), in file number order
+     */
+    std::deque<SegmentState> states;
+
+    /**
+     * @brief Mutex that protects all of the state above
+     */
+    os_mutex_t mutex = 0;
+
+    static const uint16_t RECORD_MAGIC = 0x5253;    //!< "SR", at the start of each record header
+};
+
+#endif // __SEQUENTIALSEGMENTFILERK_H